@@ -0,0 +1,51 @@
+#!/bin/sh
+# Compare the backends that move file data (heartyfs_sh -o): write and
+# read throughput for a few file sizes with mmap, pread and uring, and
+# with pread and uring bypassing the page cache (-d). Each measurement
+# moves at least 64 MB.
+#
+# Usage: sh script/bench_backends.sh [image_size] [block_size] [size ...]
+
+IMAGE_SIZE=${1:-1G}
+BLOCK_SIZE=${2:-4K}
+[ $# -gt 2 ] && shift 2 || set -- 64K 1M 16M
+SRC=$(mktemp)
+WRITES=$(mktemp)
+READS=$(mktemp)
+trap 'rm -f "$SRC" "$WRITES" "$READS"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# Print bytes per elapsed nanoseconds as MB/s
+mb_per_sec() {
+    echo $(($1 * 1000 / ($2 > 0 ? $2 : 1)))
+}
+
+for size in "$@"; do
+    head -c "$size" /dev/urandom > "$SRC"
+    bytes=$(wc -c < "$SRC")
+    reps=$((64 * 1024 * 1024 / bytes))
+    [ "$reps" -ge 1 ] || reps=1
+    : > "$WRITES"
+    : > "$READS"
+    i=0
+    while [ $i -lt "$reps" ]; do
+        echo "write /bench$((i % 8)) $SRC" >> "$WRITES"
+        echo "read /bench$((i % 8))" >> "$READS"
+        i=$((i + 1))
+    done
+
+    for backend in mmap pread uring "pread -d" "uring -d"; do
+        bin/heartyfs_init -s "$IMAGE_SIZE" -b "$BLOCK_SIZE" || exit 1
+        start=$(now_ns)
+        bin/heartyfs_sh -o $backend "$WRITES" || exit 1
+        middle=$(now_ns)
+        bin/heartyfs_sh -o $backend "$READS" | cat > /dev/null
+        end=$(now_ns)
+        printf "%-4s x %-4d %-9s write %5d MB/s, read %5d MB/s\n" "$size" "$reps" "$backend" \
+               "$(mb_per_sec $((bytes * reps)) $((middle - start)))" \
+               "$(mb_per_sec $((bytes * reps)) $((end - middle)))"
+    done
+done
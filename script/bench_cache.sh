@@ -0,0 +1,103 @@
+#!/bin/sh
+# Measure the block cache and read-ahead.
+#
+# First, one heartyfs_sh process reads FILES files of SIZE bytes PASSES
+# times over through the copying backends, with and without the page
+# cache (-d), with the block cache off (-c 0) and then at its default size,
+# and prints the read throughput and cache hit rate.
+#
+# Then a 64 MB file is written into the holes left by removing every other
+# one of 3000 small files, and read back ROUNDS times with each backend,
+# each time with the image dropped from the page cache first (GNU dd
+# iflag=nocache), so that every read goes to the disk along the file's
+# scattered extents.
+#
+# Usage: sh script/bench_cache.sh [files] [size] [passes] [rounds]
+
+FILES=${1:-8}
+SIZE=${2:-1M}
+PASSES=${3:-128}
+ROUNDS=${4:-5}
+SRC=$(mktemp)
+SCRIPT=$(mktemp)
+STATS=$(mktemp)
+OUT=$(mktemp)
+trap 'rm -f "$SRC" "$SCRIPT" "$STATS" "$OUT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# The value of counter $1 in the stats printed at the end of $OUT
+counter() {
+    tail -c 1000 "$OUT" | grep -a "^$1 " | cut -d' ' -f2
+}
+
+head -c "$SIZE" /dev/urandom > "$SRC"
+bytes=$(wc -c < "$SRC")
+bin/heartyfs_init -s 256M -b 4K > /dev/null || exit 1
+i=0
+while [ $i -lt "$FILES" ]; do
+    echo "write /file$i $SRC"
+    i=$((i + 1))
+done | bin/heartyfs_sh || exit 1
+
+: > "$SCRIPT"
+pass=0
+while [ $pass -lt "$PASSES" ]; do
+    i=0
+    while [ $i -lt "$FILES" ]; do
+        echo "read /file$i" >> "$SCRIPT"
+        i=$((i + 1))
+    done
+    pass=$((pass + 1))
+done
+cp "$SCRIPT" "$STATS"
+echo stats >> "$STATS"
+
+total=$((bytes * FILES * PASSES))
+for backend in pread uring "pread -d" "uring -d"; do
+    for cache in 0 16384; do
+        start=$(now_ns)
+        bin/heartyfs_sh -o $backend -c $cache "$SCRIPT" | cat > /dev/null
+        end=$(now_ns)
+        bin/heartyfs_sh -o $backend -c $cache "$STATS" > "$OUT"
+        hits=$(counter cache_hits)
+        misses=$(counter cache_misses)
+        printf "%-9s cache %5d KiB: %5d MB/s, hit rate %3d%%\n" "$backend" "$cache" \
+               "$((total * 1000 / (end - start)))" \
+               "$((hits * 100 / (hits + misses > 0 ? hits + misses : 1)))"
+    done
+done
+
+head -c 32K /dev/urandom > "$SRC"
+bin/heartyfs_init -s 128M -b 4K > /dev/null || exit 1
+{
+    i=0
+    while [ $i -lt 3000 ]; do
+        echo "write /small$i $SRC"
+        i=$((i + 1))
+    done
+    i=0
+    while [ $i -lt 3000 ]; do
+        echo "rm /small$i"
+        i=$((i + 2))
+    done
+} | bin/heartyfs_sh || exit 1
+head -c 64M /dev/urandom > "$SRC"
+echo "write /big $SRC" | bin/heartyfs_sh || exit 1
+sync
+
+for backend in mmap pread uring; do
+    elapsed=0
+    round=0
+    while [ $round -lt "$ROUNDS" ]; do
+        dd if=/tmp/heartyfs iflag=nocache count=0 2> /dev/null
+        start=$(now_ns)
+        printf "read /big\nstats\n" | bin/heartyfs_sh -o $backend > "$OUT"
+        elapsed=$((elapsed + $(now_ns) - start))
+        round=$((round + 1))
+    done
+    printf "%-5s cold fragmented read: %4d ms, %d blocks read ahead\n" "$backend" \
+           "$((elapsed / ROUNDS / 1000000))" "$(counter readahead_blocks)"
+done
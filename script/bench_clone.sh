@@ -0,0 +1,70 @@
+#!/bin/sh
+# Measure clones and snapshots: copy a SIZE file with heartyfs_cp and with
+# heartyfs_cp --reflink, then snapshot a tree of DIRS directories of FILES
+# files of up to 64K each, printing the time taken and the blocks used
+# by each, then check that the snapshot cannot be modified, however the
+# path to it is spelled.
+#
+# Usage: sh script/bench_clone.sh [size] [dirs] [files]
+
+SIZE=${1:-256M}
+DIRS=${2:-20}
+FILES=${3:-100}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+used() {
+    echo df | bin/heartyfs_sh | grep '^used ' | cut -d' ' -f2
+}
+
+# Run a command, printing what it took and the blocks it added
+measure() {
+    label=$1
+    shift
+    before=$(used)
+    start=$(now_ns)
+    "$@" > /dev/null || exit 1
+    end=$(now_ns)
+    printf "%-16s %6d ms, %7d blocks\n" "$label:" "$(((end - start) / 1000000))" \
+           "$(($(used) - before))"
+}
+
+head -c "$(echo "$SIZE" | numfmt --from=iec)" /dev/urandom > "$DIR/big"
+bin/heartyfs_init -s 1G -b 4K > /dev/null || exit 1
+echo "write /big $DIR/big" | bin/heartyfs_sh || exit 1
+measure "cp $SIZE" bin/heartyfs_cp /big /copy
+measure "cp --reflink" bin/heartyfs_cp --reflink /big /clone
+
+i=0
+while [ $i -lt "$FILES" ]; do
+    head -c $(($(od -An -N2 -tu2 /dev/urandom) + 1)) /dev/urandom > "$DIR/f$i"
+    i=$((i + 1))
+done
+d=0
+while [ $d -lt "$DIRS" ]; do
+    echo "mkdir /d$d"
+    i=0
+    while [ $i -lt "$FILES" ]; do
+        echo "write /d$d/f$i $DIR/f$i"
+        i=$((i + 1))
+    done
+    d=$((d + 1))
+done | bin/heartyfs_sh -g 64 || exit 1
+measure "snapshot" bin/heartyfs_snapshot first
+measure "snapshot again" bin/heartyfs_snapshot second
+
+# Every one of these must fail with EROFS and leave the snapshot as it was
+for cmd in "rm /.snapshots/first/d0/f0" "rm /./.snapshots/first/d0/f0" \
+           "write /d0/../.snapshots/first/d0/g $DIR/f0" "mkdir /d0/../.snapshots/first/x" \
+           "rmdir /./.snapshots"; do
+    if ! echo "$cmd" | bin/heartyfs_sh 2>&1 | grep -q "Read-only file system"; then
+        echo "snapshot modified by: $cmd" >&2
+        exit 1
+    fi
+done
+bin/heartyfs_read /.snapshots/first/d0/f0 | cmp -s - "$DIR/f0" || exit 1
+echo "snapshot read-only: ok"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compare two runs of heartyfs_bench (make bench > run.json): for every
+# operation, print throughput and latency percentiles of both and how
+# much they changed.
+#
+# Usage: sh script/bench_compare.sh before.json after.json
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 before.json after.json" >&2
+    exit 1
+fi
+
+# One line per operation: name ops_per_sec p50 p99 p999 (in us)
+extract() {
+    sed -n 's/^ *"\([a-z]*\)": {"count".*"ops_per_sec": \([0-9.]*\).*"p50": \([0-9]*\), "p90": [0-9]*, "p99": \([0-9]*\), "p999": \([0-9]*\).*/\1 \2 \3 \4 \5/p' "$1"
+}
+
+extract "$1" > "$1.ops.$$"
+extract "$2" | awk '
+function change(a, b) { return a == 0 ? 0 : (b - a) * 100 / a }
+NR == FNR {
+    for (i = 2; i <= 5; i++) {
+        before[$1, i] = $i
+    }
+    next
+}
+FNR == 1 {
+    printf "%-6s %21s %21s %21s %21s\n", "op", "ops/s", "p50 us", "p99 us", "p999 us"
+}
+($1, 2) in before {
+    printf "%-6s", $1
+    for (i = 2; i <= 5; i++) {
+        scale = i == 2 ? 1 : 1000
+        printf " %8.1f>%-8.1f%+4.0f%%", before[$1, i] / scale, $i / scale, change(before[$1, i], $i)
+    }
+    printf "\n"
+}' "$1.ops.$$" -
+rm -f "$1.ops.$$"
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Measure compressed files: a text file of SIZE bytes, made of the headers
+# and documentation installed on this machine, is written plain and then
+# compressed (heartyfs_sh -z), and for each the blocks it takes and the
+# write throughput are printed. Then each is read back ROUNDS times with
+# each backend, hot and then cold (the image dropped from the page cache
+# first, with GNU dd iflag=nocache), and the read throughput printed.
+#
+# Usage: sh script/bench_compress.sh [size] [rounds]
+
+SIZE=${1:-64M}
+ROUNDS=${2:-5}
+SRC=$(mktemp)
+trap 'rm -f "$SRC"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# The text repeats if there is not enough of it
+: > "$SRC"
+while [ "$(wc -c < "$SRC")" -lt "$(echo "$SIZE" | numfmt --from=iec)" ]; do
+    find /usr/include /usr/share/doc -type f \( -name '*.h' -o -name '*.txt' -o \
+         -name 'copyright' -o -name 'README*' \) 2> /dev/null | sort | xargs cat >> "$SRC"
+done
+head -c "$SIZE" "$SRC" > "$SRC.cut" && mv "$SRC.cut" "$SRC"
+bytes=$(wc -c < "$SRC")
+
+bin/heartyfs_init -s 512M -b 4K > /dev/null || exit 1
+for mode in plain z; do
+    flag=$([ $mode = z ] && echo -z)
+    before=$(echo df | bin/heartyfs_sh | grep '^used ' | cut -d' ' -f2)
+    start=$(now_ns)
+    echo "write /$mode $SRC" | bin/heartyfs_sh $flag || exit 1
+    end=$(now_ns)
+    used=$(($(echo df | bin/heartyfs_sh | grep '^used ' | cut -d' ' -f2) - before))
+    printf "%-5s write: %5d blocks, ratio %d.%02d, %5d MB/s\n" "$mode" "$used" \
+           "$((bytes / (used * 4096)))" "$((bytes * 100 / (used * 4096) % 100))" \
+           "$((bytes * 1000 / (end - start)))"
+done
+
+for backend in mmap pread; do
+    for temp in hot cold; do
+        for mode in plain z; do
+            elapsed=0
+            round=0
+            while [ $round -lt "$ROUNDS" ]; do
+                if [ $temp = cold ]; then
+                    dd if=/tmp/heartyfs iflag=nocache count=0 2> /dev/null
+                fi
+                start=$(now_ns)
+                echo "read /$mode" | bin/heartyfs_sh -o $backend | cat > /dev/null
+                elapsed=$((elapsed + $(now_ns) - start))
+                round=$((round + 1))
+            done
+            printf "%-5s %-4s read %-5s: %5d MB/s\n" "$backend" "$temp" "$mode" \
+                   "$((bytes * ROUNDS * 1000 / elapsed))"
+        done
+    done
+done
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compare per-operation latency through heartyfsd with launching the
+# heartyfs_* tools: heartyfsd_load runs ROUNDS rounds of mkdir, creat,
+# write, read, rm and rmdir from 1 and then CLIENTS clients both ways and
+# prints the median and 99th percentile of each. The image is checked
+# with heartyfs_df -c afterwards.
+#
+# Usage: sh script/bench_daemon.sh [rounds] [clients] [threads]
+
+ROUNDS=${1:-200}
+CLIENTS=${2:-4}
+THREADS=${3:-4}
+
+bin/heartyfs_init -s 256M -b 4K || exit 1
+bin/heartyfsd -t "$THREADS" &
+daemon=$!
+trap 'kill $daemon 2> /dev/null' EXIT
+while [ ! -S /tmp/heartyfsd.sock ]; do
+    sleep 0.1
+done
+
+bin/heartyfsd_load -n "$ROUNDS" -c 1 || exit 1
+echo
+bin/heartyfsd_load -n "$ROUNDS" -c "$CLIENTS" || exit 1
+kill $daemon
+wait $daemon
+bin/heartyfs_df -c > /dev/null || exit 1
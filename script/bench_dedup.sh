@@ -0,0 +1,57 @@
+#!/bin/sh
+# Measure deduplication: COPIES directories each get the same FILES files
+# of random sizes up to MAX bytes (the same configuration deployed many
+# times), then a single copy of the same amount of random data, which has
+# nothing to share. Both are written with each backend, without and with
+# dedup (heartyfs_sh -D), and the blocks they take and the write
+# throughput are printed.
+#
+# Usage: sh script/bench_dedup.sh [copies] [files] [max]
+
+COPIES=${1:-20}
+FILES=${2:-50}
+MAX=${3:-256K}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+max=$(echo "$MAX" | numfmt --from=iec)
+i=0
+while [ $i -lt "$FILES" ]; do
+    head -c $((max / 2 + $(od -An -N4 -tu4 /dev/urandom) % (max / 2))) /dev/urandom > "$DIR/f$i"
+    i=$((i + 1))
+done
+bytes=$(cat "$DIR"/f* | wc -c)
+head -c $((bytes * COPIES)) /dev/urandom > "$DIR/unique"
+
+for backend in mmap pread; do
+    for workload in copies unique; do
+        for flag in "" -D; do
+            bin/heartyfs_init -s 1G -b 4K > /dev/null || exit 1
+            if [ $workload = copies ]; then
+                c=0
+                while [ $c -lt "$COPIES" ]; do
+                    echo "mkdir /c$c/"
+                    i=0
+                    while [ $i -lt "$FILES" ]; do
+                        echo "write /c$c/f$i $DIR/f$i"
+                        i=$((i + 1))
+                    done
+                    c=$((c + 1))
+                done > "$SCRIPT"
+            else
+                echo "write /unique $DIR/unique" > "$SCRIPT"
+            fi
+            start=$(now_ns)
+            bin/heartyfs_sh -o $backend $flag "$SCRIPT" || exit 1
+            end=$(now_ns)
+            used=$(echo df | bin/heartyfs_sh | grep '^used ' | cut -d' ' -f2)
+            printf "%-5s %-6s %-2s: %6d blocks, %5d MB/s\n" "$backend" "$workload" "$flag" \
+                   "$used" "$((bytes * COPIES * 1000 / (end - start)))"
+        done
+    done
+done
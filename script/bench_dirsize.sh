@@ -0,0 +1,53 @@
+#!/bin/sh
+# Time lookups against directory size: for each size, a directory of that
+# many empty files is created, then LOOKUPS distinct names that are not in
+# it are looked up. Every lookup misses the lookup cache and has to search
+# the directory, which is the worst case for a linear scan.
+#
+# Usage: sh script/bench_dirsize.sh [sizes...]
+# BLOCK_SIZE (default 4K), IMAGE_SIZE (default 256M) and LOOKUPS (default
+# 50000) may be set in the environment.
+
+BLOCK_SIZE=${BLOCK_SIZE:-4K}
+IMAGE_SIZE=${IMAGE_SIZE:-256M}
+LOOKUPS=${LOOKUPS:-50000}
+SIZES=${*:-10 100 1000 10000 50000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# Time heartyfs_sh running SCRIPT, less the cost of starting it up
+run_ns() {
+    start=$(now_ns)
+    bin/heartyfs_sh /dev/null
+    startup=$(($(now_ns) - start))
+    start=$(now_ns)
+    bin/heartyfs_sh "$SCRIPT" > /dev/null 2>&1
+    echo $(($(now_ns) - start - startup))
+}
+
+for size in $SIZES; do
+    bin/heartyfs_init -s "$IMAGE_SIZE" -b "$BLOCK_SIZE" || exit 1
+    {
+        echo "mkdir /d"
+        i=0
+        while [ $i -lt "$size" ]; do
+            echo "creat /d/file$i"
+            i=$((i + 1))
+        done
+    } > "$SCRIPT"
+    create_ns=$(run_ns)
+
+    i=0
+    while [ $i -lt "$LOOKUPS" ]; do
+        echo "read /d/missing$i"
+        i=$((i + 1))
+    done > "$SCRIPT"
+    lookup_ns=$(run_ns)
+
+    printf "%6d entries: create %7d ns, lookup %6d ns\n" \
+           "$size" $((create_ns / size)) $((lookup_ns / LOOKUPS))
+done
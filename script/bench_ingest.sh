@@ -0,0 +1,44 @@
+#!/bin/sh
+# Measure how fast heartyfs_write copies large sources in, without the
+# cost of flushing them: the image is moved to tmpfs (behind a symlink at
+# the usual path) so that msync has nothing to write back.
+#
+# Usage: sh script/bench_ingest.sh [size ...]
+
+IMAGE=/tmp/heartyfs
+SHM_IMAGE=/dev/shm/heartyfs.bench
+[ $# -gt 0 ] || set -- 16M 64M 256M
+SRC=$(mktemp)
+WRITES=$(mktemp)
+trap 'rm -f "$SRC" "$WRITES" "$SHM_IMAGE" "$IMAGE"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+rm -f "$IMAGE"
+if [ -d /dev/shm ]; then
+    ln -s "$SHM_IMAGE" "$IMAGE"
+else
+    echo "No /dev/shm, timings include flushing" >&2
+fi
+
+for size in "$@"; do
+    head -c "$size" /dev/urandom > "$SRC"
+    bytes=$(wc -c < "$SRC")
+    reps=$((1024 * 1024 * 1024 / bytes))
+    [ "$reps" -ge 1 ] || reps=1
+    i=0
+    : > "$WRITES"
+    while [ $i -lt "$reps" ]; do
+        echo "write /bench $SRC" >> "$WRITES"
+        i=$((i + 1))
+    done
+
+    bin/heartyfs_init -s $((bytes * 3)) -b "${BLOCK_SIZE:-4K}" || exit 1
+    cat "$SRC" > /dev/null  # Warm the page cache
+    start=$(now_ns)
+    bin/heartyfs_sh "$WRITES" || exit 1
+    elapsed_ns=$(($(now_ns) - start))
+    echo "$size x $reps: $((bytes * reps * 1000 / elapsed_ns)) MB/s"
+done
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Time heartyfs_init and report the space the host file takes up for a
+# range of image sizes.
+#
+# Usage: sh script/bench_init.sh [size ...]
+
+IMAGE=/tmp/heartyfs
+[ $# -gt 0 ] || set -- 1M 64M 256M 1G 4G
+
+now_ns() {
+    date +%s%N
+}
+
+for size in "$@"; do
+    rm -f "$IMAGE"
+    start=$(now_ns)
+    bin/heartyfs_init -s "$size" || exit 1
+    elapsed_us=$((($(now_ns) - start) / 1000))
+    echo "$size: ${elapsed_us} us, $(du -k "$IMAGE" | cut -f1) KiB allocated"
+done
+rm -f "$IMAGE"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Measure small files: write FILES files of SIZE bytes (small enough by
+# default to be kept in their inodes) into a fresh image, print how many
+# blocks they take, then time reading all of them back ROUNDS times.
+#
+# Usage: sh script/bench_inline.sh [files] [size] [rounds]
+
+FILES=${1:-10000}
+SIZE=${2:-20}
+ROUNDS=${3:-5}
+SRC=$(mktemp)
+SCRIPT=$(mktemp)
+trap 'rm -f "$SRC" "$SCRIPT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+head -c "$SIZE" /dev/urandom > "$SRC"
+bin/heartyfs_init -s 64M > /dev/null || exit 1
+i=0
+while [ $i -lt "$FILES" ]; do
+    echo "write /file$i $SRC"
+    i=$((i + 1))
+done | bin/heartyfs_sh -g 64 || exit 1
+used=$(echo df | bin/heartyfs_sh | grep '^used ' | cut -d' ' -f2)
+echo "$FILES files of $SIZE bytes: $used blocks used"
+
+: > "$SCRIPT"
+i=0
+while [ $i -lt "$FILES" ]; do
+    echo "read /file$i" >> "$SCRIPT"
+    i=$((i + 1))
+done
+for backend in mmap pread; do
+    elapsed=0
+    round=0
+    while [ $round -lt "$ROUNDS" ]; do
+        start=$(now_ns)
+        bin/heartyfs_sh -o $backend "$SCRIPT" | cat > /dev/null
+        elapsed=$((elapsed + $(now_ns) - start))
+        round=$((round + 1))
+    done
+    printf "%-5s read: %4d ms\n" "$backend" "$((elapsed / ROUNDS / 1000000))"
+done
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Measure write and read throughput of heartyfs_sh for a range of file
+# sizes. Small files are written and read many times over so that each
+# measurement moves at least 64 MB.
+#
+# Usage: sh script/bench_io.sh [image_size] [block_size] [size ...]
+
+IMAGE_SIZE=${1:-1G}
+BLOCK_SIZE=${2:-4K}
+[ $# -gt 2 ] && shift 2 || set -- 1K 64K 1M 16M 256M
+SRC=$(mktemp)
+WRITES=$(mktemp)
+READS=$(mktemp)
+trap 'rm -f "$SRC" "$WRITES" "$READS"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# Print bytes per elapsed nanoseconds as MB/s
+mb_per_sec() {
+    echo $(($1 * 1000 / ($2 > 0 ? $2 : 1)))
+}
+
+for size in "$@"; do
+    head -c "$size" /dev/urandom > "$SRC" 2>/dev/null ||
+        dd if=/dev/urandom of="$SRC" bs="$size" count=1 2>/dev/null
+    bytes=$(wc -c < "$SRC")
+    reps=$((64 * 1024 * 1024 / bytes))
+    [ "$reps" -ge 1 ] || reps=1
+    [ "$reps" -le 1000 ] || reps=1000
+    : > "$WRITES"
+    : > "$READS"
+    i=0
+    while [ $i -lt "$reps" ]; do
+        echo "write /bench $SRC" >> "$WRITES"
+        echo "read /bench" >> "$READS"
+        i=$((i + 1))
+    done
+
+    bin/heartyfs_init -s "$IMAGE_SIZE" -b "$BLOCK_SIZE" || exit 1
+    start=$(now_ns)
+    bin/heartyfs_sh "$WRITES" || exit 1
+    middle=$(now_ns)
+    bin/heartyfs_sh "$READS" | cat > /dev/null
+    end=$(now_ns)
+    echo "$size x $reps: write $(mb_per_sec $((bytes * reps)) $((middle - start))) MB/s," \
+         "read $(mb_per_sec $((bytes * reps)) $((end - middle))) MB/s"
+done
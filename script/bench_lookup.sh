@@ -0,0 +1,55 @@
+#!/bin/sh
+# Time path resolution: a file at depth DEPTH, with every directory on the
+# way holding FANOUT entries, is read LOOKUPS times by one heartyfs_sh and
+# then by one process per lookup. Reads of an empty file cost little
+# beyond the lookup itself.
+#
+# Usage: sh script/bench_lookup.sh [lookups] [depth] [fanout]
+
+LOOKUPS=${1:-100000}
+DEPTH=${2:-8}
+FANOUT=${3:-100}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+bin/heartyfs_init -s 64M -b 4K || exit 1
+path=""
+level=0
+while [ $level -lt "$DEPTH" ]; do
+    i=0
+    while [ $i -lt "$FANOUT" ]; do
+        echo "creat $path/f$i"
+        i=$((i + 1))
+    done
+    path="$path/d$level"
+    echo "mkdir $path"
+    level=$((level + 1))
+done > "$SCRIPT"
+echo "creat $path/target" >> "$SCRIPT"
+bin/heartyfs_sh "$SCRIPT" || exit 1
+
+i=0
+while [ $i -lt "$LOOKUPS" ]; do
+    echo "read $path/target"
+    i=$((i + 1))
+done > "$SCRIPT"
+echo "stats" >> "$SCRIPT"
+start=$(now_ns)
+bin/heartyfs_sh "$SCRIPT" | grep dcache | tr '\n' ' '
+elapsed_ns=$(($(now_ns) - start))
+echo
+echo "heartyfs_sh: $LOOKUPS lookups, $((elapsed_ns / LOOKUPS)) ns each"
+
+PROCS=$((LOOKUPS / 100))
+start=$(now_ns)
+i=0
+while [ $i -lt "$PROCS" ]; do
+    bin/heartyfs_read "$path/target"
+    i=$((i + 1))
+done
+elapsed_ns=$(($(now_ns) - start))
+echo "one process per lookup: $PROCS lookups, $((elapsed_ns / PROCS / 1000)) us each"
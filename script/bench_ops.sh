@@ -0,0 +1,46 @@
+#!/bin/sh
+# Compare ops/sec of one process per operation against heartyfs_sh running
+# the same operations against a single mapping.
+#
+# Usage: sh script/bench_ops.sh [pairs]
+
+PAIRS=${1:-1000}
+OPS=$((PAIRS * 2))
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+report() {
+    elapsed_ns=$(($2 - $1))
+    echo "$3: $OPS ops in $((elapsed_ns / 1000000)) ms," \
+         "$((OPS * 1000000000 / elapsed_ns)) ops/sec"
+}
+
+bin/heartyfs_init || exit 1
+start=$(now_ns)
+i=0
+while [ $i -lt "$PAIRS" ]; do
+    bin/heartyfs_creat /bench > /dev/null
+    bin/heartyfs_rm /bench > /dev/null
+    i=$((i + 1))
+done
+report "$start" "$(now_ns)" "one process per op"
+
+bin/heartyfs_init || exit 1
+i=0
+while [ $i -lt "$PAIRS" ]; do
+    echo "creat /bench"
+    echo "rm /bench"
+    i=$((i + 1))
+done > "$SCRIPT"
+start=$(now_ns)
+bin/heartyfs_sh "$SCRIPT"
+report "$start" "$(now_ns)" "heartyfs_sh"
+
+bin/heartyfs_init || exit 1
+start=$(now_ns)
+bin/heartyfs_sh -g 64 "$SCRIPT"
+report "$start" "$(now_ns)" "heartyfs_sh -g 64"
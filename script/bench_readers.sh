@@ -0,0 +1,77 @@
+#!/bin/sh
+# Time concurrent readers: PROCS read-only heartyfs_sh processes each read
+# a small file READS times, first on their own and then while a writer
+# keeps rewriting that file and adding entries to its directory. Reads
+# that lose a race with the writer are counted as stale.
+#
+# Usage: sh script/bench_readers.sh [procs] [reads]
+
+PROCS=${1:-4}
+READS=${2:-200000}
+OPS=$((PROCS * READS))
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+report() {
+    elapsed_ns=$(($2 - $1))
+    stale=$(cat "$DIR"/err* | grep -c "Stale")
+    echo "$3: $OPS reads in $((elapsed_ns / 1000000)) ms," \
+         "$((OPS * 1000000000 / elapsed_ns)) reads/sec, $stale stale"
+}
+
+# Run the readers and wait for them; the writer, if any, is stopped once
+# they are done
+run_readers() {
+    p=0
+    pids=""
+    while [ $p -lt "$PROCS" ]; do
+        bin/heartyfs_sh -r "$DIR/reads" > /dev/null 2> "$DIR/err$p" &
+        pids="$pids $!"
+        p=$((p + 1))
+    done
+    wait $pids
+}
+
+head -c 16384 /dev/urandom > "$DIR/a"
+head -c 12288 /dev/urandom > "$DIR/b"
+{
+    echo "mkdir /d"
+    i=0
+    while [ $i -lt 1000 ]; do
+        echo "creat /d/f$i"
+        i=$((i + 1))
+    done
+    echo "creat /d/data"
+    echo "write /d/data $DIR/a"
+} > "$DIR/setup"
+i=0
+while [ $i -lt "$READS" ]; do
+    echo "read /d/data"
+    i=$((i + 1))
+done > "$DIR/reads"
+i=0
+while [ $i -lt 100000 ]; do
+    echo "write /d/data $DIR/b"
+    echo "write /d/data $DIR/a"
+    echo "creat /d/w$i"
+    i=$((i + 1))
+done > "$DIR/writes"
+
+bin/heartyfs_init -s 256M -b 4K || exit 1
+bin/heartyfs_sh "$DIR/setup" || exit 1
+start=$(now_ns)
+run_readers
+report "$start" "$(now_ns)" "$PROCS reader processes"
+
+bin/heartyfs_sh "$DIR/writes" 2> /dev/null &
+writer=$!
+start=$(now_ns)
+run_readers
+report "$start" "$(now_ns)" "$PROCS reader processes and a writer"
+kill $writer
+wait $writer 2> /dev/null
+bin/heartyfs_df -c > /dev/null || exit 1
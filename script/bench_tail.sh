@@ -0,0 +1,60 @@
+#!/bin/sh
+# Measure tail packing: write FILES files of random sizes up to MAX bytes
+# into a fresh image with 4K blocks, print how many blocks they take
+# against what their data needs, then time reading them all back ROUNDS
+# times.
+#
+# Usage: sh script/bench_tail.sh [files] [max] [rounds]
+
+FILES=${1:-5000}
+MAX=${2:-20000}
+ROUNDS=${3:-5}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+# The same sizes every run
+awk -v files="$FILES" -v max="$MAX" 'BEGIN {
+    srand(1);
+    for (i = 0; i < files; i++) print int(rand() * max) + 1
+}' > "$DIR/sizes"
+head -c "$MAX" /dev/urandom > "$DIR/data"
+bytes=0
+i=0
+while read -r size; do
+    head -c "$size" "$DIR/data" > "$DIR/$i"
+    bytes=$((bytes + size))
+    i=$((i + 1))
+done < "$DIR/sizes"
+
+bin/heartyfs_init -s 256M -b 4K > /dev/null || exit 1
+i=0
+while [ $i -lt "$FILES" ]; do
+    echo "write /file$i $DIR/$i"
+    i=$((i + 1))
+done | bin/heartyfs_sh -g 64 || exit 1
+used=$(echo df | bin/heartyfs_sh | grep '^used ' | cut -d' ' -f2)
+echo "$FILES files, $((bytes / 1024)) KiB: $used blocks used," \
+     "$((bytes * 100 / (used * 4096)))% of their space holds data"
+
+: > "$SCRIPT"
+i=0
+while [ $i -lt "$FILES" ]; do
+    echo "read /file$i" >> "$SCRIPT"
+    i=$((i + 1))
+done
+for backend in mmap pread; do
+    elapsed=0
+    round=0
+    while [ $round -lt "$ROUNDS" ]; do
+        start=$(now_ns)
+        bin/heartyfs_sh -o $backend "$SCRIPT" | cat > /dev/null
+        elapsed=$((elapsed + $(now_ns) - start))
+        round=$((round + 1))
+    done
+    printf "%-5s read: %4d ms\n" "$backend" "$((elapsed / ROUNDS / 1000000))"
+done
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Time concurrent writers: PROCS heartyfs_sh processes each create FILES
+# files, first each in a directory of its own and then all in one shared
+# directory, against one process creating them all. Every process checks
+# the image with heartyfs_df -c afterwards.
+#
+# Usage: sh script/bench_writers.sh [procs] [files]
+
+PROCS=${1:-4}
+FILES=${2:-2000}
+OPS=$((PROCS * FILES))
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+report() {
+    elapsed_ns=$(($2 - $1))
+    echo "$3: $OPS creates in $((elapsed_ns / 1000000)) ms," \
+         "$((OPS * 1000000000 / elapsed_ns)) ops/sec"
+}
+
+# Scripts for process p, creating in /d<p> or in /shared
+p=0
+while [ $p -lt "$PROCS" ]; do
+    echo "mkdir /d$p" >> "$DIR/setup"
+    i=0
+    while [ $i -lt "$FILES" ]; do
+        echo "creat /d$p/f$i" >> "$DIR/own$p"
+        echo "creat /shared/p${p}_$i" >> "$DIR/shared$p"
+        i=$((i + 1))
+    done
+    p=$((p + 1))
+done
+echo "mkdir /shared" >> "$DIR/setup"
+cat "$DIR"/own* > "$DIR/serial"
+
+bin/heartyfs_init -s 256M || exit 1
+bin/heartyfs_sh "$DIR/setup" || exit 1
+start=$(now_ns)
+bin/heartyfs_sh "$DIR/serial" || exit 1
+report "$start" "$(now_ns)" "1 process"
+
+for layout in own shared; do
+    bin/heartyfs_init -s 256M || exit 1
+    bin/heartyfs_sh "$DIR/setup" || exit 1
+    start=$(now_ns)
+    p=0
+    while [ $p -lt "$PROCS" ]; do
+        bin/heartyfs_sh "$DIR/$layout$p" &
+        p=$((p + 1))
+    done
+    wait
+    if [ "$layout" = own ]; then
+        report "$start" "$(now_ns)" "$PROCS processes, a directory each"
+    else
+        report "$start" "$(now_ns)" "$PROCS processes, one directory"
+    fi
+    bin/heartyfs_df -c > /dev/null || exit 1
+done
@@ -1,33 +1,724 @@
+#ifndef HEARTYFS_H
+#define HEARTYFS_H
+
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #define DISK_FILE_PATH "/tmp/heartyfs"
-#define BLOCK_SIZE (1 << 9)
-#define DISK_SIZE (1 << 20)
-#define NUM_BLOCK (DISK_SIZE / BLOCK_SIZE)
+#define DEFAULT_BLOCK_SIZE (1 << 9)
+#define DEFAULT_DISK_SIZE (1 << 20)
+#define MIN_BLOCK_SIZE (1 << 9)
+#define MAX_BLOCK_SIZE (1 << 16)
+
+#define SUPER_BLOCK 0
+#define SUPER_MAGIC 0x59545248U  // "HRTY"
+#define SUPER_VERSION 4
+
+#define MAX_NAME_LENGTH 27
+
+// Snapshots are read-only copies of the tree, kept in this directory under
+// the root (src/lib/heartyfs_snapshot.c)
+#define SNAPSHOT_DIR ".snapshots"
+
+#define INODE_TYPE_FILE 0
+#define INODE_TYPE_DIR 1
+#define INODE_TYPE_DIR_LEAF 2
+#define INODE_TYPE_DEAD 3  // A removed directory, until its block is reused
+
+// Block 0 describes the geometry of the image. Everything else is laid
+// out from it: the free bitmap (one bit per block, 1 = free), the
+// reference counts, the dedup index, then the journal, then the root
+// directory; the remaining blocks are allocatable.
+struct heartyfs_super {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int bitmap_start;
+    unsigned int bitmap_blocks;
+    unsigned int journal_start;
+    unsigned int journal_blocks;
+    unsigned int root_block;
+    unsigned int free_blocks;  // Set bits in the bitmap, kept up to date by the journal
+    unsigned int refcount_start;
+    unsigned int refcount_blocks;
+    unsigned int dedup_start;
+    unsigned int dedup_blocks;
+    unsigned int shared_refs;  // References to data blocks past the first, likewise
+};
+
+// A data block may be shared by several files (or several times by one).
+// Its reference count, one 16-bit entry per block in the blocks after the
+// bitmap, holds the references it has besides the first, and whether the
+// dedup index points at it. Blocks that are not shared have 0.
+#define REF_INDEXED 0x8000
+#define REF_MAX 0x7fff
+#define REFS_PER_BLOCK(bs) (int)((bs) / sizeof(uint16_t))
+
+// The dedup index maps hashes of data blocks to blocks holding that data,
+// in buckets of DEDUP_WAYS entries filling the dedup blocks. It is only a
+// hint: an entry counts if its block is still indexed (REF_INDEXED) and
+// holds the same data, which is checked before the block is shared.
+#define DEDUP_WAYS 8
+
+struct heartyfs_dedup_entry {
+    unsigned int hash;      // High half of the 64-bit hash of the block
+    int block;              // Or 0
+};
 
 struct heartyfs_dir_entry {
     int block_id;           // 4 bytes
     char file_name[28];     // 28 bytes
 };  // Overall: 32 bytes
 
+// Directories, inodes and data blocks fill a whole block; how many entries,
+// pointers or bytes fit depends on the block size of the image
+// A directory starts out as one block of entries. When that fills up, all
+// but "." and ".." move to leaf blocks (laid out the same way) found
+// through a hash index of up to two levels.
 struct heartyfs_directory {
     int type;               // 4 bytes
     char name[28];          // 28 bytes
-    int size;               // 4 bytes
-    struct heartyfs_dir_entry entries[14]; // 448 bytes
-};  // Overall: 512 bytes
+    int size;               // Entries in use in this block
+    int index;              // Root block of the hash index, or 0
+    int count;              // Entries in the whole directory (first block only)
+    int tail_block;         // Where tails of its files are packed, or 0 (likewise)
+    struct heartyfs_dir_entry entries[]; // 14 entries in a 512-byte block
+};
+
+// An index block maps hash ranges to blocks: entry i covers names whose
+// hash is at least entries[i].hash and less than entries[i + 1].hash
+struct heartyfs_dir_index_entry {
+    unsigned int hash;
+    int block;
+};
 
+struct heartyfs_dir_index {
+    int depth;              // 1: entries point at leaves, 2: at index blocks
+    int size;               // Entries in use, sorted by hash
+    struct heartyfs_dir_index_entry entries[]; // 63 entries in a 512-byte block
+};
+
+// A run of consecutive blocks
+struct heartyfs_extent {
+    int start;              // First block of the run
+    int length;             // Number of blocks in it
+};
+
+// Bytes of a tail block making up the end of a file
+struct heartyfs_tail {
+    int block;              // Tail block, or 0 if the file has no tail
+    unsigned short offset;  // Into its data
+    unsigned short length;
+};
+
+// The first extents of a file are kept in the inode. The next ones go in
+// the indirect block, a block full of extents, and the rest in blocks of
+// extents found through the double-indirect block, a block of pointers.
+// Unused pointers are 0. A last block that would be no more than half
+// full is packed into a tail block instead, after the extents.
+//
+// A file small enough (INLINE_BYTES) is kept in the inode instead: with
+// INODE_INLINE set, size is its length in bytes and the data takes the
+// place of the extents. With INODE_COMPRESSED set, each data block holds
+// a stream of compressed data (see heartyfs_lz.c), and its size is the
+// length of the stream.
 struct heartyfs_inode {
     int type;               // 4 bytes
     char name[28];          // 28 bytes
-    int size;               // 4 bytes
-    int data_blocks[119];   // 476 bytes
-};  // Overall: 512 bytes
+    int size;               // Number of extents in use, over all levels
+    int indirect;           // 4 bytes
+    int double_indirect;    // 4 bytes
+    int flags;              // INODE_INLINE, INODE_COMPRESSED
+    struct heartyfs_tail tail;        // 8 bytes
+    struct heartyfs_extent extents[]; // 57 extents in a 512-byte block
+};
+
+#define INODE_INLINE 0x1
+#define INODE_COMPRESSED 0x2
 
 struct heartyfs_data_block {
     int size;               // 4 bytes
-    char data[508];         // 508 bytes
-};  // Overall: 512 bytes
+    char data[];            // 508 bytes in a 512-byte block
+};
+
+// The tails of files in one directory, packed one after another. Space is
+// handed out from the front and only reused once every tail in the block
+// has been released; a block the directory has moved on from is freed
+// then.
+struct heartyfs_tail_block {
+    int dir;                // Directory packing tails here, or 0
+    int used;               // Bytes of data handed out
+    int live;               // Bytes of them still part of a file
+    char data[];            // 500 bytes in a 512-byte block
+};
+
+#define DIR_ENTRIES(bs) \
+    (int)(((bs) - sizeof(struct heartyfs_directory)) / sizeof(struct heartyfs_dir_entry))
+#define INODE_EXTENTS(bs) \
+    (int)(((bs) - sizeof(struct heartyfs_inode)) / sizeof(struct heartyfs_extent))
+#define INLINE_BYTES(bs) (int)((bs) - sizeof(struct heartyfs_inode))
+#define INDEX_ENTRIES(bs) \
+    (int)(((bs) - sizeof(struct heartyfs_dir_index)) / sizeof(struct heartyfs_dir_index_entry))
+#define EXTENTS_PER_BLOCK(bs) (int)((bs) / sizeof(struct heartyfs_extent))
+#define POINTERS_PER_BLOCK(bs) (int)((bs) / sizeof(int))
+#define DATA_PAYLOAD(bs) (int)((bs) - sizeof(struct heartyfs_data_block))
+#define TAIL_BYTES(bs) (int)((bs) - sizeof(struct heartyfs_tail_block))
+
+// The first journal block holds the header; the rest is a log of
+// transactions. Each transaction is a descriptor (this header followed by
+// count target block numbers, spilling over as many blocks as needed) and
+// then the new images of those blocks. Transactions from header.start on
+// with consecutive sequence numbers and a matching checksum are committed
+// and get replayed at mount.
+#define JOURNAL_MAGIC 0x4c4e524aU     // "JRNL"
+#define JOURNAL_TXN_MAGIC 0x4e584154U // "TAXN"
+#define OP_MAX_BLOCKS 16  // Metadata blocks a single operation may modify
+
+struct heartyfs_journal_header {
+    unsigned int magic;
+    unsigned int sequence;  // Sequence number of the transaction at start
+    int start;              // Log position of the oldest live transaction
+};
+
+struct heartyfs_journal_descriptor {
+    unsigned int magic;
+    unsigned int sequence;
+    int count;
+    unsigned int checksum;  // Over the descriptor (with checksum = 0) and images
+    int targets[];
+};
+
+// Shared lookup cache (src/lib/heartyfs_dcache.c), in a POSIX shared
+// memory segment named after the device and inode of the image
+#define DCACHE_NAME_FORMAT "/heartyfs-%llx-%llx"
+#define DCACHE_MAGIC 0x48434344U  // "DCCH"
+#define DCACHE_SLOTS 8192         // A power of two
+#define DCACHE_MISS (-1 - 0x10000) // Not a block and not an errno value
+
+struct heartyfs_dcache_entry {
+    unsigned int seq;         // Odd while the slot is being written
+    unsigned int generation;  // Generation the lookup was made under
+    int parent;
+    int block;                // Or -ENOENT
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+struct heartyfs_dcache {
+    unsigned int magic;
+    unsigned int generation;  // Bumped on every committed namespace change
+    unsigned int slot_count;
+    struct heartyfs_dcache_entry slots[];
+};
+
+#define SHARED_NAME_FORMAT "/heartyfs-%llx-%llx-shared"
+#define SHARED_MAGIC 0x44524853U  // "SHRD"
+#define LOCK_STRIPES 1024         // A power of two
+#define SEQ_STRIPES 4096          // A power of two
+
+// State shared by every process that mounts an image, in a shared-memory
+// segment named after the image like the lookup cache. Directories are
+// locked through a fixed set of robust mutexes, picked by hashing the
+// directory's block. Block installs are counted the same way, in sequence
+// counters that are odd while a block of the stripe is being written.
+struct heartyfs_shared {
+    unsigned int magic;
+    int block_count;               // Of the image it was set up for
+    pthread_mutex_t journal_lock;  // Held to commit or checkpoint
+    unsigned int journal_seq;      // Sequence number of the next transaction
+    int journal_pos;               // Log position it will be written at
+    int last_txn_pos;              // Of the newest transaction in the log, or -1
+    pthread_mutex_t dir_locks[LOCK_STRIPES];
+    unsigned int block_seq[SEQ_STRIPES];
+    unsigned int free_seq[SEQ_STRIPES];  // Bumped as blocks of the stripe are freed
+    uint64_t in_log[];             // Blocks in the log, one bit each
+};
+
+// A set of blocks that need flushing, as a bitmap for de-duplication and
+// as a list so that a flush does not have to scan the bitmap
+struct heartyfs_dirty_set {
+    unsigned char *map;
+    int *list;
+    int count;
+};
+
+// Write-back counters, accumulated over the life of a mount
+struct heartyfs_stats {
+    unsigned long ops;
+    unsigned long commits;                  // journal transactions written
+    unsigned long checkpoints;
+    unsigned long flush_ranges;             // msync calls issued
+    unsigned long long bytes_flushed;
+    unsigned long long last_bytes_flushed;  // by the most recent commit
+    unsigned long dcache_hits;
+    unsigned long dcache_misses;
+    unsigned long cache_hits;               // block cache of copying backends
+    unsigned long cache_misses;
+    unsigned long cache_evictions;
+    unsigned long readahead_blocks;         // prefetched along files' extents
+    unsigned long dedup_hits;               // data blocks shared instead of written
+    unsigned long dedup_misses;             // data blocks indexed
+    unsigned long long blocks_logged;       // metadata block images committed
+    unsigned long long data_blocks_written; // flushed ahead of the commits
+    unsigned long long data_blocks_read;    // mapped for readers
+};
+
+// Hot-path counters and phase timers (src/lib/heartyfs_stat.c), built in
+// with -DHEARTYFS_STATS (make STATS=1, the default). A mount counts in
+// private and adds its counts to a shared-memory segment named after the
+// image every COUNTERS_PUBLISH_OPS operations, at each commit and as it
+// unmounts. The totals there outlive the mounts, until heartyfs_init makes
+// the image anew, and heartyfs_stat prints them. Built without,
+// HEARTYFS_COUNT() and HEARTYFS_TIME_*() are empty.
+#define COUNTERS_NAME_FORMAT "/heartyfs-%llx-%llx-stats"
+#define COUNTERS_MAGIC 0x54415453U  // "STAT"
+#define COUNTERS_PUBLISH_OPS 256
+
+enum heartyfs_counter {
+    COUNT_OPS,               // Operations finished
+    COUNT_LOOKUPS,           // Names looked up in a directory, past the lookup cache
+    COUNT_ENTRIES_COMPARED,  // Directory entries compared by those lookups
+    COUNT_ALLOCS,            // Runs allocated
+    COUNT_BITS_SCANNED,      // Bitmap bits looked at to find them
+    COUNT_BLOCKS_ALLOCATED,
+    COUNT_BLOCKS_FREED,
+    COUNT_REFS_DROPPED,      // References given back to shared blocks
+    COUNT_MSYNCS,
+    COUNT_BYTES_MSYNCED,
+    COUNTERS
+};
+
+// Phases nest: commit takes in journal_write, install and checkpoint, and
+// those the msyncs they issue
+enum heartyfs_phase {
+    PHASE_LOOKUP,         // Path walks
+    PHASE_LOCK_WAIT,      // Waiting for directory locks held by others
+    PHASE_ALLOC,
+    PHASE_DEV_READ,       // File data moved by the backend
+    PHASE_DEV_WRITE,
+    PHASE_COMMIT,
+    PHASE_JOURNAL_WRITE,
+    PHASE_INSTALL,
+    PHASE_CHECKPOINT,
+    PHASE_MSYNC,
+    PHASES
+};
+
+struct heartyfs_counters {
+    uint64_t count[COUNTERS];
+    uint64_t phase_calls[PHASES];
+    uint64_t phase_ns[PHASES];
+};
+
+struct heartyfs_counter_segment {
+    unsigned int magic;
+    unsigned int size;  // Of the segment, which changes with the counters
+    struct heartyfs_counters totals;
+};
+
+#ifdef HEARTYFS_STATS
+#define HEARTYFS_COUNT(fs, counter, n) ((fs)->counters.count[counter] += (n))
+#define HEARTYFS_TIME_START(start) uint64_t start = heartyfs_now_ns()
+#define HEARTYFS_TIME_END(fs, phase, start) heartyfs_phase_add(fs, phase, start)
+#define HEARTYFS_OP_DONE(fs) heartyfs_counters_op(fs)
+#else
+#define HEARTYFS_COUNT(fs, counter, n) ((void)0)
+#define HEARTYFS_TIME_START(start) ((void)0)
+#define HEARTYFS_TIME_END(fs, phase, start) ((void)0)
+#define HEARTYFS_OP_DONE(fs) ((void)0)
+#define heartyfs_counters_attach(fs) ((void)0)
+#define heartyfs_counters_detach(fs) ((void)0)
+#define heartyfs_counters_publish(fs) ((void)0)
+#endif
+
+// What heartyfs_fsck() found. Everything but broken can be repaired.
+struct heartyfs_fsck_report {
+    int dirs;
+    int files;
+    int used_blocks;  // Reachable blocks past the root directory
+    int leaked;       // Allocated, but not reachable from the root
+    int missing;      // Reachable, but free in the bitmap
+    int bad_refs;     // Reference counts that do not match the references
+    int bad_tails;    // Tail blocks whose live bytes or directory are off
+    int bad_counts;   // Directory entry counts and superblock counters
+    int broken;       // Pointers, types or sizes that make no sense, and
+                      // blocks reachable twice
+    int repaired;
+};
+
+// Usage of a mounted image, as reported by heartyfs_statfs()
+struct heartyfs_statfs {
+    int block_size;
+    int block_count;
+    int data_blocks;  // Blocks that can hold directories, inodes or data
+    int free_blocks;
+    int shared_refs;  // Blocks saved by sharing data blocks
+};
+
+// Blocks a lock-free reader has looked at, with the install sequence each
+// had at the time (see heartyfs_read_block())
+#define READ_SET_MAX 8
+
+struct heartyfs_read_set {
+    int count;
+    int blocks[READ_SET_MAX];
+    unsigned int seqs[READ_SET_MAX];
+};
+
+// Position in a file being read with heartyfs_read_iov()
+struct heartyfs_read_cursor {
+    int inode_block;
+    unsigned int inode_hash;  // Of the inode when the file was opened
+    int extent;  // Next extent to map
+    int block;   // Next block within it
+    int ahead_extent;  // Where read-ahead has got to, likewise
+    int ahead_block;
+    int window;  // Blocks read ahead at a time, 0 before the second batch
+    int inline_data;  // Whether the file is kept in its inode
+    int rest;  // Whether that, or the file's tail, is still to come
+    int compressed;  // Whether the file is compressed
+};
+
+// heartyfsd serves operations over a SOCK_SEQPACKET Unix socket. A request
+// is one packet: this header followed by path_len bytes of path. Reads and
+// writes pass the descriptor to copy to or from along with it
+// (SCM_RIGHTS), so file data never goes through the socket. The reply is
+// one packet holding the int32_t result of the operation.
+#define HEARTYFSD_SOCKET_PATH "/tmp/heartyfsd.sock"
+#define HEARTYFSD_PATH_MAX 4096
+
+enum heartyfsd_op {
+    HEARTYFSD_MKDIR = 1,
+    HEARTYFSD_RMDIR,
+    HEARTYFSD_CREAT,
+    HEARTYFSD_RM,
+    HEARTYFSD_READ,   // Copies the file to the descriptor passed
+    HEARTYFSD_WRITE,  // Copies the descriptor passed into the file
+};
+
+struct heartyfsd_request {
+    uint16_t op;
+    uint16_t path_len;
+};
+
+struct heartyfs;
+struct heartyfs_ring;
+struct heartyfs_cache;
+struct heartyfs_dedup_pending;
+
+// A run of consecutive data blocks for a backend to move, and the memory
+// it goes to or comes from (count * block_size bytes)
+struct heartyfs_io {
+    int block;
+    int count;
+    void *buf;
+};
+
+// How file data moves between memory and the image (src/lib/heartyfs_dev.c).
+// Metadata always goes through the shared mapping: other processes update
+// it in place and read it without locks.
+struct heartyfs_backend {
+    const char *name;
+    int mapped;  // Data can be used in place in the mapping, without copies
+    int (*open)(struct heartyfs *fs);
+    void (*close)(struct heartyfs *fs);
+    int (*read)(struct heartyfs *fs, const struct heartyfs_io *ios, int count);
+    int (*write)(struct heartyfs *fs, const struct heartyfs_io *ios, int count);
+};
+
+#define IO_BATCH_BYTES (1 << 20)  // Staged per batch by copying backends
+#define CACHE_BYTES (16 << 20)    // Default size of their block cache
+#define READAHEAD_MIN 16          // Blocks read ahead once a reader is sequential
+
+#define LZ_HASH_BITS 14
+#define LZ_BUF_BYTES (1 << 20)                      // Raw data of compressed files per batch
+#define LZ_MAX_RAW(bs) (16 * DATA_PAYLOAD(bs))      // Most one block decompresses to
+
+// A mounted heartyfs image. All libheartyfs calls operate on one of these;
+// the image stays mapped from heartyfs_mount() until heartyfs_unmount().
+struct heartyfs {
+    int fd;
+    void *disk;
+    size_t disk_size;
+    size_t page_size;
+    int readonly;
+
+    // Geometry, copied from the superblock at mount
+    int block_size;
+    int block_count;
+    int bitmap_start;
+    int bitmap_blocks;
+    int refcount_start;
+    int refcount_blocks;
+    int dedup_start;
+    int dedup_blocks;
+    int journal_start;
+    int journal_blocks;
+    int root_block;
+    int data_start;  // First allocatable block
+
+    // Data blocks written since the last commit, flushed before it, and
+    // the home locations a checkpoint is flushing
+    struct heartyfs_dirty_set data_dirty;
+    struct heartyfs_dirty_set home_dirty;
+
+    // The running transaction: private copies of the metadata blocks it
+    // modified (found through a hash of block numbers), and blocks it freed
+    // (reusable only once it commits). The bitmap, the reference counts and
+    // the superblock are updated in place instead; they are only listed,
+    // and their images are taken as the transaction is written.
+    unsigned char *txn_map;
+    int *txn_blocks;
+    char *txn_images;
+    int *txn_slots;
+    int txn_slot_mask;
+    int txn_count;
+    int txn_max;
+    int *pending_free;
+    int pending_free_count;
+    int pending_free_cap;
+    int txn_free_count;  // Pending frees going into the commit under way
+    int txn_drop_count;  // And after them, references dropped from shared blocks
+    int alloc_cursor;  // Where the next allocation starts looking (next fit)
+
+    // Group commit: operations since the last commit, and how many
+    // operations to gather before committing
+    int txn_ops;
+    int group_ops;
+
+    int checkpoint_needed;  // A data block reuses a block still in the log
+
+    // State shared with the other processes that mount the image, and the
+    // directory lock stripes the running transaction holds
+    struct heartyfs_shared *shared;
+    size_t shared_size;
+    int shared_private;  // No segment could be set up; shared is malloc'd
+    unsigned char held_map[LOCK_STRIPES / 8];
+    int held_locks[LOCK_STRIPES];
+    int held_count;
+
+    // Shared lookup cache, or NULL, and whether the running transaction
+    // adds or removes names
+    struct heartyfs_dcache *dcache;
+    size_t dcache_size;
+    int namespace_dirty;
+
+    // Backend moving file data, with the descriptor it uses (the image
+    // opened again, O_DIRECT if asked for), its staging buffer and its
+    // io_uring if it has one
+    const struct heartyfs_backend *backend;
+    int io_fd;
+    void *io_buf;
+    struct heartyfs_ring *ring;
+
+    // Data blocks a copying backend has read, and how big the cache of
+    // them may grow
+    struct heartyfs_cache *cache;
+    size_t cache_bytes;
+
+    // Whether heartyfs_write() compresses files, and the buffers they go
+    // through, set up on first use
+    int compress;
+    char *lz_buf;
+    int *lz_table;
+
+    // Whether heartyfs_write() shares data blocks with identical ones
+    // already in the image, a block to read those into for comparison, and
+    // the blocks it wrote that go into the index at the next commit
+    int dedup;
+    void *dedup_buf;
+    struct heartyfs_dedup_pending *dedup_pending;
+
+    int in_snapshot;  // heartyfs_snapshot() is writing in SNAPSHOT_DIR
+
+    struct heartyfs_stats stats;
+
+#ifdef HEARTYFS_STATS
+    // Counted since they were last published, the segment they go to (or
+    // NULL), and operations until they are published again
+    struct heartyfs_counters counters;
+    struct heartyfs_counter_segment *counter_segment;
+    int counter_ops;
+#endif
+};
+
+// Every libheartyfs call returns 0 (or a non-negative result) on success
+// and a negative errno value on failure.
+
+// Mounting (src/lib/heartyfs_mount.c)
+int heartyfs_mount(struct heartyfs *fs, const char *image_path);
+int heartyfs_mount_readonly(struct heartyfs *fs, const char *image_path);
+void heartyfs_unmount(struct heartyfs *fs);
+
+// Block device backends (src/lib/heartyfs_dev.c)
+int heartyfs_set_backend(struct heartyfs *fs, const char *name, int direct);
+void heartyfs_backend_reset(struct heartyfs *fs);
+int heartyfs_batch_blocks(struct heartyfs *fs);
+int heartyfs_dev_read(struct heartyfs *fs, const struct heartyfs_io *ios, int count);
+int heartyfs_dev_write(struct heartyfs *fs, const struct heartyfs_io *ios, int count);
+void heartyfs_dev_prefetch(struct heartyfs *fs, const struct heartyfs_extent *runs, int count);
+
+// Block cache of copying backends (src/lib/heartyfs_cache.c)
+int heartyfs_set_cache(struct heartyfs *fs, size_t bytes);
+int heartyfs_cache_init(struct heartyfs *fs);
+void heartyfs_cache_free(struct heartyfs *fs);
+const void *heartyfs_cache_get(struct heartyfs *fs, int block_id);
+void *heartyfs_cache_reserve(struct heartyfs *fs, int block_id);
+void heartyfs_cache_filled(struct heartyfs *fs, const void *data);
+void heartyfs_cache_drop(struct heartyfs *fs, const void *data);
+void heartyfs_cache_unpin(struct heartyfs *fs, const void *data);
+
+// Compression (src/lib/heartyfs_lz.c)
+int heartyfs_lz_init(struct heartyfs *fs);
+void heartyfs_lz_free(struct heartyfs *fs);
+int heartyfs_lz_compress(int *table, const char *buf, int *pos, int end, char *dst, int cap);
+int heartyfs_lz_decompress(const char *src, int len, char *dst, int cap);
+
+// Deduplication (src/lib/heartyfs_dedup.c)
+void heartyfs_set_dedup(struct heartyfs *fs, int on);
+void heartyfs_dedup_free(struct heartyfs *fs);
+int heartyfs_dedup_block(struct heartyfs *fs, int block_id,
+                         const struct heartyfs_data_block *db);
+void heartyfs_dedup_publish(struct heartyfs *fs);
+
+// Tail packing (src/lib/heartyfs_tail.c)
+int heartyfs_tail_pack(struct heartyfs *fs, int dir_block, const void *data, int len,
+                       struct heartyfs_tail *tail);
+void heartyfs_tail_release(struct heartyfs *fs, const struct heartyfs_tail *tail);
+void heartyfs_tail_close(struct heartyfs *fs, int dir_block);
+
+// Dirty-block tracking (src/lib/heartyfs_sync.c)
+int heartyfs_dirty_init(struct heartyfs_dirty_set *set, int block_count);
+void heartyfs_dirty_free(struct heartyfs_dirty_set *set);
+void heartyfs_dirty_add(struct heartyfs_dirty_set *set, int block_id);
+void heartyfs_dirty_forget(struct heartyfs_dirty_set *set, int block_id);
+int heartyfs_dirty_flush(struct heartyfs *fs, struct heartyfs_dirty_set *set);
+int heartyfs_flush_blocks(struct heartyfs *fs, int first_block, int count);
+void heartyfs_data_written(struct heartyfs *fs, int block_id);
+void *heartyfs_data_mut(struct heartyfs *fs, int block_id);
+
+// Metadata journal (src/lib/heartyfs_journal.c)
+int heartyfs_journal_init(struct heartyfs *fs);
+void heartyfs_journal_free(struct heartyfs *fs);
+int heartyfs_journal_replay(struct heartyfs *fs);
+int heartyfs_journal_dirty(struct heartyfs *fs);
+int heartyfs_checkpoint(struct heartyfs *fs);
+void *heartyfs_block(struct heartyfs *fs, int block_id);
+void *heartyfs_block_mut(struct heartyfs *fs, int block_id);
+void *heartyfs_block_log(struct heartyfs *fs, int block_id);
+void *heartyfs_txn_image(struct heartyfs *fs, int block_id);
+int heartyfs_in_txn(struct heartyfs *fs, int block_id);
+int heartyfs_commit(struct heartyfs *fs);
+int heartyfs_fail(struct heartyfs *fs, int rc);
+int heartyfs_sync(struct heartyfs *fs);
+int heartyfs_sync_keep_locks(struct heartyfs *fs);
+void heartyfs_journal_recover(struct heartyfs *fs);
+void heartyfs_set_group_commit(struct heartyfs *fs, int ops);
+
+// Free-block bitmap (src/lib/heartyfs_bitmap.c)
+int heartyfs_alloc_block(struct heartyfs *fs);
+int heartyfs_alloc_run(struct heartyfs *fs, int want, int *length);
+void heartyfs_free_block(struct heartyfs *fs, int block_id);
+void heartyfs_release_pending(struct heartyfs *fs);
+void heartyfs_apply_frees(struct heartyfs *fs, int installed);
+int heartyfs_block_in_use(struct heartyfs *fs, int block_id);
+unsigned int heartyfs_ref_entry(struct heartyfs *fs, int block_id);
+int heartyfs_ref_get(struct heartyfs *fs, int block_id);
+void heartyfs_ref_index(struct heartyfs *fs, int block_id);
+void heartyfs_ref_scrub(struct heartyfs *fs);
+int heartyfs_count_free(struct heartyfs *fs);
+void heartyfs_statfs(struct heartyfs *fs, struct heartyfs_statfs *st);
+
+// Shared state and locking (src/lib/heartyfs_lock.c)
+int heartyfs_shared_attach(struct heartyfs *fs);
+void heartyfs_shared_ready(struct heartyfs *fs);
+int heartyfs_lock_image(struct heartyfs *fs);
+void heartyfs_shared_detach(struct heartyfs *fs);
+int heartyfs_lock_journal(struct heartyfs *fs);
+void heartyfs_unlock_journal(struct heartyfs *fs);
+int heartyfs_lock_dir(struct heartyfs *fs, int dir_block);
+void heartyfs_unlock_all(struct heartyfs *fs);
+void heartyfs_install_begin(struct heartyfs *fs, int block_id);
+void heartyfs_install_end(struct heartyfs *fs, int block_id);
+void heartyfs_install_repair(struct heartyfs *fs);
+unsigned int heartyfs_read_begin(struct heartyfs *fs, int block_id);
+int heartyfs_read_changed(struct heartyfs *fs, int block_id, unsigned int seq);
+const void *heartyfs_read_block(struct heartyfs *fs, struct heartyfs_read_set *set,
+                                int block_id);
+int heartyfs_read_valid(struct heartyfs *fs, const struct heartyfs_read_set *set);
+void heartyfs_free_note(struct heartyfs *fs, int block_id);
+unsigned int heartyfs_free_seq(struct heartyfs *fs, int block_id);
+
+// Shared lookup cache (src/lib/heartyfs_dcache.c)
+void heartyfs_dcache_attach(struct heartyfs *fs);
+void heartyfs_dcache_detach(struct heartyfs *fs);
+unsigned int heartyfs_dcache_generation(struct heartyfs *fs);
+int heartyfs_dcache_lookup(struct heartyfs *fs, int parent, const char *name);
+void heartyfs_dcache_insert(struct heartyfs *fs, unsigned int generation, int parent,
+                            const char *name, int block);
+void heartyfs_dcache_invalidate(struct heartyfs *fs);
+
+// Hot-path counters (src/lib/heartyfs_stat.c)
+extern const char *const heartyfs_counter_names[COUNTERS];
+extern const char *const heartyfs_phase_names[PHASES];
+int heartyfs_counters_read(const char *image_path, struct heartyfs_counters *totals,
+                           int reset);
+#ifdef HEARTYFS_STATS
+void heartyfs_counters_attach(struct heartyfs *fs);
+void heartyfs_counters_detach(struct heartyfs *fs);
+void heartyfs_counters_publish(struct heartyfs *fs);
+void heartyfs_counters_op(struct heartyfs *fs);
+uint64_t heartyfs_now_ns(void);
+void heartyfs_phase_add(struct heartyfs *fs, enum heartyfs_phase phase, uint64_t start);
+#endif
+
+// Directory entries (src/lib/heartyfs_dir.c)
+int heartyfs_dir_find(struct heartyfs *fs, int dir_block, const char *name);
+int heartyfs_dir_add(struct heartyfs *fs, int dir_block, const char *name,
+                     int block_id);
+int heartyfs_dir_remove(struct heartyfs *fs, int dir_block, const char *name);
+int heartyfs_dir_iterate(struct heartyfs *fs, int dir_block,
+                         int (*fn)(void *arg, const struct heartyfs_dir_entry *entry),
+                         void *arg);
+void heartyfs_dir_release(struct heartyfs *fs, int dir_block);
+
+// Path resolution (src/lib/heartyfs_path.c)
+int heartyfs_lookup(struct heartyfs *fs, const char *path);
+int heartyfs_lookup_parent(struct heartyfs *fs, const char *path,
+                           char name[MAX_NAME_LENGTH + 1]);
+int heartyfs_lookup_parent_mut(struct heartyfs *fs, const char *path,
+                               char name[MAX_NAME_LENGTH + 1]);
+
+// File system operations (src/lib/heartyfs_ops.c, src/lib/heartyfs_file.c)
+int heartyfs_mkdir(struct heartyfs *fs, const char *path);
+int heartyfs_rmdir(struct heartyfs *fs, const char *path);
+int heartyfs_creat(struct heartyfs *fs, const char *path);
+int heartyfs_rm(struct heartyfs *fs, const char *path);
+int heartyfs_write(struct heartyfs *fs, const char *path, int src_fd);
+int heartyfs_clone(struct heartyfs *fs, const char *src_path, const char *dst_path);
+void heartyfs_set_compress(struct heartyfs *fs, int on);
+int heartyfs_read(struct heartyfs *fs, const char *path, int out_fd);
+int heartyfs_read_open(struct heartyfs *fs, const char *path,
+                       struct heartyfs_read_cursor *cursor);
+int heartyfs_read_iov(struct heartyfs *fs, struct heartyfs_read_cursor *cursor,
+                      struct iovec *iov, int max);
+void heartyfs_release_file(struct heartyfs *fs, const struct heartyfs_inode *inode);
+
+// Consistency checks (src/lib/heartyfs_fsck.c)
+int heartyfs_fsck(struct heartyfs *fs, int threads, int repair, FILE *log,
+                  struct heartyfs_fsck_report *report);
+
+// Snapshots (src/lib/heartyfs_snapshot.c)
+int heartyfs_snapshot(struct heartyfs *fs, const char *name);
+int heartyfs_snapshot_remove(struct heartyfs *fs, const char *name);
+
+// heartyfsd clients (src/lib/heartyfs_client.c)
+int heartyfsd_connect(const char *socket_path);
+int heartyfsd_call(int sock, enum heartyfsd_op op, const char *path, int fd);
+
+#endif  // HEARTYFS_H
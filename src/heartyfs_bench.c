@@ -0,0 +1,527 @@
+#define _GNU_SOURCE  // memfd_create
+#include "heartyfs.h"
+#include <errno.h>
+#include <limits.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HISTOGRAM_BUCKETS 40  // Powers of two of microseconds
+#define FILL_GROUP_OPS 64     // Operations per commit while filling the image
+
+extern char **environ;
+
+// The phases of a run, in the order they run: each does one operation on
+// every directory or file of the tree
+enum bench_op { OP_MKDIR, OP_CREAT, OP_WRITE, OP_READ, OP_RM, OP_RMDIR, OP_COUNT };
+
+static const char *const op_names[OP_COUNT] = {"mkdir", "creat", "write", "read", "rm", "rmdir"};
+
+// How big the files are: all min bytes, uniform over [min, max], or
+// spread evenly over the powers of two in between (log)
+enum dist_kind { DIST_FIXED, DIST_UNIFORM, DIST_LOG };
+
+struct size_dist {
+    enum dist_kind kind;
+    long long min;
+    long long max;
+};
+
+// What one phase measured. The counters are taken from the mount's stats
+// before the phase and after its last commit.
+struct phase {
+    long *latency;  // Nanoseconds per operation, sorted once done
+    int count;
+    int failed;
+    long elapsed;
+    long long bytes;  // Of file data written or read
+    struct heartyfs_stats before;
+    struct heartyfs_stats after;
+};
+
+struct bench {
+    struct heartyfs fs;
+    const char *image_size;
+    const char *block_size;
+    const char *bin_dir;
+    const char *backend;
+    const char *dist_text;
+    struct size_dist dist;
+    int depth;
+    int fanout;
+    int files_per_dir;
+    int fill;  // Percent of the data blocks to fill before the run
+    int group_ops;
+    uint64_t seed;
+
+    // Directories, parents before children, and files in the leaves
+    char **dirs;
+    int dir_count;
+    char **files;
+    long long *sizes;
+    int file_count;
+
+    // Source of the writes, and where reads go: a file in memory, so that
+    // reading costs a copy as it would anywhere else
+    int src_fd;
+    char *data;
+    int sink_fd;
+    int null_fd;
+
+    int fill_files;
+    int used_before;  // Data blocks in use once filled
+    struct phase phases[OP_COUNT];
+};
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// xorshift64*, so that a seed gives the same tree and sizes every run
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static long long parse_size(const char *text) {
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; end++; break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Parse "fixed:SIZE", "uniform:MIN:MAX" or "log:MIN:MAX"
+static int parse_dist(const char *text, struct size_dist *dist) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", text);
+    char *save = NULL;
+    const char *kind = strtok_r(buf, ":", &save);
+    const char *min = strtok_r(NULL, ":", &save);
+    const char *max = strtok_r(NULL, ":", &save);
+    if (kind == NULL || min == NULL) {
+        return -1;
+    }
+    if (strcmp(kind, "fixed") == 0 && max == NULL) {
+        dist->kind = DIST_FIXED;
+    } else if (strcmp(kind, "uniform") == 0 && max != NULL) {
+        dist->kind = DIST_UNIFORM;
+    } else if (strcmp(kind, "log") == 0 && max != NULL) {
+        dist->kind = DIST_LOG;
+    } else {
+        return -1;
+    }
+    dist->min = parse_size(min);
+    dist->max = max != NULL ? parse_size(max) : dist->min;
+    return dist->min < 0 || dist->max < dist->min || dist->max > INT_MAX ? -1 : 0;
+}
+
+static long long pick_size(const struct size_dist *dist, uint64_t *state) {
+    long long min = dist->min;
+    long long max = dist->max;
+    if (dist->kind == DIST_LOG) {
+        // A power of two first, then a size within it
+        int low = 0;
+        int high = 0;
+        while ((2LL << low) <= min) {
+            low++;
+        }
+        while ((1LL << high) < max) {
+            high++;
+        }
+        int k = low + next_random(state) % (high - low + 1);
+        min = (1LL << k) > dist->min ? 1LL << k : dist->min;
+        max = (2LL << k) - 1 < dist->max ? (2LL << k) - 1 : dist->max;
+    }
+    if (dist->kind == DIST_FIXED || max <= min) {
+        return min;
+    }
+    return min + next_random(state) % (max - min + 1);
+}
+
+static char *path_printf(const char *format, const char *parent, int i) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), format, parent, i);
+    return strdup(path);
+}
+
+// Lay out the tree: fanout directories under the root, fanout under each
+// of those, and so on depth levels down, with files_per_dir files in each
+// directory of the last level
+static int build_tree(struct bench *b) {
+    long long dirs = 0;
+    long long level = 1;
+    for (int d = 0; d < b->depth; d++) {
+        level *= b->fanout;
+        dirs += level;
+        if (dirs > 1 << 20 || level * b->files_per_dir > 1 << 22) {
+            return -EFBIG;
+        }
+    }
+    b->dirs = calloc(dirs, sizeof(char *));
+    b->files = calloc(level * b->files_per_dir + 1, sizeof(char *));
+    b->sizes = calloc(level * b->files_per_dir + 1, sizeof(long long));
+    if (b->dirs == NULL || b->files == NULL || b->sizes == NULL) {
+        return -ENOMEM;
+    }
+    int parents = 0;  // Directories of the level above, at the end of dirs
+    for (int d = 0; d < b->depth; d++) {
+        int first = b->dir_count;
+        for (int p = 0; p < (d == 0 ? 1 : parents); p++) {
+            const char *parent = d == 0 ? "" : b->dirs[first - parents + p];
+            for (int i = 0; i < b->fanout; i++) {
+                b->dirs[b->dir_count++] = path_printf("%s/d%d", parent, i);
+            }
+        }
+        parents = b->dir_count - first;
+    }
+    uint64_t state = b->seed;
+    for (int p = b->dir_count - parents; p < b->dir_count; p++) {
+        for (int i = 0; i < b->files_per_dir; i++) {
+            b->sizes[b->file_count] = pick_size(&b->dist, &state);
+            b->files[b->file_count++] = path_printf("%s/f%d", b->dirs[p], i);
+        }
+    }
+    for (int i = 0; i < b->dir_count; i++) {
+        if (b->dirs[i] == NULL) {
+            return -ENOMEM;
+        }
+    }
+    for (int i = 0; i < b->file_count; i++) {
+        if (b->files[i] == NULL) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// Make the source of the next write size bytes long. Every file gets
+// different data, from somewhere in a block-sized window of the buffer.
+static int set_source(struct bench *b, long long size, int i) {
+    if (ftruncate(b->src_fd, 0) != 0 ||
+        pwrite(b->src_fd, b->data + i * 64 % 4096, size, 0) != size ||
+        lseek(b->src_fd, 0, SEEK_SET) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Format a fresh image with bin_dir/heartyfs_init
+static int format_image(struct bench *b) {
+    char tool[PATH_MAX];
+    snprintf(tool, sizeof(tool), "%s/heartyfs_init", b->bin_dir);
+    char *argv[] = {tool, "-s", (char *)b->image_size, "-b", (char *)b->block_size, NULL};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, b->null_fd, STDOUT_FILENO);
+    pid_t pid;
+    int rc = posix_spawn(&pid, tool, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        return -rc;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EIO;
+}
+
+static int used_blocks(struct bench *b) {
+    struct heartyfs_statfs st;
+    heartyfs_statfs(&b->fs, &st);
+    return st.data_blocks - st.free_blocks;
+}
+
+// Write filler files into /fill until the given number of blocks is in
+// use, or the image is full
+static int fill_to(struct bench *b, int target, uint64_t *state) {
+    while (used_blocks(b) < target) {
+        char path[64];
+        snprintf(path, sizeof(path), "/fill/f%d", b->fill_files++);
+        int rc = set_source(b, pick_size(&b->dist, state), b->fill_files);
+        if (rc == 0) {
+            rc = heartyfs_write(&b->fs, path, b->src_fd);
+        }
+        if (rc == -ENOSPC) {
+            break;
+        }
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+// Fill the image to b->fill percent of its data blocks, then remove every
+// other filler and fill it up again, so that free space is scattered the
+// way it is on an image that has been in use
+static int fill_image(struct bench *b) {
+    struct heartyfs_statfs st;
+    heartyfs_statfs(&b->fs, &st);
+    int target = (int)((long long)st.data_blocks * b->fill / 100);
+    uint64_t state = b->seed ^ 0x9e3779b97f4a7c15ULL;
+    heartyfs_set_group_commit(&b->fs, FILL_GROUP_OPS);
+    int rc = heartyfs_mkdir(&b->fs, "/fill");
+    if (rc == 0) {
+        rc = fill_to(b, target, &state);
+    }
+    for (int i = 0; i < b->fill_files && rc == 0; i += 2) {
+        char path[64];
+        snprintf(path, sizeof(path), "/fill/f%d", i);
+        rc = heartyfs_rm(&b->fs, path);
+    }
+    if (rc == 0) {
+        rc = fill_to(b, target, &state);
+    }
+    int sync_rc = heartyfs_sync(&b->fs);
+    heartyfs_set_group_commit(&b->fs, b->group_ops);
+    return rc < 0 ? rc : sync_rc;
+}
+
+static int run_op(struct bench *b, enum bench_op op, int i) {
+    switch (op) {
+    case OP_MKDIR:
+        return heartyfs_mkdir(&b->fs, b->dirs[i]);
+    case OP_CREAT:
+        return heartyfs_creat(&b->fs, b->files[i]);
+    case OP_WRITE:
+        return heartyfs_write(&b->fs, b->files[i], b->src_fd);
+    case OP_READ:
+        return heartyfs_read(&b->fs, b->files[i], b->sink_fd);
+    case OP_RM:
+        return heartyfs_rm(&b->fs, b->files[i]);
+    default:
+        return heartyfs_rmdir(&b->fs, b->dirs[b->dir_count - 1 - i]);  // Children first
+    }
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Run op on every directory or file, timing each
+static int run_phase(struct bench *b, enum bench_op op) {
+    struct phase *ph = &b->phases[op];
+    ph->count = op == OP_MKDIR || op == OP_RMDIR ? b->dir_count : b->file_count;
+    ph->latency = calloc(ph->count + 1, sizeof(long));
+    if (ph->latency == NULL) {
+        return -ENOMEM;
+    }
+    ph->before = b->fs.stats;
+    long start = now_ns();
+    long prepare = 0;
+    for (int i = 0; i < ph->count; i++) {
+        if (op == OP_WRITE || op == OP_READ) {
+            long t = now_ns();
+            int rc = op == OP_WRITE ? set_source(b, b->sizes[i], i) :
+                     ftruncate(b->sink_fd, 0) == 0 && lseek(b->sink_fd, 0, SEEK_SET) == 0 ? 0 :
+                     -errno;
+            if (rc < 0) {
+                return rc;
+            }
+            prepare += now_ns() - t;
+        }
+        long t = now_ns();
+        int rc = run_op(b, op, i);
+        ph->latency[i] = now_ns() - t;
+        ph->failed += rc < 0;
+        if (rc == 0 && (op == OP_WRITE || op == OP_READ)) {
+            ph->bytes += b->sizes[i];
+        }
+    }
+    int rc = heartyfs_sync(&b->fs);
+    ph->elapsed = now_ns() - start - prepare;
+    ph->after = b->fs.stats;
+    qsort(ph->latency, ph->count, sizeof(long), compare_long);
+    return rc;
+}
+
+static long percentile(const struct phase *ph, int per_mille) {
+    if (ph->count == 0) {
+        return 0;
+    }
+    long long i = (long long)ph->count * per_mille / 1000;
+    return ph->latency[i < ph->count ? i : ph->count - 1];
+}
+
+// Print one phase as a line of JSON
+static void print_phase(const struct bench *b, enum bench_op op, int last) {
+    const struct phase *ph = &b->phases[op];
+    double seconds = ph->elapsed / 1e9;
+    double ops = ph->count == 0 ? 1 : ph->count;
+    long long sum = 0;
+    for (int i = 0; i < ph->count; i++) {
+        sum += ph->latency[i];
+    }
+    printf("    \"%s\": {\"count\": %d, \"failed\": %d, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, ", op_names[op], ph->count, ph->failed,
+           seconds, ph->count / seconds, ph->bytes / seconds / (1 << 20));
+    printf("\"latency_ns\": {\"mean\": %lld, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, "
+           "\"p999\": %ld, \"max\": %ld}, ", ph->count == 0 ? 0 : sum / ph->count,
+           percentile(ph, 500), percentile(ph, 900), percentile(ph, 990), percentile(ph, 999),
+           ph->count == 0 ? 0 : ph->latency[ph->count - 1]);
+
+    // Operations per power of two of microseconds, up to the slowest
+    int buckets[HISTOGRAM_BUCKETS] = {0};
+    int top = 0;
+    for (int i = 0; i < ph->count; i++) {
+        int k = 0;
+        while (k < HISTOGRAM_BUCKETS - 1 && ph->latency[i] >= 2000L << k) {
+            k++;
+        }
+        buckets[k]++;
+        top = k > top ? k : top;
+    }
+    printf("\"histogram_us\": [");
+    for (int k = 0; k <= top; k++) {
+        printf("%s[%ld, %d]", k == 0 ? "" : ", ", 2L << k, buckets[k]);
+    }
+
+    // Blocks the operations logged, wrote and read, and what was flushed
+    printf("], \"blocks_per_op\": {\"metadata\": %.2f, \"data_written\": %.2f, "
+           "\"data_read\": %.2f}, \"commits\": %lu, \"bytes_flushed\": %llu}%s\n",
+           (ph->after.blocks_logged - ph->before.blocks_logged) / ops,
+           (ph->after.data_blocks_written - ph->before.data_blocks_written) / ops,
+           (ph->after.data_blocks_read - ph->before.data_blocks_read) / ops,
+           ph->after.commits - ph->before.commits,
+           ph->after.bytes_flushed - ph->before.bytes_flushed, last ? "" : ",");
+}
+
+static void print_json(const struct bench *b) {
+    printf("{\n  \"config\": {\"image_size\": \"%s\", \"block_size\": \"%s\", "
+           "\"backend\": \"%s\", \"group_ops\": %d, \"depth\": %d, \"fanout\": %d, "
+           "\"files_per_dir\": %d, \"sizes\": \"%s\", \"fill_percent\": %d, \"seed\": %llu},\n",
+           b->image_size, b->block_size, b->fs.backend->name, b->group_ops, b->depth,
+           b->fanout, b->files_per_dir, b->dist_text, b->fill, (unsigned long long)b->seed);
+    printf("  \"tree\": {\"dirs\": %d, \"files\": %d, \"fill_files\": %d, "
+           "\"used_blocks_before\": %d},\n", b->dir_count, b->file_count, b->fill_files,
+           b->used_before);
+    printf("  \"ops\": {\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        print_phase(b, op, op == OP_COUNT - 1);
+    }
+    printf("  }\n}\n");
+}
+
+// A table of the same for people, on stderr
+static void print_table(const struct bench *b) {
+    fprintf(stderr, "%-6s %8s %10s %8s %9s %9s %9s %7s\n", "op", "count", "ops/s", "MB/s",
+            "p50 us", "p99 us", "p999 us", "blk/op");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const struct phase *ph = &b->phases[op];
+        double ops = ph->count == 0 ? 1 : ph->count;
+        double blocks = ph->after.blocks_logged - ph->before.blocks_logged +
+                        ph->after.data_blocks_written - ph->before.data_blocks_written +
+                        ph->after.data_blocks_read - ph->before.data_blocks_read;
+        fprintf(stderr, "%-6s %8d %10.0f %8.1f %9.1f %9.1f %9.1f %7.1f\n", op_names[op],
+                ph->count, ph->count / (ph->elapsed / 1e9),
+                ph->bytes / (ph->elapsed / 1e9) / (1 << 20), percentile(ph, 500) / 1000.0,
+                percentile(ph, 990) / 1000.0, percentile(ph, 999) / 1000.0, blocks / ops);
+    }
+}
+
+static int run(struct bench *b) {
+    int rc = build_tree(b);
+    if (rc < 0) {
+        return rc;
+    }
+    b->data = malloc(b->dist.max + 4096);
+    b->src_fd = memfd_create("heartyfs_bench", 0);
+    b->sink_fd = memfd_create("heartyfs_bench_sink", 0);
+    if (b->data == NULL || b->src_fd < 0 || b->sink_fd < 0) {
+        return b->data == NULL ? -ENOMEM : -errno;
+    }
+    uint64_t state = b->seed;
+    for (long long i = 0; i < b->dist.max + 4096; i++) {
+        b->data[i] = (char)next_random(&state);
+    }
+
+    if ((rc = format_image(b)) < 0 || (rc = heartyfs_mount(&b->fs, DISK_FILE_PATH)) < 0) {
+        return rc;
+    }
+    rc = heartyfs_set_backend(&b->fs, b->backend, 0);
+    heartyfs_set_group_commit(&b->fs, b->group_ops);
+    if (rc == 0 && b->fill > 0) {
+        rc = fill_image(b);
+    }
+    b->used_before = used_blocks(b);
+    for (int op = 0; op < OP_COUNT && rc == 0; op++) {
+        rc = run_phase(b, op);
+    }
+    heartyfs_unmount(&b->fs);
+    return rc;
+}
+
+// heartyfs_bench formats a fresh image (with bin_dir/heartyfs_init), fills
+// it to a given level if asked, then builds a tree of depth levels of
+// fanout directories with files in the deepest ones, and runs mkdir,
+// creat, write, read, rm and rmdir over all of it in turn, all in one
+// mount. For each operation it prints (as JSON, on stdout) throughput,
+// latency percentiles and a histogram, and the blocks logged, written and
+// read per operation; a summary table goes to stderr.
+int main(int argc, char *argv[]) {
+    struct bench b = {
+        .image_size = "256M", .block_size = "4K", .bin_dir = "bin", .backend = "mmap",
+        .dist_text = "log:1K:256K", .depth = 2, .fanout = 8, .files_per_dir = 32,
+        .group_ops = 1, .seed = 1, .src_fd = -1, .sink_fd = -1,
+    };
+    int quiet = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:d:f:n:S:F:o:g:r:B:q")) != -1) {
+        switch (opt) {
+        case 's': b.image_size = optarg; break;
+        case 'b': b.block_size = optarg; break;
+        case 'd': b.depth = atoi(optarg); break;
+        case 'f': b.fanout = atoi(optarg); break;
+        case 'n': b.files_per_dir = atoi(optarg); break;
+        case 'S': b.dist_text = optarg; break;
+        case 'F': b.fill = atoi(optarg); break;
+        case 'o': b.backend = optarg; break;
+        case 'g': b.group_ops = atoi(optarg); break;
+        case 'r': b.seed = strtoull(optarg, NULL, 10); break;
+        case 'B': b.bin_dir = optarg; break;
+        case 'q': quiet = 1; break;
+        default: argc = -1; break;
+        }
+    }
+    if (argc < 0 || optind != argc || b.depth < 1 || b.fanout < 1 || b.files_per_dir < 0 ||
+        b.fill < 0 || b.fill > 99 || b.group_ops < 1 || b.seed == 0 ||
+        parse_dist(b.dist_text, &b.dist) < 0) {
+        fprintf(stderr, "Usage: %s [-s image_size] [-b block_size] [-d depth] [-f fanout] "
+                        "[-n files_per_dir] [-S fixed:SIZE|uniform:MIN:MAX|log:MIN:MAX] "
+                        "[-F fill_percent] [-o backend] [-g group_ops] [-r seed] "
+                        "[-B bin_dir] [-q]\n", argv[0]);
+        return 1;
+    }
+
+    b.null_fd = open("/dev/null", O_WRONLY);
+    int rc = run(&b);
+    if (rc < 0) {
+        fprintf(stderr, "heartyfs_bench: %s\n", strerror(-rc));
+        return 1;
+    }
+    print_json(&b);
+    if (!quiet) {
+        print_table(&b);
+    }
+    int failed = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        failed += b.phases[op].failed;
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -1,57 +1,203 @@
 #include "heartyfs.h"
+#include <limits.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-int main() {
-    // Open the disk file
-    int fd = open(DISK_FILE_PATH, O_RDWR);
+#define MIN_JOURNAL_BLOCKS 32
+
+// Parse a size such as 4096, 64K, 256M or 4G
+static long long parse_size(const char *text) {
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; end++; break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Write one block of the image, or give up
+static void write_block(int fd, const void *block, long long block_size, long long block_id) {
+    if (pwrite(fd, block, block_size, block_id * block_size) != block_size) {
+        perror("Cannot write to the disk file\n");
+        exit(1);
+    }
+}
+
+// Fill the bitmap block whose first bit stands for block first, marking
+// the blocks in [free_start, free_end) as free
+static void fill_bitmap_block(unsigned char *bitmap, long long block_size, long long first,
+                              long long free_start, long long free_end) {
+    long long lo = free_start - first;
+    long long hi = free_end - first;
+    lo = lo < 0 ? 0 : lo;
+    hi = hi > block_size * 8 ? block_size * 8 : hi;
+    memset(bitmap, 0, block_size);
+    if (lo >= hi) {
+        return;
+    }
+
+    // Whole bytes in the middle, single bits at either edge
+    long long first_byte = (lo + 7) / 8;
+    long long last_byte = hi / 8;
+    if (first_byte < last_byte) {
+        memset(bitmap + first_byte, 0xFF, last_byte - first_byte);
+    }
+    for (long long i = lo; i < hi && i < first_byte * 8; i++) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+    for (long long i = last_byte * 8 > lo ? last_byte * 8 : lo; i < hi; i++) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long long disk_size = DEFAULT_DISK_SIZE;
+    long long block_size = DEFAULT_BLOCK_SIZE;
+    long long journal_blocks = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:j:")) != -1) {
+        switch (opt) {
+        case 's': disk_size = parse_size(optarg); break;
+        case 'b': block_size = parse_size(optarg); break;
+        case 'j': journal_blocks = parse_size(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-s image_size] [-b block_size] [-j journal_blocks]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    // Check the geometry and lay out the metadata
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "Block size must be a power of two between %d and %d\n",
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(1);
+    }
+    long long block_count = disk_size / block_size;
+    if (disk_size <= 0 || block_count > INT_MAX) {
+        fprintf(stderr, "Invalid image size\n");
+        exit(1);
+    }
+    if (journal_blocks == 0) {
+        journal_blocks = block_count / 32;
+        journal_blocks = journal_blocks < MIN_JOURNAL_BLOCKS ? MIN_JOURNAL_BLOCKS
+                         : journal_blocks > 8192 ? 8192 : journal_blocks;
+    }
+    if (journal_blocks < MIN_JOURNAL_BLOCKS) {
+        fprintf(stderr, "The journal needs at least %d blocks\n", MIN_JOURNAL_BLOCKS);
+        exit(1);
+    }
+    long long bitmap_blocks = (block_count + block_size * 8 - 1) / (block_size * 8);
+    long long refcount_blocks = (block_count + REFS_PER_BLOCK(block_size) - 1) /
+                                REFS_PER_BLOCK(block_size);
+    long long dedup_blocks = (block_count * 2 + block_size - 1) / block_size;  // 1 entry per 4
+    struct heartyfs_super sb = {
+        .magic = SUPER_MAGIC,
+        .version = SUPER_VERSION,
+        .block_size = block_size,
+        .block_count = block_count,
+        .bitmap_start = SUPER_BLOCK + 1,
+        .bitmap_blocks = bitmap_blocks,
+        .refcount_start = SUPER_BLOCK + 1 + bitmap_blocks,
+        .refcount_blocks = refcount_blocks,
+        .dedup_start = SUPER_BLOCK + 1 + bitmap_blocks + refcount_blocks,
+        .dedup_blocks = dedup_blocks,
+        .journal_start = SUPER_BLOCK + 1 + bitmap_blocks + refcount_blocks + dedup_blocks,
+        .journal_blocks = journal_blocks,
+    };
+    sb.root_block = sb.journal_start + journal_blocks;
+    sb.free_blocks = block_count - sb.root_block - 1;
+    if (sb.root_block + 1 >= block_count) {
+        fprintf(stderr, "Image too small for its metadata\n");
+        exit(1);
+    }
+
+    // Open the disk file, dropping whatever it held before
+    int fd = open(DISK_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (fd < 0) {
         perror("Cannot open the disk file\n");
         exit(1);
     }
 
-    // Zero out the entire disk file
-    void *zero_buffer = calloc(1, DISK_SIZE);
-    if (zero_buffer == NULL) {
-        perror("Cannot allocate memory\n");
-        close(fd);
-        exit(1);
+    // Drop the lookup cache, shared state and counters other processes kept
+    // for the old contents
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        char shm_name[64];
+        snprintf(shm_name, sizeof(shm_name), DCACHE_NAME_FORMAT,
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+        shm_unlink(shm_name);
+        snprintf(shm_name, sizeof(shm_name), SHARED_NAME_FORMAT,
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+        shm_unlink(shm_name);
+        snprintf(shm_name, sizeof(shm_name), COUNTERS_NAME_FORMAT,
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+        shm_unlink(shm_name);
     }
-    if (write(fd, zero_buffer, DISK_SIZE) != DISK_SIZE) {
-        perror("Cannot write to the disk file\n");
-        free(zero_buffer);
+
+    // Extend it to the image size. The file is left sparse: unwritten
+    // blocks read back as zeros, so only the metadata has to be written.
+    if (ftruncate(fd, block_count * block_size) != 0) {
+        perror("Cannot resize the disk file\n");
         close(fd);
         exit(1);
     }
-    free(zero_buffer);
 
-    // Map the disk file onto memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED) {
-        perror("Cannot map the disk file onto memory\n");
+    char *block = malloc(block_size);
+    if (block == NULL) {
+        perror("Cannot allocate memory\n");
         close(fd);
         exit(1);
     }
 
     // Initialize the superblock
-    struct heartyfs_directory *root = (struct heartyfs_directory *)buffer;
-    root->type = 1;
+    memset(block, 0, block_size);
+    memcpy(block, &sb, sizeof(sb));
+    write_block(fd, block, block_size, SUPER_BLOCK);
+
+    // Initialize the bitmap: every block after the root directory is free
+    for (long long i = 0; i < bitmap_blocks; i++) {
+        fill_bitmap_block((unsigned char *)block, block_size, i * block_size * 8,
+                          sb.root_block + 1, block_count);
+        write_block(fd, block, block_size, sb.bitmap_start + i);
+    }
+
+    // The reference counts and the dedup index start out empty, which the
+    // sparse file already reads as
+
+    // Initialize an empty journal
+    memset(block, 0, block_size);
+    struct heartyfs_journal_header *journal = (struct heartyfs_journal_header *)block;
+    journal->magic = JOURNAL_MAGIC;
+    journal->sequence = 1;
+    journal->start = 0;
+    write_block(fd, block, block_size, sb.journal_start);
+
+    // Initialize the root directory
+    memset(block, 0, block_size);
+    struct heartyfs_directory *root = (struct heartyfs_directory *)block;
+    root->type = INODE_TYPE_DIR;
     strcpy(root->name, "/");
     root->size = 2;
-    root->entries[0].block_id = 0;
+    root->count = 2;
+    root->entries[0].block_id = sb.root_block;
     strcpy(root->entries[0].file_name, ".");
-    root->entries[1].block_id = 0;
+    root->entries[1].block_id = sb.root_block;
     strcpy(root->entries[1].file_name, "..");
-
-    // Initialize the bitmap
-    unsigned char *bitmap = (unsigned char *)(buffer + BLOCK_SIZE);
-    memset(bitmap, 0xFF, 256); // Set all bits to 1 (free)
+    write_block(fd, block, block_size, sb.root_block);
 
     // Flush changes to disk
-    msync(buffer, DISK_SIZE, MS_SYNC);
+    if (fsync(fd) != 0) {
+        perror("Cannot flush the disk file\n");
+        exit(1);
+    }
 
     // Clean up
-    munmap(buffer, DISK_SIZE);
+    free(block);
     close(fd);
 
     return 0;
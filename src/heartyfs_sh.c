@@ -0,0 +1,226 @@
+#include "heartyfs.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_ARGS 3
+
+// Print the write-back counters of this mount
+static void print_stats(struct heartyfs *fs) {
+    const struct heartyfs_stats *st = &fs->stats;
+    printf("ops %lu\n", st->ops);
+    printf("commits %lu\n", st->commits);
+    printf("checkpoints %lu\n", st->checkpoints);
+    printf("msync_calls %lu\n", st->flush_ranges);
+    printf("bytes_flushed %llu\n", st->bytes_flushed);
+    printf("bytes_flushed_per_commit %llu\n",
+           st->commits == 0 ? 0 : st->bytes_flushed / st->commits);
+    printf("last_bytes_flushed %llu\n", st->last_bytes_flushed);
+    printf("dcache_hits %lu\n", st->dcache_hits);
+    printf("dcache_misses %lu\n", st->dcache_misses);
+    printf("cache_hits %lu\n", st->cache_hits);
+    printf("cache_misses %lu\n", st->cache_misses);
+    printf("cache_evictions %lu\n", st->cache_evictions);
+    printf("readahead_blocks %lu\n", st->readahead_blocks);
+    printf("dedup_hits %lu\n", st->dedup_hits);
+    printf("dedup_misses %lu\n", st->dedup_misses);
+    printf("blocks_logged %llu\n", st->blocks_logged);
+    printf("data_blocks_written %llu\n", st->data_blocks_written);
+    printf("data_blocks_read %llu\n", st->data_blocks_read);
+}
+
+// Print the usage of the file system, like df
+static void print_df(struct heartyfs *fs) {
+    struct heartyfs_statfs st;
+    heartyfs_statfs(fs, &st);
+    printf("blocks %d\n", st.data_blocks);
+    printf("used %d\n", st.data_blocks - st.free_blocks);
+    printf("free %d\n", st.free_blocks);
+    printf("shared %d\n", st.shared_refs);
+}
+
+// Run one parsed command against the mounted file system. Returns a negative
+// errno value when the operation fails and 1 when the command is malformed.
+static int run_command(struct heartyfs *fs, int argc, char *argv[]) {
+    const char *op = argv[0];
+    if (strcmp(op, "mkdir") == 0 && argc == 2) {
+        return heartyfs_mkdir(fs, argv[1]);
+    }
+    if (strcmp(op, "rmdir") == 0 && argc == 2) {
+        return heartyfs_rmdir(fs, argv[1]);
+    }
+    if (strcmp(op, "creat") == 0 && argc == 2) {
+        return heartyfs_creat(fs, argv[1]);
+    }
+    if (strcmp(op, "rm") == 0 && argc == 2) {
+        return heartyfs_rm(fs, argv[1]);
+    }
+    if (strcmp(op, "read") == 0 && argc == 2) {
+        fflush(stdout);
+        return heartyfs_read(fs, argv[1], STDOUT_FILENO);
+    }
+    if (strcmp(op, "write") == 0 && argc == 3) {
+        int src_fd = open(argv[2], O_RDONLY);
+        if (src_fd < 0) {
+            return -errno;
+        }
+        int rc = heartyfs_write(fs, argv[1], src_fd);
+        close(src_fd);
+        return rc;
+    }
+    if (strcmp(op, "clone") == 0 && argc == 3) {
+        return heartyfs_clone(fs, argv[1], argv[2]);
+    }
+    if (strcmp(op, "snapshot") == 0 && argc == 2) {
+        return heartyfs_snapshot(fs, argv[1]);
+    }
+    if (strcmp(op, "rmsnapshot") == 0 && argc == 2) {
+        return heartyfs_snapshot_remove(fs, argv[1]);
+    }
+    if (strcmp(op, "sync") == 0 && argc == 1) {
+        return heartyfs_sync(fs);
+    }
+    if (strcmp(op, "df") == 0 && argc == 1) {
+        print_df(fs);
+        return 0;
+    }
+    if (strcmp(op, "stats") == 0 && argc == 1) {
+        print_stats(fs);
+        return 0;
+    }
+    return 1;
+}
+
+// heartyfs_sh reads one operation per line from a script (or stdin) and
+// runs them all against a single mapping of the disk file:
+//
+//     mkdir /dir1/
+//     creat /dir1/abc.xyz
+//     write /dir1/abc.xyz /home/pnx/random.txt
+//     read /dir1/abc.xyz
+//     rm /dir1/abc.xyz
+//     rmdir /dir1/
+//     clone /dir1/abc.xyz /dir1/copy.xyz
+//     snapshot monday
+//     rmsnapshot monday
+//     sync
+//     stats
+//     df
+//
+// Blank lines and lines starting with '#' are ignored. With -g ops, up to
+// ops operations are committed together as one journal transaction; `sync`
+// commits whatever has gathered so far. With -r the image is mounted
+// read-only: reads never wait for writers and anything else fails. -o
+// picks the backend that moves file data (mmap, pread or uring), -d
+// makes it bypass the page cache, and -c sets the size of the block cache
+// the copying ones keep, in KiB. With -z, files are written compressed,
+// and with -D, data blocks already in the image are shared, not written.
+int main(int argc, char *argv[]) {
+    int group_ops = 1;
+    int readonly = 0;
+    const char *backend = "mmap";
+    int direct = 0;
+    long cache_kib = CACHE_BYTES / 1024;
+    int compress = 0;
+    int dedup = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "g:ro:dc:zD")) != -1) {
+        if (opt == 'g') {
+            group_ops = atoi(optarg);
+        } else if (opt == 'r') {
+            readonly = 1;
+        } else if (opt == 'o') {
+            backend = optarg;
+        } else if (opt == 'd') {
+            direct = 1;
+        } else if (opt == 'c') {
+            cache_kib = atol(optarg);
+        } else if (opt == 'z') {
+            compress = 1;
+        } else if (opt == 'D') {
+            dedup = 1;
+        } else {
+            argc = -1;
+            break;
+        }
+    }
+    if (argc < 0 || argc - optind > 1 || cache_kib < 0) {
+        fprintf(stderr, "Usage: %s [-r] [-g ops] [-o backend] [-d] [-c cache_kib] [-z] [-D] [script]\n",
+                argv[0]);
+        return 1;
+    }
+
+    FILE *in = stdin;
+    if (optind < argc) {
+        in = fopen(argv[optind], "r");
+        if (in == NULL) {
+            perror("Cannot open the script");
+            return 1;
+        }
+    }
+
+    struct heartyfs fs;
+    int rc = readonly ? heartyfs_mount_readonly(&fs, DISK_FILE_PATH) :
+                        heartyfs_mount(&fs, DISK_FILE_PATH);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot mount %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return 1;
+    }
+    heartyfs_set_group_commit(&fs, group_ops);
+    heartyfs_set_compress(&fs, compress);
+    heartyfs_set_dedup(&fs, dedup);
+    heartyfs_set_cache(&fs, (size_t)cache_kib * 1024);
+    rc = heartyfs_set_backend(&fs, backend, direct);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot use the %s backend%s: %s\n", backend,
+                direct ? " with O_DIRECT" : "", strerror(-rc));
+        heartyfs_unmount(&fs);
+        return 1;
+    }
+    if (strcmp(fs.backend->name, backend) != 0) {
+        fprintf(stderr, "No %s here, using %s\n", backend, fs.backend->name);
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    int line_no = 0;
+    int failures = 0;
+    while (getline(&line, &line_cap, in) != -1) {
+        line_no++;
+
+        char *args[MAX_ARGS + 1];
+        int nargs = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (nargs == 0 && tok[0] == '#') {
+                break;
+            }
+            if (nargs == MAX_ARGS + 1) {
+                nargs++;
+                break;
+            }
+            args[nargs++] = tok;
+        }
+        if (nargs == 0) {
+            continue;
+        }
+
+        rc = nargs > MAX_ARGS ? 1 : run_command(&fs, nargs, args);
+        if (rc > 0) {
+            fprintf(stderr, "line %d: bad command: %s\n", line_no, args[0]);
+            failures++;
+        } else if (rc < 0) {
+            fprintf(stderr, "line %d: %s %s: %s\n", line_no, args[0],
+                    nargs > 1 ? args[1] : "", strerror(-rc));
+            failures++;
+        }
+    }
+
+    free(line);
+    heartyfs_unmount(&fs);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return failures == 0 ? 0 : 1;
+}
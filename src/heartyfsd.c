@@ -0,0 +1,217 @@
+#define _GNU_SOURCE  // accept4
+#include "heartyfs.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+
+// A worker thread serves one request at a time through a mount of its
+// own: a mount carries the state of the transaction being built, so it
+// cannot be shared between threads. The mounts share everything else
+// (the mapping's pages, the lookup cache, the journal) like processes do.
+struct worker {
+    pthread_t thread;
+    struct heartyfs fs;
+};
+
+// Workers wait on one epoll set holding the listening socket, every
+// connection and the stop pipe. Sockets are armed one-shot, so a request
+// goes to exactly one worker, and rearmed once it is answered.
+static int epoll_fd;
+static int listen_fd;
+static int stop_pipe[2];  // Readable once the daemon is asked to stop
+
+static void request_stop(int sig) {
+    (void)sig;
+    char byte = 0;
+    ssize_t n = write(stop_pipe[1], &byte, 1);
+    (void)n;  // If the pipe is full, it is readable already
+}
+
+// Wait for events on fd again
+static int arm(int fd, int op) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = fd};
+    return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static int run_request(struct heartyfs *fs, int op, const char *path, int fd) {
+    switch (op) {
+    case HEARTYFSD_MKDIR:
+        return heartyfs_mkdir(fs, path);
+    case HEARTYFSD_RMDIR:
+        return heartyfs_rmdir(fs, path);
+    case HEARTYFSD_CREAT:
+        return heartyfs_creat(fs, path);
+    case HEARTYFSD_RM:
+        return heartyfs_rm(fs, path);
+    case HEARTYFSD_READ:
+        return fd < 0 ? -EBADF : heartyfs_read(fs, path, fd);
+    case HEARTYFSD_WRITE:
+        return fd < 0 ? -EBADF : heartyfs_write(fs, path, fd);
+    }
+    return -EINVAL;
+}
+
+// Receive one request, run it and reply. Returns 0 when the connection is
+// done with.
+static int serve_request(struct heartyfs *fs, int conn) {
+    char buf[sizeof(struct heartyfsd_request) + HEARTYFSD_PATH_MAX + 1];
+    struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf) - 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return n < 0 && errno == EINTR;
+    }
+
+    int fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    struct heartyfsd_request req;
+    int32_t result = -EPROTO;
+    if ((size_t)n >= sizeof(req) && !(msg.msg_flags & MSG_TRUNC)) {
+        memcpy(&req, buf, sizeof(req));
+        if ((size_t)n == sizeof(req) + req.path_len) {
+            buf[n] = '\0';
+            result = run_request(fs, req.op, buf + sizeof(req), fd);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return send(conn, &result, sizeof(result), MSG_NOSIGNAL) == sizeof(result);
+}
+
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    struct epoll_event ev;
+    for (;;) {
+        int n = epoll_wait(epoll_fd, &ev, 1, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || ev.data.fd == stop_pipe[0]) {
+            return NULL;
+        }
+        int fd = ev.data.fd;
+        if (fd == listen_fd) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn >= 0 && arm(conn, EPOLL_CTL_ADD) < 0) {
+                close(conn);
+            }
+            arm(listen_fd, EPOLL_CTL_MOD);
+        } else if (serve_request(&worker->fs, fd)) {
+            arm(fd, EPOLL_CTL_MOD);
+        } else {
+            close(fd);
+        }
+    }
+}
+
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+// heartyfsd mounts the image once per worker thread and serves the
+// operations of heartyfsd_call() clients until SIGINT or SIGTERM. Every
+// operation commits before it is answered, as with the heartyfs_* tools.
+int main(int argc, char *argv[]) {
+    const char *socket_path = HEARTYFSD_SOCKET_PATH;
+    int threads = DEFAULT_THREADS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        if (opt == 's') {
+            socket_path = optarg;
+        } else if (opt == 't') {
+            threads = atoi(optarg);
+        } else {
+            argc = -1;
+            break;
+        }
+    }
+    if (argc < 0 || optind != argc || threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [-t threads] [-s socket_path]\n", argv[0]);
+        return 1;
+    }
+
+    if (pipe(stop_pipe) < 0) {
+        perror("Cannot create a pipe");
+        return 1;
+    }
+    struct sigaction sa = {.sa_handler = request_stop};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    static struct worker workers[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        int rc = heartyfs_mount(&workers[i].fs, DISK_FILE_PATH);
+        if (rc < 0) {
+            fprintf(stderr, "Cannot mount %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+            while (--i >= 0) {
+                heartyfs_unmount(&workers[i].fs);
+            }
+            return 1;
+        }
+    }
+    listen_fd = listen_on(socket_path);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event stop_ev = {.events = EPOLLIN, .data.fd = stop_pipe[0]};
+    if (listen_fd < 0 || epoll_fd < 0 || arm(listen_fd, EPOLL_CTL_ADD) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_pipe[0], &stop_ev) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        for (int i = 0; i < threads; i++) {
+            heartyfs_unmount(&workers[i].fs);
+        }
+        return 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    fprintf(stderr, "heartyfsd: serving %s on %s with %d threads\n", DISK_FILE_PATH,
+            socket_path, threads);
+
+    // Connections still open when the workers stop are closed with the
+    // process
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        heartyfs_unmount(&workers[i].fs);
+    }
+    unlink(socket_path);
+    return 0;
+}
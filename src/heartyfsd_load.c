@@ -0,0 +1,275 @@
+#include "heartyfs.h"
+#include <errno.h>
+#include <limits.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 64
+
+extern char **environ;
+
+// The operations of one round, in the order they run
+enum load_op { OP_MKDIR, OP_CREAT, OP_WRITE, OP_READ, OP_RM, OP_RMDIR, OP_COUNT };
+
+static const char *const op_names[OP_COUNT] = {"mkdir", "creat", "write", "read", "rm", "rmdir"};
+static const enum heartyfsd_op daemon_ops[OP_COUNT] = {
+    HEARTYFSD_MKDIR, HEARTYFSD_CREAT, HEARTYFSD_WRITE,
+    HEARTYFSD_READ, HEARTYFSD_RM, HEARTYFSD_RMDIR,
+};
+
+// What every client runs: rounds of each operation, through the daemon or
+// through the heartyfs_* tools
+struct load {
+    int use_daemon;
+    int rounds;
+    const char *socket_path;
+    const char *bin_dir;
+    const char *src_path;
+    long *latency[OP_COUNT];  // Nanoseconds, rounds per client
+    int failures;
+};
+
+struct client {
+    pthread_t thread;
+    struct load *load;
+    int id;
+    int sock;
+    int src_fd;
+    int null_fd;
+};
+
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Run bin_dir/heartyfs_<op> with its output thrown away and wait for it
+static int run_tool(struct client *client, const char *op, const char *path,
+                    const char *src_path) {
+    char tool[PATH_MAX];
+    snprintf(tool, sizeof(tool), "%s/heartyfs_%s", client->load->bin_dir, op);
+    char *argv[] = {tool, (char *)path, (char *)src_path, NULL};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, client->null_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, client->null_fd, STDERR_FILENO);
+    pid_t pid;
+    int rc = posix_spawn(&pid, tool, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        return -rc;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EIO;
+}
+
+static int run_op(struct client *client, enum load_op op, const char *path) {
+    struct load *load = client->load;
+    if (load->use_daemon) {
+        int fd = -1;
+        if (op == OP_WRITE) {
+            lseek(client->src_fd, 0, SEEK_SET);  // The daemon reads from our offset
+            fd = client->src_fd;
+        } else if (op == OP_READ) {
+            fd = client->null_fd;
+        }
+        return heartyfsd_call(client->sock, daemon_ops[op], path, fd);
+    }
+    return run_tool(client, op_names[op], path, op == OP_WRITE ? load->src_path : NULL);
+}
+
+static void *client_main(void *arg) {
+    struct client *client = arg;
+    struct load *load = client->load;
+    const char *prefix = load->use_daemon ? "daemon" : "cli";
+    char dir[MAX_NAME_LENGTH + 2];
+    snprintf(dir, sizeof(dir), "/%s%d", prefix, client->id);
+    int failures = run_op(client, OP_MKDIR, dir) < 0;
+
+    char paths[OP_COUNT][64];
+    for (int i = 0; i < load->rounds; i++) {
+        snprintf(paths[OP_MKDIR], sizeof(paths[0]), "%s/d%d", dir, i);
+        snprintf(paths[OP_CREAT], sizeof(paths[0]), "%s/f%d", dir, i);
+        strcpy(paths[OP_WRITE], paths[OP_CREAT]);
+        strcpy(paths[OP_READ], paths[OP_CREAT]);
+        strcpy(paths[OP_RM], paths[OP_CREAT]);
+        strcpy(paths[OP_RMDIR], paths[OP_MKDIR]);
+        for (int op = 0; op < OP_COUNT; op++) {
+            long start = now_ns();
+            failures += run_op(client, op, paths[op]) < 0;
+            load->latency[op][client->id * load->rounds + i] = now_ns() - start;
+        }
+    }
+    failures += run_op(client, OP_RMDIR, dir) < 0;
+
+    pthread_mutex_lock(&failures_lock);
+    load->failures += failures;
+    pthread_mutex_unlock(&failures_lock);
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Run the load with clients threads and return how long it took, or -1 if
+// the daemon cannot be reached
+static long run_load(struct load *load, int clients) {
+    static struct client client[MAX_CLIENTS];
+    int src_fd = open(load->src_path, O_RDONLY);
+    int null_fd = open("/dev/null", O_WRONLY);
+    for (int i = 0; i < clients; i++) {
+        client[i] = (struct client){
+            .load = load, .id = i, .sock = -1, .src_fd = src_fd, .null_fd = null_fd,
+        };
+        if (load->use_daemon) {
+            // One open file description each, so the offsets stay apart
+            client[i].src_fd = open(load->src_path, O_RDONLY);
+            client[i].sock = heartyfsd_connect(load->socket_path);
+            if (client[i].sock < 0) {
+                fprintf(stderr, "Cannot connect to %s: %s\n", load->socket_path,
+                        strerror(-client[i].sock));
+                return -1;
+            }
+        }
+    }
+
+    long start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&client[i].thread, NULL, client_main, &client[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(client[i].thread, NULL);
+    }
+    long elapsed = now_ns() - start;
+
+    for (int i = 0; i < clients; i++) {
+        if (load->use_daemon) {
+            close(client[i].sock);
+            close(client[i].src_fd);
+        }
+    }
+    close(src_fd);
+    close(null_fd);
+    for (int op = 0; op < OP_COUNT; op++) {
+        qsort(load->latency[op], (size_t)clients * load->rounds, sizeof(long), compare_long);
+    }
+    return elapsed;
+}
+
+// Create the file every write copies in
+static int make_source(char *path, int bytes) {
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    char buf[4096];
+    for (int i = 0; i < (int)sizeof(buf); i++) {
+        buf[i] = 'a' + i % 26;
+    }
+    for (int left = bytes; left > 0;) {
+        int chunk = left < (int)sizeof(buf) ? left : (int)sizeof(buf);
+        if (write(fd, buf, chunk) != chunk) {
+            close(fd);
+            return -1;
+        }
+        left -= chunk;
+    }
+    close(fd);
+    return 0;
+}
+
+// heartyfsd_load runs the same rounds of mkdir, creat, write, read, rm and
+// rmdir from each of clients threads, first through a running heartyfsd
+// and then by launching the heartyfs_* tools, and prints the median and
+// 99th percentile latency of each operation both ways.
+int main(int argc, char *argv[]) {
+    int rounds = 200;
+    int clients = 1;
+    int bytes = 4096;
+    const char *socket_path = HEARTYFSD_SOCKET_PATH;
+    const char *bin_dir = "bin";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:b:s:B:")) != -1) {
+        if (opt == 'n') {
+            rounds = atoi(optarg);
+        } else if (opt == 'c') {
+            clients = atoi(optarg);
+        } else if (opt == 'b') {
+            bytes = atoi(optarg);
+        } else if (opt == 's') {
+            socket_path = optarg;
+        } else if (opt == 'B') {
+            bin_dir = optarg;
+        } else {
+            argc = -1;
+            break;
+        }
+    }
+    if (argc < 0 || optind != argc || rounds < 1 || clients < 1 || clients > MAX_CLIENTS ||
+        bytes < 0) {
+        fprintf(stderr, "Usage: %s [-n rounds] [-c clients] [-b write_bytes] "
+                        "[-s socket_path] [-B bin_dir]\n", argv[0]);
+        return 1;
+    }
+
+    char src_path[] = "/tmp/heartyfsd_load.XXXXXX";
+    if (make_source(src_path, bytes) < 0) {
+        perror("Cannot create the source file");
+        return 1;
+    }
+    struct load loads[2];
+    long elapsed[2];
+    for (int mode = 0; mode < 2; mode++) {
+        loads[mode] = (struct load){
+            .use_daemon = mode == 0, .rounds = rounds, .socket_path = socket_path,
+            .bin_dir = bin_dir, .src_path = src_path,
+        };
+        for (int op = 0; op < OP_COUNT; op++) {
+            loads[mode].latency[op] = calloc((size_t)clients * rounds, sizeof(long));
+        }
+        elapsed[mode] = run_load(&loads[mode], clients);
+        if (elapsed[mode] < 0) {
+            unlink(src_path);
+            return 1;
+        }
+    }
+    unlink(src_path);
+
+    size_t samples = (size_t)clients * rounds;
+    printf("%d client%s, %d rounds each, %d-byte writes (latency in us)\n", clients,
+           clients == 1 ? "" : "s", rounds, bytes);
+    printf("%-6s %12s %12s %12s %12s\n", "op", "daemon p50", "daemon p99", "cli p50", "cli p99");
+    for (int op = 0; op < OP_COUNT; op++) {
+        printf("%-6s", op_names[op]);
+        for (int mode = 0; mode < 2; mode++) {
+            const long *lat = loads[mode].latency[op];
+            printf(" %12.1f %12.1f", lat[samples / 2] / 1000.0, lat[samples * 99 / 100] / 1000.0);
+        }
+        printf("\n");
+    }
+    int failures = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        printf("%s: %.0f ops/sec, %d failed\n", mode == 0 ? "daemon" : "cli",
+               samples * OP_COUNT * 1e9 / elapsed[mode], loads[mode].failures);
+        failures += loads[mode].failures;
+        for (int op = 0; op < OP_COUNT; op++) {
+            free(loads[mode].latency[op]);
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,370 @@
+#include "../heartyfs.h"
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// The bitmap starts at fs->bitmap_start and keeps one bit per block,
+// 1 = free. Blocks below fs->data_start (superblock, bitmap, journal, root
+// directory) and the padding bits after the last block are always 0, so
+// the allocator can take any set bit it finds. It works on 64-bit words,
+// starts where the previous allocation left off and hands out runs of
+// consecutive blocks where it can. The number of set bits is kept in the
+// superblock so that nothing has to count them.
+//
+// Every process mounting the image allocates from the shared mapping at
+// once, so the bitmap and the free count are updated in place with atomic
+// operations: bits are claimed with compare-and-swap on whole words.
+// Frees are different. They may not take effect before the transaction
+// that makes them is durable, so they are applied at commit time, first
+// to the images the transaction logs and then, once it is written, to the
+// bitmap itself.
+//
+// Data blocks can be shared (see heartyfs_dedup.c). The reference counts
+// after the bitmap are live blocks too, but only change under the journal
+// lock: references are taken in place, and a free of a block that still
+// has other references only drops one, applied at commit like a free. A
+// block freed for good has its count cleared.
+
+// Get a pointer to word w of a bitmap; bit i of the word (once converted
+// from little-endian) is block i of the 64 it covers
+static uint64_t *word_ptr(void *bitmap, int w) {
+    return (uint64_t *)((char *)bitmap + (size_t)w * 8);
+}
+
+// The whole bitmap, as every process sees it
+static void *bitmap_base(struct heartyfs *fs) {
+    return (char *)fs->disk + (size_t)fs->bitmap_start * fs->block_size;
+}
+
+// Load bitmap word w
+static uint64_t bitmap_word(struct heartyfs *fs, int w) {
+    return le64toh(__atomic_load_n(word_ptr(bitmap_base(fs), w), __ATOMIC_ACQUIRE));
+}
+
+// Claim the free blocks in [first, end) a word at a time. Another process
+// may take some of them first; the claim then stops at the first block it
+// lost. Returns the end of what was claimed, first if nothing was.
+static int claim_run(struct heartyfs *fs, int first, int end) {
+    int pos = first;
+    while (pos < end) {
+        uint64_t *word = word_ptr(bitmap_base(fs), pos / 64);
+        int lo = pos % 64;
+        int hi = end - (pos - lo) < 64 ? end - (pos - lo) : 64;
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        int n;
+        do {
+            // The free bits from lo on, up to the first taken one or hi
+            uint64_t taken = ~(le64toh(old) >> lo);
+            n = taken == 0 ? 64 : __builtin_ctzll(taken);
+            n = n < hi - lo ? n : hi - lo;
+            if (n == 0) {
+                return pos;
+            }
+        } while (!__atomic_compare_exchange_n(
+            word, &old, old & ~htole64((n == 64 ? ~0ULL : (1ULL << n) - 1) << lo), 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        pos += n;
+        if (lo + n < hi) {
+            break;
+        }
+    }
+    return pos;
+}
+
+// Find the first free block at or after the cursor, wrapping around once
+static int find_free(struct heartyfs *fs) {
+    int total_words = (fs->block_count + 63) / 64;
+    int start = fs->alloc_cursor / 64;
+    for (int n = 0; n < total_words; n++) {
+        int w = start + n < total_words ? start + n : start + n - total_words;
+        uint64_t word = bitmap_word(fs, w);
+        if (word != 0) {
+            HEARTYFS_COUNT(fs, COUNT_BITS_SCANNED, n * 64 + __builtin_ctzll(word) + 1);
+            return w * 64 + __builtin_ctzll(word);
+        }
+    }
+    HEARTYFS_COUNT(fs, COUNT_BITS_SCANNED, total_words * 64);
+    return -ENOSPC;
+}
+
+// Allocate a run of up to want consecutive blocks, starting at the first
+// free block after the previous allocation. The run never crosses into
+// another bitmap block, so it dirties one bitmap block and the superblock.
+// Returns the first block and stores the length of the run in length.
+int heartyfs_alloc_run(struct heartyfs *fs, int want, int *length) {
+    struct heartyfs_super *sb = heartyfs_block(fs, SUPER_BLOCK);
+    HEARTYFS_TIME_START(start);
+    int first;
+    int end;
+    do {
+        if (__atomic_load_n(&sb->free_blocks, __ATOMIC_RELAXED) == 0 ||
+            (first = find_free(fs)) < 0) {
+            HEARTYFS_TIME_END(fs, PHASE_ALLOC, start);  // Failures take time too
+            return -ENOSPC;
+        }
+
+        // Extend the run over the free bits that follow, a word at a time
+        int bits_per_block = fs->block_size * 8;
+        int limit = first - first % bits_per_block + bits_per_block;
+        limit = limit < fs->block_count ? limit : fs->block_count;
+        limit = limit - first < want ? limit : first + want;
+        end = first + 1;
+        while (end < limit) {
+            uint64_t rest = ~(bitmap_word(fs, end / 64) >> (end % 64));
+            int ones = rest == 0 ? 64 : __builtin_ctzll(rest);
+            HEARTYFS_COUNT(fs, COUNT_BITS_SCANNED, ones == 64 ? 64 : ones + 1);
+            if (ones == 0) {
+                break;
+            }
+            end += ones;
+        }
+        end = claim_run(fs, first, end < limit ? end : limit);
+
+        // Lost the first block to another process: look again from there
+        fs->alloc_cursor = end < fs->block_count ? end : fs->data_start;
+    } while (end == first);
+
+    heartyfs_block_log(fs, fs->bitmap_start + first / (fs->block_size * 8));
+    heartyfs_block_log(fs, SUPER_BLOCK);
+    __atomic_fetch_sub(&sb->free_blocks, end - first, __ATOMIC_RELAXED);
+    HEARTYFS_COUNT(fs, COUNT_ALLOCS, 1);
+    HEARTYFS_COUNT(fs, COUNT_BLOCKS_ALLOCATED, end - first);
+    HEARTYFS_TIME_END(fs, PHASE_ALLOC, start);
+    *length = end - first;
+    return first;
+}
+
+// Whether a block is allocated
+int heartyfs_block_in_use(struct heartyfs *fs, int block_id) {
+    return !(bitmap_word(fs, block_id / 64) & (1ULL << (block_id % 64)));
+}
+
+// Allocate a single block
+int heartyfs_alloc_block(struct heartyfs *fs) {
+    int length;
+    return heartyfs_alloc_run(fs, 1, &length);
+}
+
+// Mark a block as free once the running transaction commits. Until then
+// the committed state may still point at it, so it must not be reused.
+void heartyfs_free_block(struct heartyfs *fs, int block_id) {
+    if (block_id < fs->data_start || block_id >= fs->block_count) {
+        return;
+    }
+    if (fs->pending_free_count == fs->pending_free_cap) {
+        int cap = fs->pending_free_cap == 0 ? 64 : fs->pending_free_cap * 2;
+        int *grown = realloc(fs->pending_free, cap * sizeof(int));
+        if (grown == NULL) {
+            return;  // The block leaks rather than risk being reused early
+        }
+        fs->pending_free = grown;
+        fs->pending_free_cap = cap;
+    }
+    fs->pending_free[fs->pending_free_count++] = block_id;
+}
+
+// The reference count block holding the entry of block_id
+static int ref_block(struct heartyfs *fs, int block_id) {
+    return fs->refcount_start + block_id / REFS_PER_BLOCK(fs->block_size);
+}
+
+// Get a pointer to the entry of block_id, in place or (for the commit
+// under way) in the image the transaction logs
+static uint16_t *ref_ptr(struct heartyfs *fs, int block_id, int installed) {
+    uint16_t *refs = installed ? heartyfs_block(fs, ref_block(fs, block_id))
+                               : heartyfs_txn_image(fs, ref_block(fs, block_id));
+    return refs + block_id % REFS_PER_BLOCK(fs->block_size);
+}
+
+// The reference count entry of a block: REF_INDEXED, and the references
+// it has besides the first
+unsigned int heartyfs_ref_entry(struct heartyfs *fs, int block_id) {
+    return *ref_ptr(fs, block_id, 1);
+}
+
+// Take another reference to a data block in use, so that it stays
+// allocated until every file pointing at it has let go. The caller holds
+// the journal lock. Fails with -EMLINK if the count is full.
+int heartyfs_ref_get(struct heartyfs *fs, int block_id) {
+    uint16_t *ref = ref_ptr(fs, block_id, 1);
+    if ((*ref & REF_MAX) == REF_MAX) {
+        return -EMLINK;
+    }
+    heartyfs_block_log(fs, ref_block(fs, block_id));
+    struct heartyfs_super *sb = heartyfs_block_log(fs, SUPER_BLOCK);
+    (*ref)++;
+    __atomic_fetch_add(&sb->shared_refs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Note that the dedup index points at a data block in use. Like the index
+// itself, this is only a hint: it is not logged, and a crash may lose it.
+// The caller holds the journal lock.
+void heartyfs_ref_index(struct heartyfs *fs, int block_id) {
+    *ref_ptr(fs, block_id, 1) |= REF_INDEXED;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Sort the n frees at blocks, all of shared blocks, into drops of a
+// reference and frees of blocks released once more than they are shared
+// (a file may share a block with itself), the frees first. Returns the
+// number of frees.
+static int split_drops(struct heartyfs *fs, int *blocks, int n) {
+    qsort(blocks, n, sizeof(int), compare_blocks);
+    int frees = 0;
+    for (int i = 0; i < n;) {
+        int block_id = blocks[i];
+        int count = heartyfs_ref_entry(fs, block_id) & REF_MAX;
+        int j = i;
+        while (j < n && blocks[j] == block_id) {
+            j++;
+        }
+        if (j - i > count) {
+            // Swap one of them to the front as a free
+            blocks[i] = blocks[frees];
+            blocks[frees++] = block_id;
+        }
+        i = j;
+    }
+    return frees;
+}
+
+// Pick the frees deferred by heartyfs_free_block() that go into the
+// transaction being committed, and add the bitmap blocks they touch (and
+// the superblock) to it. A free whose bitmap block does not fit in the
+// transaction any more stays pending for the next one. Frees of shared
+// blocks only drop a reference; they log the block's reference counts,
+// and are sorted after the frees proper (txn_drop_count of them).
+void heartyfs_release_pending(struct heartyfs *fs) {
+    int bits_per_block = fs->block_size * 8;
+    int taken = 0;
+    int plain = 0;  // Of blocks that are not shared, at the front
+    for (int i = 0; i < fs->pending_free_count; i++) {
+        int block_id = fs->pending_free[i];
+        int bitmap_block = fs->bitmap_start + block_id / bits_per_block;
+        unsigned int entry = heartyfs_ref_entry(fs, block_id);
+        int missing = !heartyfs_in_txn(fs, bitmap_block) + !heartyfs_in_txn(fs, SUPER_BLOCK) +
+                      (entry != 0 && !heartyfs_in_txn(fs, ref_block(fs, block_id)));
+        if (fs->txn_count + missing > fs->txn_max) {
+            continue;
+        }
+        heartyfs_block_log(fs, bitmap_block);
+        heartyfs_block_log(fs, SUPER_BLOCK);
+        if (entry != 0) {
+            heartyfs_block_log(fs, ref_block(fs, block_id));
+        }
+        fs->pending_free[i] = fs->pending_free[taken];
+        fs->pending_free[taken++] = block_id;
+        if ((entry & REF_MAX) == 0) {
+            fs->pending_free[taken - 1] = fs->pending_free[plain];
+            fs->pending_free[plain++] = block_id;
+        }
+    }
+    int *shared = fs->pending_free + plain;
+    int frees = split_drops(fs, shared, taken - plain);
+    fs->txn_free_count = plain + frees;
+    fs->txn_drop_count = taken - plain - frees;
+}
+
+// Apply the frees picked by heartyfs_release_pending(): to the images of
+// the transaction before it is written, and to the bitmap once it is
+// installed, after which they are no longer pending
+void heartyfs_apply_frees(struct heartyfs *fs, int installed) {
+    int bits_per_block = fs->block_size * 8;
+    int count = fs->txn_free_count;
+    int drops = fs->txn_drop_count;
+    if (count + drops == 0) {
+        return;  // The superblock may not even be in the transaction
+    }
+    for (int i = 0; i < count; i++) {
+        int block_id = fs->pending_free[i];
+        int bitmap_block = fs->bitmap_start + block_id / bits_per_block;
+        int bit = block_id % bits_per_block;
+        void *bitmap = installed ? heartyfs_block(fs, bitmap_block)
+                                 : heartyfs_txn_image(fs, bitmap_block);
+        uint64_t mask = htole64(1ULL << (bit % 64));
+        if (installed) {
+            heartyfs_free_note(fs, block_id);
+        }
+        if (heartyfs_ref_entry(fs, block_id) != 0) {
+            *ref_ptr(fs, block_id, installed) = 0;
+        }
+        __atomic_fetch_or(word_ptr(bitmap, bit / 64), mask, __ATOMIC_RELEASE);
+    }
+    for (int i = count; i < count + drops; i++) {
+        uint16_t *ref = ref_ptr(fs, fs->pending_free[i], installed);
+        if ((*ref & REF_MAX) > 0) {
+            (*ref)--;
+        }
+    }
+    struct heartyfs_super *sb = installed ? heartyfs_block(fs, SUPER_BLOCK)
+                                          : heartyfs_txn_image(fs, SUPER_BLOCK);
+    __atomic_fetch_add(&sb->free_blocks, count, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&sb->shared_refs, drops, __ATOMIC_RELAXED);
+    if (installed) {
+        HEARTYFS_COUNT(fs, COUNT_BLOCKS_FREED, count);
+        HEARTYFS_COUNT(fs, COUNT_REFS_DROPPED, drops);
+        fs->pending_free_count -= count + drops;
+        memmove(fs->pending_free, fs->pending_free + count + drops,
+                fs->pending_free_count * sizeof(int));
+        fs->txn_free_count = 0;
+        fs->txn_drop_count = 0;
+    }
+}
+
+// Clear the reference counts of free blocks and count the shared
+// references afresh. A process that died before committing may have left
+// counts in place for blocks its allocations never made it to the bitmap
+// for. Only done by the first process to mount the image, after replay.
+void heartyfs_ref_scrub(struct heartyfs *fs) {
+    struct heartyfs_super *sb = heartyfs_block(fs, SUPER_BLOCK);
+    unsigned int shared = 0;
+    for (int b = 0; b < fs->refcount_blocks; b++) {
+        uint16_t *refs = heartyfs_block(fs, fs->refcount_start + b);
+        int first = b * REFS_PER_BLOCK(fs->block_size);
+        int changed = 0;
+        for (int i = 0; i < REFS_PER_BLOCK(fs->block_size) && first + i < fs->block_count; i++) {
+            int block_id = first + i;
+            if (refs[i] == 0) {
+                continue;
+            }
+            if (bitmap_word(fs, block_id / 64) & (1ULL << (block_id % 64))) {
+                refs[i] = 0;
+                changed = 1;
+            }
+            shared += refs[i] & REF_MAX;
+        }
+        if (changed) {
+            heartyfs_flush_blocks(fs, fs->refcount_start + b, 1);
+        }
+    }
+    if (sb->shared_refs != shared) {
+        sb->shared_refs = shared;
+        heartyfs_flush_blocks(fs, SUPER_BLOCK, 1);
+    }
+}
+
+// Count the free blocks by scanning the bitmap, for checking the count
+// kept in the superblock
+int heartyfs_count_free(struct heartyfs *fs) {
+    int total_words = (fs->block_count + 63) / 64;
+    int count = 0;
+    for (int w = 0; w < total_words; w++) {
+        count += __builtin_popcountll(bitmap_word(fs, w));
+    }
+    return count;
+}
+
+// Report the size and usage of the file system without scanning anything
+void heartyfs_statfs(struct heartyfs *fs, struct heartyfs_statfs *st) {
+    const struct heartyfs_super *sb = heartyfs_block(fs, SUPER_BLOCK);
+    st->block_size = fs->block_size;
+    st->block_count = fs->block_count;
+    st->data_blocks = fs->block_count - fs->data_start;
+    st->free_blocks = sb->free_blocks;
+    st->shared_refs = sb->shared_refs;
+}
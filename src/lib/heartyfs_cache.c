@@ -0,0 +1,224 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+
+// Copying backends keep the data blocks they read in a cache private to
+// the mount, of fs->cache_bytes at most. Slots are found through a hash of
+// block numbers and reused in CLOCK order: the hand sweeps the slots,
+// giving those used since it last passed a second chance, and takes the
+// first that was not. Slots handed out by heartyfs_cache_get() or
+// heartyfs_cache_reserve() are pinned until heartyfs_cache_unpin(), so
+// the hand passes them by. Since the hand moves on one slot at a time, the
+// slots reserved for a run of blocks mostly follow each other, and the
+// run can be read into them in one go.
+//
+// Data blocks are never written in place, only after being freed and
+// allocated again. So a copy stays good until its block is freed, which
+// every mount counts per stripe of blocks (heartyfs_free_note()); a slot
+// whose stripe has seen a free since it was read is a miss.
+
+struct heartyfs_cache_slot {
+    int block;                 // Or -1 if the slot is unused
+    unsigned int free_seq;     // Of the block's stripe before it was read
+    int next;                  // Next slot in the same hash bucket, or -1
+    int pins;
+    unsigned char referenced;  // Used since the hand last passed
+    unsigned char filling;     // Reserved, with the read still under way
+};
+
+struct heartyfs_cache {
+    int capacity;
+    int hand;
+    unsigned int bucket_mask;
+    int *buckets;
+    struct heartyfs_cache_slot *slots;
+    char *data;
+};
+
+static int *bucket_of(struct heartyfs_cache *cache, int block_id) {
+    return &cache->buckets[(unsigned int)block_id * 2654435761U & cache->bucket_mask];
+}
+
+static char *slot_data(struct heartyfs *fs, struct heartyfs_cache *cache, int slot) {
+    return cache->data + (size_t)slot * fs->block_size;
+}
+
+// The slot holding block_id, or -1
+static int find_slot(struct heartyfs_cache *cache, int block_id) {
+    int slot = *bucket_of(cache, block_id);
+    while (slot >= 0 && cache->slots[slot].block != block_id) {
+        slot = cache->slots[slot].next;
+    }
+    return slot;
+}
+
+static void unlink_slot(struct heartyfs_cache *cache, int slot) {
+    int *link = bucket_of(cache, cache->slots[slot].block);
+    while (*link != slot) {
+        link = &cache->slots[*link].next;
+    }
+    *link = cache->slots[slot].next;
+    cache->slots[slot].block = -1;
+}
+
+// Pick a slot to reuse, or -1 if every one is pinned
+static int evict(struct heartyfs *fs, struct heartyfs_cache *cache) {
+    for (int scanned = 0; scanned < 2 * cache->capacity; scanned++) {
+        int slot = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+        struct heartyfs_cache_slot *s = &cache->slots[slot];
+        if (s->pins > 0) {
+            continue;
+        }
+        if (s->block < 0) {
+            return slot;
+        }
+        if (s->referenced) {
+            s->referenced = 0;
+            continue;
+        }
+        unlink_slot(cache, slot);
+        fs->stats.cache_evictions++;
+        return slot;
+    }
+    return -1;
+}
+
+// Set the most memory the block cache may use; 0 turns it off. Takes
+// effect at once if a copying backend is in use, and otherwise when one is
+// picked.
+int heartyfs_set_cache(struct heartyfs *fs, size_t bytes) {
+    fs->cache_bytes = bytes;
+    return fs->backend->mapped ? 0 : heartyfs_cache_init(fs);
+}
+
+// Set up an empty cache of fs->cache_bytes, dropping the one there was
+int heartyfs_cache_init(struct heartyfs *fs) {
+    heartyfs_cache_free(fs);
+    int capacity = fs->cache_bytes / fs->block_size;
+    if (capacity == 0) {
+        return 0;
+    }
+    struct heartyfs_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return -ENOMEM;
+    }
+    unsigned int buckets = 1;
+    while (buckets < (unsigned int)capacity) {
+        buckets *= 2;
+    }
+    cache->capacity = capacity;
+    cache->bucket_mask = buckets - 1;
+    cache->buckets = malloc(buckets * sizeof(int));
+    cache->slots = malloc(capacity * sizeof(struct heartyfs_cache_slot));
+    void *data = NULL;
+    if (cache->buckets == NULL || cache->slots == NULL ||
+        posix_memalign(&data, fs->page_size, (size_t)capacity * fs->block_size) != 0) {
+        free(cache->buckets);
+        free(cache->slots);
+        free(cache);
+        return -ENOMEM;
+    }
+    cache->data = data;
+    memset(cache->buckets, 0xff, buckets * sizeof(int));
+    for (int i = 0; i < capacity; i++) {
+        cache->slots[i] = (struct heartyfs_cache_slot){.block = -1, .next = -1};
+    }
+    fs->cache = cache;
+    return 0;
+}
+
+void heartyfs_cache_free(struct heartyfs *fs) {
+    struct heartyfs_cache *cache = fs->cache;
+    if (cache == NULL) {
+        return;
+    }
+    free(cache->data);
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache);
+    fs->cache = NULL;
+}
+
+// The cached copy of block_id, pinned, or NULL if there is none that is
+// still good
+const void *heartyfs_cache_get(struct heartyfs *fs, int block_id) {
+    struct heartyfs_cache *cache = fs->cache;
+    if (cache == NULL) {
+        return NULL;
+    }
+    int slot = find_slot(cache, block_id);
+    if (slot >= 0 && (cache->slots[slot].filling ||
+                      cache->slots[slot].free_seq != heartyfs_free_seq(fs, block_id))) {
+        if (cache->slots[slot].pins == 0) {
+            unlink_slot(cache, slot);
+        }
+        slot = -1;
+    }
+    if (slot < 0) {
+        fs->stats.cache_misses++;
+        return NULL;
+    }
+    struct heartyfs_cache_slot *s = &cache->slots[slot];
+    fs->stats.cache_hits++;
+    s->referenced = 1;
+    s->pins++;
+    return slot_data(fs, cache, slot);
+}
+
+// A slot for block_id to be read into, pinned, or NULL if the cache is
+// off, full of pinned blocks or already has the block in use. It is not
+// found by lookups until heartyfs_cache_filled(), and must be given back
+// with heartyfs_cache_drop() if the read fails.
+void *heartyfs_cache_reserve(struct heartyfs *fs, int block_id) {
+    struct heartyfs_cache *cache = fs->cache;
+    if (cache == NULL) {
+        return NULL;
+    }
+    int slot = find_slot(cache, block_id);
+    if (slot >= 0 && cache->slots[slot].pins > 0) {
+        return NULL;
+    }
+    if (slot < 0) {
+        slot = evict(fs, cache);
+        if (slot < 0) {
+            return NULL;
+        }
+        int *bucket = bucket_of(cache, block_id);
+        cache->slots[slot].next = *bucket;
+        *bucket = slot;
+    }
+    // Taken before the read, so that a free racing with it shows
+    cache->slots[slot] = (struct heartyfs_cache_slot){
+        .block = block_id,
+        .free_seq = heartyfs_free_seq(fs, block_id),
+        .next = cache->slots[slot].next,
+        .pins = 1,
+        .referenced = 1,
+        .filling = 1,
+    };
+    return slot_data(fs, cache, slot);
+}
+
+static int slot_of(struct heartyfs *fs, const void *data) {
+    return ((const char *)data - fs->cache->data) / fs->block_size;
+}
+
+// Make a block read into a reserved slot visible to lookups. It stays
+// pinned.
+void heartyfs_cache_filled(struct heartyfs *fs, const void *data) {
+    fs->cache->slots[slot_of(fs, data)].filling = 0;
+}
+
+// Give back a reserved slot whose read failed
+void heartyfs_cache_drop(struct heartyfs *fs, const void *data) {
+    int slot = slot_of(fs, data);
+    fs->cache->slots[slot].pins--;
+    unlink_slot(fs->cache, slot);
+}
+
+// Let the hand have a block returned by heartyfs_cache_get() or
+// heartyfs_cache_reserve() again
+void heartyfs_cache_unpin(struct heartyfs *fs, const void *data) {
+    fs->cache->slots[slot_of(fs, data)].pins--;
+}
@@ -0,0 +1,67 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Connect to the heartyfsd listening on socket_path. Returns the socket or
+// a negative errno value.
+int heartyfsd_connect(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -errno;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int rc = -errno;
+        close(sock);
+        return rc;
+    }
+    return sock;
+}
+
+// Run one operation on the daemon and wait for its result, which is what
+// the matching heartyfs_*() call returned there. fd is the descriptor a
+// read copies to or a write copies from, and -1 otherwise.
+int heartyfsd_call(int sock, enum heartyfsd_op op, const char *path, int fd) {
+    size_t path_len = strlen(path);
+    if (path_len > HEARTYFSD_PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    struct heartyfsd_request req = {.op = op, .path_len = path_len};
+    struct iovec iov[2] = {
+        {.iov_base = &req, .iov_len = sizeof(req)},
+        {.iov_base = (void *)path, .iov_len = path_len},
+    };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    if (fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        return -errno;
+    }
+
+    int32_t result;
+    ssize_t n;
+    while ((n = recv(sock, &result, sizeof(result), 0)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) {
+        return -errno;
+    }
+    return n == sizeof(result) ? result : -EPROTO;
+}
@@ -0,0 +1,152 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Every process that mounts an image shares a cache of directory lookups,
+// kept in a POSIX shared-memory segment named after the image's device
+// and inode. Each slot maps (parent directory, name) to the block the
+// name points to, or to -ENOENT. A slot is only trusted if it was filled
+// under the current generation; the generation is bumped whenever a
+// transaction that added or removed names is committed, which makes every
+// older slot stale at once.
+//
+// Slots are written under a per-slot sequence lock: a writer makes the
+// sequence odd, fills the slot and makes it even again, and a reader
+// retries (here: treats it as a miss) if the sequence was odd or changed
+// while it copied the slot. A process that dies mid-write leaves its slot
+// odd, which only costs that one slot.
+
+static unsigned int slot_hash(int parent, const char *name) {
+    unsigned int hash = 2166136261U ^ (unsigned int)parent;
+    hash *= 16777619U;
+    for (const char *p = name; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619U;
+    }
+    return hash;
+}
+
+static struct heartyfs_dcache_entry *slot_of(struct heartyfs_dcache *dc, int parent,
+                                             const char *name) {
+    return &dc->slots[slot_hash(parent, name) & (dc->slot_count - 1)];
+}
+
+// Attach to the lookup cache of the image open on fs->fd, creating it if
+// this is the first process to mount the image. Running without a cache
+// is not an error.
+void heartyfs_dcache_attach(struct heartyfs *fs) {
+    struct stat st;
+    if (fstat(fs->fd, &st) != 0) {
+        return;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), DCACHE_NAME_FORMAT, (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino);
+
+    size_t size = sizeof(struct heartyfs_dcache) +
+                  DCACHE_SLOTS * sizeof(struct heartyfs_dcache_entry);
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        return;
+    }
+    if (created && ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return;
+    }
+    if (!created && (fstat(fd, &st) != 0 || (size_t)st.st_size != size)) {
+        close(fd);
+        return;
+    }
+    struct heartyfs_dcache *dc = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (dc == MAP_FAILED) {
+        return;
+    }
+
+    // A new segment is all zeros; the magic goes in last so that others
+    // never use a half-initialized one
+    if (created) {
+        dc->slot_count = DCACHE_SLOTS;
+        dc->generation = 1;
+        __atomic_store_n(&dc->magic, DCACHE_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&dc->magic, __ATOMIC_ACQUIRE) != DCACHE_MAGIC ||
+               dc->slot_count != DCACHE_SLOTS) {
+        munmap(dc, size);
+        return;
+    }
+    fs->dcache = dc;
+    fs->dcache_size = size;
+}
+
+void heartyfs_dcache_detach(struct heartyfs *fs) {
+    if (fs->dcache != NULL) {
+        munmap(fs->dcache, fs->dcache_size);
+        fs->dcache = NULL;
+    }
+}
+
+// The generation to tag a lookup with, read before the lookup starts
+unsigned int heartyfs_dcache_generation(struct heartyfs *fs) {
+    return fs->dcache == NULL ? 0 : __atomic_load_n(&fs->dcache->generation, __ATOMIC_ACQUIRE);
+}
+
+// Look name up in the cache. Returns the cached block or -ENOENT, or
+// DCACHE_MISS if the cache has nothing current to say. While this process
+// has uncommitted namespace changes its own view differs from what the
+// cache describes, so the cache is not consulted at all.
+int heartyfs_dcache_lookup(struct heartyfs *fs, int parent, const char *name) {
+    struct heartyfs_dcache *dc = fs->dcache;
+    if (dc == NULL || fs->namespace_dirty) {
+        return DCACHE_MISS;
+    }
+    struct heartyfs_dcache_entry *slot = slot_of(dc, parent, name);
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    struct heartyfs_dcache_entry copy;
+    memcpy(&copy, slot, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq & 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+        copy.generation != __atomic_load_n(&dc->generation, __ATOMIC_ACQUIRE) ||
+        copy.parent != parent || strncmp(copy.name, name, sizeof(copy.name)) != 0) {
+        fs->stats.dcache_misses++;
+        return DCACHE_MISS;
+    }
+    fs->stats.dcache_hits++;
+    return copy.block;
+}
+
+// Remember the result of a lookup that started under generation
+void heartyfs_dcache_insert(struct heartyfs *fs, unsigned int generation, int parent,
+                            const char *name, int block) {
+    struct heartyfs_dcache *dc = fs->dcache;
+    if (dc == NULL || fs->namespace_dirty || strlen(name) > MAX_NAME_LENGTH) {
+        return;
+    }
+    struct heartyfs_dcache_entry *slot = slot_of(dc, parent, name);
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;  // Someone else is writing this slot
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->generation = generation;
+    slot->parent = parent;
+    slot->block = block;
+    strncpy(slot->name, name, sizeof(slot->name));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Make every cached lookup stale, once the namespace changes of this
+// process have been committed and are visible to others
+void heartyfs_dcache_invalidate(struct heartyfs *fs) {
+    if (fs->dcache != NULL) {
+        __atomic_fetch_add(&fs->dcache->generation, 1, __ATOMIC_RELEASE);
+    }
+    fs->namespace_dirty = 0;
+}
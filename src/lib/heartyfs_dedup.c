@@ -0,0 +1,237 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// With dedup on, heartyfs_write() looks up each data block it wrote in an
+// index of blocks by the hash of their contents. If a block with the same
+// data turns up, the file points at that one instead, which takes another
+// reference to it, and gives its own back; otherwise the new block goes
+// into the index. The index lives in the dedup blocks of the image, and
+// like the reference counts, is only looked at and changed under the
+// journal lock. Entries are never removed: one whose block has been freed
+// lost REF_INDEXED with it, and is simply overwritten later.
+//
+// A new block only goes into the index once the transaction that wrote it
+// is durable (heartyfs_dedup_publish()), so a block another process finds
+// there is allocated and its data flushed for good. Until then it waits in
+// a table private to the mount, where later blocks written by the same
+// mount (in the same file, even) can still find it.
+
+// A block waiting to be indexed, or an empty slot (block 0)
+struct pending_slot {
+    uint64_t hash;
+    int block;
+};
+
+struct heartyfs_dedup_pending {
+    int mask;   // Slots - 1
+    int count;  // Slots in use
+    struct pending_slot slots[];
+};
+
+// Have heartyfs_write() share data blocks from now on, or stop. Files
+// written either way can be read, rewritten and removed as usual.
+void heartyfs_set_dedup(struct heartyfs *fs, int on) {
+    fs->dedup = on;
+}
+
+void heartyfs_dedup_free(struct heartyfs *fs) {
+    free(fs->dedup_buf);
+    free(fs->dedup_pending);
+    fs->dedup_buf = NULL;
+    fs->dedup_pending = NULL;
+}
+
+// Hash the size and the data of a data block, 8 bytes at a time
+static uint64_t hash_block(const struct heartyfs_data_block *db, int size) {
+    const char *p = db->data;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)size;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        hash = (hash ^ v) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 29;
+    return hash * 0xc4ceb9fe1a85ec53ULL;
+}
+
+// Get the bucket a hash falls in, and the index block it is in
+static struct heartyfs_dedup_entry *bucket_of(struct heartyfs *fs, uint64_t hash,
+                                              int *index_block) {
+    int per_block = fs->block_size / (DEDUP_WAYS * sizeof(struct heartyfs_dedup_entry));
+    uint64_t bucket = hash % ((uint64_t)fs->dedup_blocks * per_block);
+    *index_block = fs->dedup_start + bucket / per_block;
+    return (struct heartyfs_dedup_entry *)heartyfs_block(fs, *index_block) +
+           bucket % per_block * DEDUP_WAYS;
+}
+
+// Whether an entry points at a block the index still stands for
+static int entry_live(struct heartyfs *fs, const struct heartyfs_dedup_entry *entry) {
+    return entry->block >= fs->data_start && entry->block < fs->block_count &&
+           (heartyfs_ref_entry(fs, entry->block) & REF_INDEXED) &&
+           heartyfs_block_in_use(fs, entry->block);
+}
+
+// Whether block_id holds the same size bytes of data as db. Copying
+// backends read it through the block cache, where the blocks a run of
+// duplicates is compared against soon all are.
+static int same_data(struct heartyfs *fs, int block_id, const struct heartyfs_data_block *db,
+                     int size) {
+    if (fs->backend->mapped) {
+        const struct heartyfs_data_block *other = heartyfs_block(fs, block_id);
+        return other->size == size && memcmp(other->data, db->data, size) == 0;
+    }
+    const struct heartyfs_data_block *other = heartyfs_cache_get(fs, block_id);
+    void *slot = NULL;
+    if (other == NULL) {
+        slot = heartyfs_cache_reserve(fs, block_id);
+        if (slot == NULL && fs->dedup_buf == NULL &&
+            posix_memalign(&fs->dedup_buf, fs->page_size, fs->block_size) != 0) {
+            fs->dedup_buf = NULL;
+            return 0;
+        }
+        struct heartyfs_io io = {block_id, 1, slot != NULL ? slot : fs->dedup_buf};
+        if (heartyfs_dev_read(fs, &io, 1) < 0) {
+            if (slot != NULL) {
+                heartyfs_cache_drop(fs, slot);
+            }
+            return 0;
+        }
+        if (slot != NULL) {
+            heartyfs_cache_filled(fs, slot);
+        }
+        other = io.buf;
+    }
+    int same = other->size == size && memcmp(other->data, db->data, size) == 0;
+    if (other != fs->dedup_buf) {
+        heartyfs_cache_unpin(fs, other);
+    }
+    return same;
+}
+
+// Add a block to those waiting to be indexed, growing the table when it
+// is half full. A block left out for want of memory is just never shared.
+static void pending_add(struct heartyfs *fs, uint64_t hash, int block_id) {
+    struct heartyfs_dedup_pending *pending = fs->dedup_pending;
+    if (pending == NULL || (pending->count + 1) * 2 > pending->mask + 1) {
+        int slots = pending == NULL ? 1024 : (pending->mask + 1) * 2;
+        struct heartyfs_dedup_pending *grown =
+            calloc(1, sizeof(*grown) + slots * sizeof(struct pending_slot));
+        if (grown == NULL) {
+            return;
+        }
+        grown->mask = slots - 1;
+        fs->dedup_pending = grown;
+        if (pending != NULL) {
+            for (int i = 0; i <= pending->mask; i++) {
+                if (pending->slots[i].block != 0) {
+                    pending_add(fs, pending->slots[i].hash, pending->slots[i].block);
+                }
+            }
+            free(pending);
+        }
+        pending = grown;
+    }
+    int i = hash & pending->mask;
+    while (pending->slots[i].block != 0) {
+        i = (i + 1) & pending->mask;
+    }
+    pending->slots[i] = (struct pending_slot){hash, block_id};
+    pending->count++;
+}
+
+// Put a block in the index, in place of an entry that no longer counts if
+// there is one, and otherwise of the one the hash picks
+static void index_add(struct heartyfs *fs, uint64_t hash, int block_id) {
+    int index_block;
+    struct heartyfs_dedup_entry *bucket = bucket_of(fs, hash, &index_block);
+    int victim = -1;
+    for (int i = 0; i < DEDUP_WAYS && victim < 0; i++) {
+        if (!entry_live(fs, &bucket[i])) {
+            victim = i;
+        }
+    }
+    victim = victim >= 0 ? victim : (int)((hash >> 32) % DEDUP_WAYS);
+    bucket[victim].hash = hash >> 32;
+    bucket[victim].block = block_id;
+    heartyfs_ref_index(fs, block_id);
+}
+
+// Index the blocks written by the transaction just committed, except any
+// it freed. Called by heartyfs_commit() under the journal lock.
+void heartyfs_dedup_publish(struct heartyfs *fs) {
+    struct heartyfs_dedup_pending *pending = fs->dedup_pending;
+    if (pending == NULL || pending->count == 0) {
+        return;
+    }
+    for (int i = 0; i <= pending->mask; i++) {
+        struct pending_slot *slot = &pending->slots[i];
+        if (slot->block != 0 && heartyfs_block_in_use(fs, slot->block)) {
+            index_add(fs, slot->hash, slot->block);
+        }
+        slot->block = 0;
+    }
+    pending->count = 0;
+}
+
+// Take a reference to a block holding the same data as db, found among
+// the count candidates, and return it; or return 0 if there is none
+static int share(struct heartyfs *fs, const int *candidates, int count,
+                 const struct heartyfs_data_block *db, int size) {
+    for (int i = 0; i < count; i++) {
+        if (same_data(fs, candidates[i], db, size) && heartyfs_ref_get(fs, candidates[i]) == 0) {
+            fs->stats.dedup_hits++;
+            return candidates[i];
+        }
+    }
+    return 0;
+}
+
+// Find a block holding the same data as db, the contents of block_id,
+// which the caller has just written and not yet made reachable, and take
+// a reference to it; or have block_id indexed under that data once it is
+// committed, if there is none. Returns the block the file should point
+// at. The running transaction needs room for two more blocks.
+int heartyfs_dedup_block(struct heartyfs *fs, int block_id,
+                         const struct heartyfs_data_block *db) {
+    int size = db->size;
+    if (size <= 0 || size > DATA_PAYLOAD(fs->block_size)) {
+        return block_id;
+    }
+    uint64_t hash = hash_block(db, size);
+    int candidates[DEDUP_WAYS];
+    int count = 0;
+    int rc = heartyfs_lock_journal(fs);
+    if (rc < 0) {
+        return rc;
+    }
+
+    // Blocks in the index, then blocks written here and not committed yet
+    int index_block;
+    struct heartyfs_dedup_entry *bucket = bucket_of(fs, hash, &index_block);
+    for (int i = 0; i < DEDUP_WAYS; i++) {
+        if (bucket[i].hash == hash >> 32 && entry_live(fs, &bucket[i])) {
+            candidates[count++] = bucket[i].block;
+        }
+    }
+    int shared = share(fs, candidates, count, db, size);
+    struct heartyfs_dedup_pending *pending = fs->dedup_pending;
+    for (int i = hash & (pending != NULL ? pending->mask : 0); shared == 0 && pending != NULL &&
+         pending->slots[i].block != 0; i = (i + 1) & pending->mask) {
+        if (pending->slots[i].hash == hash) {
+            shared = share(fs, &pending->slots[i].block, 1, db, size);
+        }
+    }
+    if (shared == 0) {
+        pending_add(fs, hash, block_id);
+        fs->stats.dedup_misses++;
+    }
+    heartyfs_unlock_journal(fs);
+    return shared != 0 ? shared : block_id;
+}
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE  // O_DIRECT
+#include "../heartyfs.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 64
+
+// An io_uring set up by hand: the submission and completion rings shared
+// with the kernel, and the array of submission entries
+struct heartyfs_ring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static off_t io_offset(struct heartyfs *fs, int block) {
+    return (off_t)block * fs->block_size;
+}
+
+static size_t io_length(struct heartyfs *fs, const struct heartyfs_io *io) {
+    return (size_t)io->count * fs->block_size;
+}
+
+// Backends with nothing of their own to set up
+
+static int nothing_to_open(struct heartyfs *fs) {
+    (void)fs;
+    return 0;
+}
+
+static void nothing_to_close(struct heartyfs *fs) {
+    (void)fs;
+}
+
+// The mapping itself: copies to and from it, for callers that want data
+// in memory of their own. File reads and writes use it in place instead.
+
+static int mmap_read(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    for (int i = 0; i < count; i++) {
+        memcpy(ios[i].buf, heartyfs_block(fs, ios[i].block), io_length(fs, &ios[i]));
+    }
+    return 0;
+}
+
+static int mmap_write(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    for (int i = 0; i < count; i++) {
+        memcpy((char *)fs->disk + io_offset(fs, ios[i].block), ios[i].buf,
+               io_length(fs, &ios[i]));
+    }
+    return 0;
+}
+
+// pread and pwrite, one call per run
+
+// Move len bytes at offset, carrying on after short transfers
+static int transfer_full(int fd, int writing, char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = writing ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int pread_read(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    for (int i = 0; i < count; i++) {
+        int rc = transfer_full(fs->io_fd, 0, ios[i].buf, io_length(fs, &ios[i]),
+                               io_offset(fs, ios[i].block));
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+static int pread_write(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    for (int i = 0; i < count; i++) {
+        int rc = transfer_full(fs->io_fd, 1, ios[i].buf, io_length(fs, &ios[i]),
+                               io_offset(fs, ios[i].block));
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+// io_uring, through the raw system calls: every run of a batch is queued
+// and the lot is submitted and waited for with one io_uring_enter.
+
+static void ring_free(struct heartyfs_ring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static int uring_open(struct heartyfs *fs) {
+    struct heartyfs_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return -ENOMEM;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        int rc = -errno;
+        ring->fd = -1;
+        ring_free(ring);
+        return rc;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (ring->sq_ring != MAP_FAILED && ring->cq_ring != MAP_FAILED) {
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    }
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == NULL ||
+        ring->sqes == MAP_FAILED) {
+        int rc = -errno;
+        ring_free(ring);
+        return rc;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    fs->ring = ring;
+    return 0;
+}
+
+static void uring_close(struct heartyfs *fs) {
+    if (fs->ring != NULL) {
+        ring_free(fs->ring);
+        fs->ring = NULL;
+    }
+}
+
+// Queue count runs, submit them and wait for all of them. Runs the kernel
+// cut short are finished with plain pread or pwrite. If submitting fails,
+// the runs not submitted are taken back out of the ring, and the call
+// still waits for those in flight, which use the caller's buffers.
+static int uring_submit(struct heartyfs *fs, int writing, const struct heartyfs_io *ios,
+                        int count) {
+    struct heartyfs_ring *ring = fs->ring;
+    unsigned int tail = *ring->sq_tail;
+    for (int i = 0; i < count; i++) {
+        unsigned int index = (tail + i) & ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fs->io_fd;
+        sqe->addr = (unsigned long)ios[i].buf;
+        sqe->len = io_length(fs, &ios[i]);
+        sqe->off = io_offset(fs, ios[i].block);
+        sqe->user_data = i;
+        ring->sq_array[index] = index;
+    }
+    __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    int completed = 0;
+    int wanted = count;  // Runs to wait for
+    int rc = 0;
+    while (completed < wanted) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, wanted - submitted, wanted - completed,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && wanted == count) {
+            // The kernel took none of the rest, so they can be withdrawn
+            rc = -errno;
+            wanted = submitted;
+            __atomic_store_n(ring->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+            continue;
+        }
+        submitted += n > 0 ? n : 0;
+
+        unsigned int head = *ring->cq_head;
+        unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, completed++) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            const struct heartyfs_io *io = &ios[cqe->user_data];
+            size_t len = io_length(fs, io);
+            if (cqe->res < 0) {
+                rc = rc < 0 ? rc : cqe->res;
+            } else if ((size_t)cqe->res < len && rc == 0) {
+                rc = transfer_full(fs->io_fd, writing, (char *)io->buf + cqe->res,
+                                   len - cqe->res, io_offset(fs, io->block) + cqe->res);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+static int uring_transfer(struct heartyfs *fs, int writing, const struct heartyfs_io *ios,
+                          int count) {
+    for (int done = 0; done < count;) {
+        int chunk = count - done < (int)fs->ring->sq_entries ? count - done :
+                    (int)fs->ring->sq_entries;
+        int rc = uring_submit(fs, writing, ios + done, chunk);
+        if (rc < 0) {
+            return rc;
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+static int uring_read(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    return uring_transfer(fs, 0, ios, count);
+}
+
+static int uring_write(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    return uring_transfer(fs, 1, ios, count);
+}
+
+static const struct heartyfs_backend backends[] = {
+    {"mmap", 1, nothing_to_open, nothing_to_close, mmap_read, mmap_write},
+    {"pread", 0, nothing_to_open, nothing_to_close, pread_read, pread_write},
+    {"uring", 0, uring_open, uring_close, uring_read, uring_write},
+};
+
+// Close whatever the current backend opened and go back to the mapping.
+// A freshly mounted image starts out like this, with io_fd -1.
+void heartyfs_backend_reset(struct heartyfs *fs) {
+    if (fs->backend != NULL) {
+        fs->backend->close(fs);
+    }
+    if (fs->io_fd >= 0 && fs->io_fd != fs->fd) {
+        close(fs->io_fd);
+    }
+    free(fs->io_buf);
+    heartyfs_cache_free(fs);
+    fs->io_fd = fs->fd;
+    fs->io_buf = NULL;
+    fs->backend = &backends[0];
+}
+
+// Move file data with the backend called name: "mmap" (the default),
+// "pread" or "uring". With direct set, the copying backends bypass the
+// page cache (O_DIRECT), which needs blocks of at least a page. If the
+// kernel has no io_uring, "uring" settles for "pread"; fs->backend->name
+// tells which one is in use.
+int heartyfs_set_backend(struct heartyfs *fs, const char *name, int direct) {
+    const struct heartyfs_backend *backend = NULL;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i].name, name) == 0) {
+            backend = &backends[i];
+        }
+    }
+    if (backend == NULL || (direct && (backend->mapped ||
+                                       (size_t)fs->block_size < fs->page_size))) {
+        return -EINVAL;
+    }
+
+    heartyfs_backend_reset(fs);
+    if (backend->mapped) {
+        return 0;
+    }
+    if (direct) {
+        // The image again, as a file description of its own
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fs->fd);
+        fs->io_fd = open(path, (fs->readonly ? O_RDONLY : O_RDWR) | O_DIRECT | O_CLOEXEC);
+        if (fs->io_fd < 0) {
+            int rc = -errno;
+            fs->io_fd = fs->fd;
+            return rc;
+        }
+    }
+    if (posix_memalign(&fs->io_buf, fs->page_size, IO_BATCH_BYTES) != 0) {
+        fs->io_buf = NULL;
+        heartyfs_backend_reset(fs);
+        return -ENOMEM;
+    }
+    int rc = heartyfs_cache_init(fs);
+    if (rc < 0) {
+        heartyfs_backend_reset(fs);
+        return rc;
+    }
+    rc = backend->open(fs);
+    if (rc < 0 && backend->read == uring_read) {
+        backend = &backends[1];
+        rc = backend->open(fs);
+    }
+    if (rc < 0) {
+        heartyfs_backend_reset(fs);
+        return rc;
+    }
+    fs->backend = backend;
+    return 0;
+}
+
+// Blocks a copying backend moves per batch
+int heartyfs_batch_blocks(struct heartyfs *fs) {
+    int blocks = IO_BATCH_BYTES / fs->block_size;
+    return blocks > 0 ? blocks : 1;
+}
+
+// Read count runs of data blocks
+int heartyfs_dev_read(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    HEARTYFS_TIME_START(start);
+    int rc = fs->backend->read(fs, ios, count);
+    HEARTYFS_TIME_END(fs, PHASE_DEV_READ, start);
+    return rc;
+}
+
+// Write count runs of data blocks. They are flushed before the next
+// commit, like data blocks written in place.
+int heartyfs_dev_write(struct heartyfs *fs, const struct heartyfs_io *ios, int count) {
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < ios[i].count; j++) {
+            heartyfs_data_written(fs, ios[i].block + j);
+        }
+    }
+    HEARTYFS_TIME_START(start);
+    int rc = fs->backend->write(fs, ios, count);
+    HEARTYFS_TIME_END(fs, PHASE_DEV_WRITE, start);
+    return rc;
+}
+
+// Have the kernel start reading count runs of data blocks in, ahead of
+// their use: into the mapping, or the page cache under a copying backend.
+// One that bypasses the page cache has nowhere to put them.
+void heartyfs_dev_prefetch(struct heartyfs *fs, const struct heartyfs_extent *runs, int count) {
+    if (!fs->backend->mapped && fs->io_fd != fs->fd) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        off_t offset = io_offset(fs, runs[i].start);
+        size_t len = (size_t)runs[i].length * fs->block_size;
+        if (fs->backend->mapped) {
+            off_t page = offset & ~(off_t)(fs->page_size - 1);
+            madvise((char *)fs->disk + page, offset - page + len, MADV_WILLNEED);
+        } else {
+            posix_fadvise(fs->io_fd, offset, len, POSIX_FADV_WILLNEED);
+        }
+        fs->stats.readahead_blocks += runs[i].length;
+    }
+}
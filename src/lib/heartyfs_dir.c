@@ -0,0 +1,596 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Directory entries are kept packed: entries[0 .. size - 1] of a block are
+// in use, with "." and ".." always in the first two slots of the first
+// block. Names are NUL-padded to the full 28 bytes, which lets a whole name
+// be compared with two 16-byte loads.
+//
+// When the first block fills up, the directory is converted to an indexed
+// one, much like an ext3 htree: the first block keeps only "." and "..",
+// and every other entry lives in a leaf block chosen by the hash of its
+// name. The index root has depth 1 (it points at leaves) until it fills
+// up, and is then pushed down a level to depth 2. A full leaf is split at
+// the median hash of its entries, so entries with equal hashes always
+// share a leaf. Leaves are never merged again.
+//
+// Lookups and listings take no locks. They read through a read set (see
+// heartyfs_lock.c) and start over if a writer installed any block they
+// looked at meanwhile. Until they know that, what they read may be torn,
+// so sizes are clamped and block numbers checked before anything is
+// followed.
+
+// Hash of a name for the directory index (FNV-1a)
+static unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261U;
+    for (const char *p = name; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619U;
+    }
+    return hash;
+}
+
+// A size read without locks, cut down to what fits in a block
+static int clamp_size(int size, int max) {
+    return size < 0 ? 0 : size > max ? max : size;
+}
+
+// Number of entries in a block, as far as it can be trusted
+static int block_entries(struct heartyfs *fs, const struct heartyfs_directory *dir) {
+    return clamp_size(dir->size, DIR_ENTRIES(fs->block_size));
+}
+
+// Find the slot of name in one block of entries, or return -1
+static int find_in_block(struct heartyfs *fs, const struct heartyfs_directory *dir,
+                         const char *name) {
+    int size = block_entries(fs, dir);
+    size_t len = strlen(name);
+    if (len > MAX_NAME_LENGTH) {
+        return -1;
+    }
+    char key[32] = {0};
+    memcpy(key, name, len);
+#ifdef __SSE2__
+    // Compare bytes 0-15 and 12-27 of every name against the padded key
+    __m128i head = _mm_loadu_si128((const __m128i *)key);
+    __m128i tail = _mm_loadu_si128((const __m128i *)(key + 12));
+    for (int i = 0; i < size; i++) {
+        const char *file_name = dir->entries[i].file_name;
+        __m128i eq = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)file_name), head),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(file_name + 12)), tail));
+        if (_mm_movemask_epi8(eq) == 0xFFFF) {
+            HEARTYFS_COUNT(fs, COUNT_ENTRIES_COMPARED, i + 1);
+            return i;
+        }
+    }
+#else
+    for (int i = 0; i < size; i++) {
+        if (memcmp(dir->entries[i].file_name, key, sizeof(dir->entries[i].file_name)) == 0) {
+            HEARTYFS_COUNT(fs, COUNT_ENTRIES_COMPARED, i + 1);
+            return i;
+        }
+    }
+#endif
+    HEARTYFS_COUNT(fs, COUNT_ENTRIES_COMPARED, size);
+    return -1;
+}
+
+// Find the index entry covering hash: the last one whose hash is not
+// greater than it
+static int index_slot(struct heartyfs *fs, const struct heartyfs_dir_index *index,
+                      unsigned int hash) {
+    int lo = 0;
+    int hi = clamp_size(index->size, INDEX_ENTRIES(fs->block_size)) - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (index->entries[mid].hash <= hash) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// The blocks visited on the way from the index root to the leaf that
+// covers a hash
+struct index_path {
+    int depth;
+    int nodes[2];  // Index blocks, root first
+    int leaf;
+};
+
+// Read a block, through the read set if there is one. Returns NULL for
+// something that is not a block.
+static const void *get_block(struct heartyfs *fs, struct heartyfs_read_set *set, int block) {
+    if (set != NULL) {
+        return heartyfs_read_block(fs, set, block);
+    }
+    return block > 0 && block < fs->block_count ? heartyfs_block(fs, block) : NULL;
+}
+
+static int index_walk(struct heartyfs *fs, struct heartyfs_read_set *set, int root,
+                      unsigned int hash, struct index_path *path) {
+    const struct heartyfs_dir_index *index = get_block(fs, set, root);
+    if (index == NULL || index->depth < 1 || index->depth > 2) {
+        return -EIO;
+    }
+    path->depth = index->depth;
+    int block = root;
+    for (int level = 0; level < path->depth; level++) {
+        index = level == 0 ? index : get_block(fs, set, block);
+        if (index == NULL) {
+            return -EIO;
+        }
+        path->nodes[level] = block;
+        block = index->entries[index_slot(fs, index, hash)].block;
+    }
+    path->leaf = block;
+    return get_block(fs, set, block) == NULL ? -EIO : 0;
+}
+
+// Look name up in a directory through a read set
+static int find_entry(struct heartyfs *fs, struct heartyfs_read_set *set, int dir_block,
+                      const char *name) {
+    const struct heartyfs_directory *dir = heartyfs_read_block(fs, set, dir_block);
+    if (dir == NULL) {
+        return -EIO;
+    }
+    if (dir->type != INODE_TYPE_DIR) {
+        return -ENOTDIR;
+    }
+    int i = find_in_block(fs, dir, name);
+    if (i < 0 && dir->index != 0) {
+        struct index_path path;
+        int rc = index_walk(fs, set, dir->index, name_hash(name), &path);
+        if (rc < 0) {
+            return rc;
+        }
+        dir = heartyfs_block(fs, path.leaf);
+        i = find_in_block(fs, dir, name);
+    }
+    return i < 0 ? -ENOENT : dir->entries[i].block_id;
+}
+
+// Find name in a directory and return the block it points to. Results,
+// including misses, go through the shared lookup cache.
+int heartyfs_dir_find(struct heartyfs *fs, int dir_block, const char *name) {
+    int block = heartyfs_dcache_lookup(fs, dir_block, name);
+    if (block != DCACHE_MISS) {
+        return block;
+    }
+    unsigned int generation = heartyfs_dcache_generation(fs);
+    HEARTYFS_COUNT(fs, COUNT_LOOKUPS, 1);
+
+    struct heartyfs_read_set set;
+    do {
+        set.count = 0;
+        block = find_entry(fs, &set, dir_block, name);
+    } while (!heartyfs_read_valid(fs, &set));
+    if (block >= 0 || block == -ENOENT) {
+        heartyfs_dcache_insert(fs, generation, dir_block, name, block);
+    }
+    return block;
+}
+
+static void append_entry(struct heartyfs_directory *dir, const char *name, int block_id) {
+    struct heartyfs_dir_entry *entry = &dir->entries[dir->size++];
+    memset(entry, 0, sizeof(*entry));
+    entry->block_id = block_id;
+    strncpy(entry->file_name, name, sizeof(entry->file_name));
+}
+
+// Allocate the count blocks a change to a directory needs before it
+// modifies anything. Other processes allocate too, so the free count
+// checked beforehand does not guarantee them; if one cannot be had, those
+// already taken are given back.
+static int alloc_blocks(struct heartyfs *fs, int *blocks, int count) {
+    for (int i = 0; i < count; i++) {
+        blocks[i] = heartyfs_alloc_block(fs);
+        if (blocks[i] < 0) {
+            int rc = blocks[i];
+            while (i-- > 0) {
+                heartyfs_free_block(fs, blocks[i]);
+            }
+            return rc;
+        }
+    }
+    return 0;
+}
+
+// Start an allocated block as an empty leaf or index block
+static void new_leaf(struct heartyfs *fs, int block) {
+    struct heartyfs_directory *leaf = heartyfs_block_mut(fs, block);
+    memset(leaf, 0, fs->block_size);
+    leaf->type = INODE_TYPE_DIR_LEAF;
+}
+
+static void new_index(struct heartyfs *fs, int block, int depth) {
+    struct heartyfs_dir_index *index = heartyfs_block_mut(fs, block);
+    memset(index, 0, fs->block_size);
+    index->depth = depth;
+}
+
+// Add (hash, block) to an index block that has room, keeping it sorted
+static void index_add(struct heartyfs *fs, int node, unsigned int hash, int block) {
+    struct heartyfs_dir_index *index = heartyfs_block_mut(fs, node);
+    int i = index->size;
+    for (; i > 0 && index->entries[i - 1].hash > hash; i--) {
+        index->entries[i] = index->entries[i - 1];
+    }
+    index->entries[i].hash = hash;
+    index->entries[i].block = block;
+    index->size++;
+}
+
+// Move the upper half of a full index block into sibling, an allocated
+// block; its first hash is where it takes over
+static void index_split(struct heartyfs *fs, int node, int sibling) {
+    new_index(fs, sibling, 1);
+    struct heartyfs_dir_index *index = heartyfs_block_mut(fs, node);
+    struct heartyfs_dir_index *upper = heartyfs_block_mut(fs, sibling);
+    int keep = index->size / 2;
+    upper->size = index->size - keep;
+    memcpy(upper->entries, index->entries + keep, upper->size * sizeof(index->entries[0]));
+    memset(index->entries + keep, 0, upper->size * sizeof(index->entries[0]));
+    index->size = keep;
+}
+
+// Pick the hash at which to split a full leaf: the median hash of its
+// entries, moved up past duplicates of the lowest one so that both halves
+// are non-empty. Returns 0 if every entry has the same hash.
+static unsigned int split_hash(const struct heartyfs_directory *leaf) {
+    unsigned int lowest = name_hash(leaf->entries[0].file_name);
+    unsigned int best = 0;
+    int best_below = 0;
+    for (int i = 0; i < leaf->size; i++) {
+        unsigned int hash = name_hash(leaf->entries[i].file_name);
+        lowest = hash < lowest ? hash : lowest;
+    }
+    // The candidate whose count of smaller hashes is closest to half
+    for (int i = 0; i < leaf->size; i++) {
+        unsigned int hash = name_hash(leaf->entries[i].file_name);
+        if (hash == lowest) {
+            continue;
+        }
+        int below = 0;
+        for (int j = 0; j < leaf->size; j++) {
+            below += name_hash(leaf->entries[j].file_name) < hash;
+        }
+        if (best == 0 || abs(below - leaf->size / 2) < abs(best_below - leaf->size / 2)) {
+            best = hash;
+            best_below = below;
+        }
+    }
+    return best;
+}
+
+// Turn a directory whose first block is full into an indexed one with a
+// single leaf
+static int convert_to_indexed(struct heartyfs *fs, int dir_block) {
+    int blocks[2];
+    int rc = alloc_blocks(fs, blocks, 2);
+    if (rc < 0) {
+        return rc;
+    }
+    int leaf_block = blocks[0];
+    int root = blocks[1];
+    new_leaf(fs, leaf_block);
+    new_index(fs, root, 1);
+    struct heartyfs_directory *dir = heartyfs_block_mut(fs, dir_block);
+    struct heartyfs_directory *leaf = heartyfs_block_mut(fs, leaf_block);
+    leaf->size = dir->size - 2;
+    memcpy(leaf->entries, dir->entries + 2, leaf->size * sizeof(dir->entries[0]));
+    memset(dir->entries + 2, 0, leaf->size * sizeof(dir->entries[0]));
+    dir->size = 2;
+    dir->index = root;
+    index_add(fs, root, 0, leaf_block);
+    return 0;
+}
+
+// Add an entry to an indexed directory, splitting the leaf (and the index
+// above it) if needed. Everything that can fail is checked, and every block
+// the split takes allocated, before anything is modified.
+static int indexed_add(struct heartyfs *fs, int dir_block, const char *name, int block_id) {
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    unsigned int hash = name_hash(name);
+    struct index_path path;
+    int rc = index_walk(fs, NULL, dir->index, hash, &path);
+    if (rc < 0) {
+        return rc;
+    }
+
+    const struct heartyfs_directory *leaf = heartyfs_block(fs, path.leaf);
+    if (leaf->size < DIR_ENTRIES(fs->block_size)) {
+        append_entry(heartyfs_block_mut(fs, path.leaf), name, block_id);
+        return 0;
+    }
+
+    // The leaf is full: work out how to split it and what that costs
+    unsigned int split = split_hash(leaf);
+    if (split == 0) {
+        return -ENOSPC;  // Every name in the leaf has the same hash
+    }
+    int node = path.nodes[path.depth - 1];
+    const struct heartyfs_dir_index *bottom = heartyfs_block(fs, node);
+    const struct heartyfs_dir_index *root = heartyfs_block(fs, path.nodes[0]);
+    int needed = 1;
+    if (bottom->size == INDEX_ENTRIES(fs->block_size)) {
+        if (path.depth == 2 && root->size == INDEX_ENTRIES(fs->block_size)) {
+            return -ENOSPC;  // Both index levels are full
+        }
+        needed += path.depth == 1 ? 2 : 1;
+    }
+    int blocks[3];
+    rc = alloc_blocks(fs, blocks, needed);
+    if (rc < 0) {
+        return rc;
+    }
+    int *next = blocks;
+
+    // Make room in the index for the new leaf
+    if (bottom->size == INDEX_ENTRIES(fs->block_size)) {
+        if (path.depth == 1) {
+            // Push the full root down into a new index block
+            int child = *next++;
+            new_index(fs, child, 1);
+            struct heartyfs_dir_index *old_root = heartyfs_block_mut(fs, node);
+            struct heartyfs_dir_index *moved = heartyfs_block_mut(fs, child);
+            moved->size = old_root->size;
+            memcpy(moved->entries, old_root->entries, old_root->size * sizeof(old_root->entries[0]));
+            memset(old_root->entries, 0, old_root->size * sizeof(old_root->entries[0]));
+            old_root->size = 0;
+            old_root->depth = 2;
+            index_add(fs, node, 0, child);
+            path.nodes[1] = child;
+            path.depth = 2;
+            node = child;
+        }
+        int sibling = *next++;
+        index_split(fs, node, sibling);
+        const struct heartyfs_dir_index *upper = heartyfs_block(fs, sibling);
+        unsigned int sibling_hash = upper->entries[0].hash;
+        index_add(fs, path.nodes[0], sibling_hash, sibling);
+        node = split >= sibling_hash ? sibling : node;
+    }
+
+    // Move the upper half of the leaf into a new one
+    int new_block = *next;
+    new_leaf(fs, new_block);
+    struct heartyfs_directory *lower = heartyfs_block_mut(fs, path.leaf);
+    struct heartyfs_directory *upper = heartyfs_block_mut(fs, new_block);
+    int kept = 0;
+    for (int i = 0; i < lower->size; i++) {
+        if (name_hash(lower->entries[i].file_name) >= split) {
+            upper->entries[upper->size++] = lower->entries[i];
+        } else {
+            lower->entries[kept++] = lower->entries[i];
+        }
+    }
+    memset(lower->entries + kept, 0, (lower->size - kept) * sizeof(lower->entries[0]));
+    lower->size = kept;
+    index_add(fs, node, split, new_block);
+
+    append_entry(hash >= split ? upper : lower, name, block_id);
+    return 0;
+}
+
+// Add a new entry to a directory, growing it as needed
+int heartyfs_dir_add(struct heartyfs *fs, int dir_block, const char *name,
+                     int block_id) {
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    if (dir->index == 0 && dir->size == DIR_ENTRIES(fs->block_size)) {
+        int rc = convert_to_indexed(fs, dir_block);
+        if (rc < 0) {
+            return rc;
+        }
+        dir = heartyfs_block(fs, dir_block);
+    }
+
+    int rc = 0;
+    if (dir->index == 0) {
+        append_entry(heartyfs_block_mut(fs, dir_block), name, block_id);
+    } else {
+        rc = indexed_add(fs, dir_block, name, block_id);
+    }
+    if (rc == 0) {
+        struct heartyfs_directory *first = heartyfs_block_mut(fs, dir_block);
+        first->count++;
+        fs->namespace_dirty = 1;
+    }
+    return rc;
+}
+
+// Remove an entry from a directory, moving the last entry of its block
+// into its slot
+int heartyfs_dir_remove(struct heartyfs *fs, int dir_block, const char *name) {
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    int block = dir_block;
+    int i = find_in_block(fs, dir, name);
+    if (i >= 0 && i < 2) {
+        return -EINVAL;  // "." and ".." stay
+    }
+    if (i < 0 && dir->index != 0) {
+        struct index_path path;
+        int rc = index_walk(fs, NULL, dir->index, name_hash(name), &path);
+        if (rc < 0) {
+            return rc;
+        }
+        block = path.leaf;
+        i = find_in_block(fs, heartyfs_block(fs, block), name);
+    }
+    if (i < 0) {
+        return -ENOENT;
+    }
+
+    struct heartyfs_directory *entries = heartyfs_block_mut(fs, block);
+    entries->entries[i] = entries->entries[entries->size - 1];
+    memset(&entries->entries[entries->size - 1], 0, sizeof(struct heartyfs_dir_entry));
+    entries->size--;
+    struct heartyfs_directory *first = heartyfs_block_mut(fs, dir_block);
+    first->count--;
+    fs->namespace_dirty = 1;
+    return 0;
+}
+
+// A copy of a directory taken by a lock-free reader, with the sequence of
+// every block it was copied from so it can be checked afterwards
+struct listing {
+    struct heartyfs_dir_entry *entries;
+    int size;
+    int cap;
+    int *blocks;
+    unsigned int *seqs;
+    int block_count;
+    int block_cap;
+};
+
+// Grow an array of elem_size elements to hold at least need of them
+static int grow(void **array, int *cap, int need, size_t elem_size) {
+    if (need <= *cap) {
+        return 0;
+    }
+    int new_cap = *cap == 0 ? 16 : *cap;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    void *grown = realloc(*array, new_cap * elem_size);
+    if (grown == NULL) {
+        return -ENOMEM;
+    }
+    *array = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+// Note a block the listing depends on and return it, or NULL if it is not
+// a block or there is no memory (*rc says which)
+static const void *list_block(struct heartyfs *fs, struct listing *list, int block, int *rc) {
+    if (block <= 0 || block >= fs->block_count) {
+        *rc = -EIO;
+        return NULL;
+    }
+    int cap = list->block_cap;
+    *rc = grow((void **)&list->blocks, &cap, list->block_count + 1, sizeof(int));
+    if (*rc == 0) {
+        *rc = grow((void **)&list->seqs, &list->block_cap, list->block_count + 1,
+                   sizeof(unsigned int));
+    }
+    if (*rc < 0) {
+        return NULL;
+    }
+    list->blocks[list->block_count] = block;
+    list->seqs[list->block_count] = heartyfs_read_begin(fs, block);
+    list->block_count++;
+    return heartyfs_block(fs, block);
+}
+
+// Copy the entries of one block into the listing
+static int list_entries(struct heartyfs *fs, struct listing *list, int block) {
+    int rc;
+    const struct heartyfs_directory *dir = list_block(fs, list, block, &rc);
+    if (dir == NULL) {
+        return rc;
+    }
+    int size = block_entries(fs, dir);
+    rc = grow((void **)&list->entries, &list->cap, list->size + size, sizeof(dir->entries[0]));
+    if (rc < 0) {
+        return rc;
+    }
+    memcpy(list->entries + list->size, dir->entries, size * sizeof(dir->entries[0]));
+    list->size += size;
+    return 0;
+}
+
+// Copy every entry of a directory into the listing
+static int list_directory(struct heartyfs *fs, struct listing *list, int dir_block) {
+    int rc;
+    const struct heartyfs_directory *dir = list_block(fs, list, dir_block, &rc);
+    if (dir == NULL) {
+        return rc;
+    }
+    int index_block = dir->index;
+    rc = list_entries(fs, list, dir_block);
+    if (rc < 0 || index_block == 0) {
+        return rc;
+    }
+    const struct heartyfs_dir_index *root = list_block(fs, list, index_block, &rc);
+    if (root == NULL) {
+        return rc;
+    }
+    int depth = root->depth;
+    int size = clamp_size(root->size, INDEX_ENTRIES(fs->block_size));
+    for (int i = 0; i < size && rc == 0; i++) {
+        if (depth != 2) {
+            rc = list_entries(fs, list, root->entries[i].block);
+            continue;
+        }
+        const struct heartyfs_dir_index *child = list_block(fs, list, root->entries[i].block, &rc);
+        if (child == NULL) {
+            return rc;
+        }
+        int child_size = clamp_size(child->size, INDEX_ENTRIES(fs->block_size));
+        for (int j = 0; j < child_size && rc == 0; j++) {
+            rc = list_entries(fs, list, child->entries[j].block);
+        }
+    }
+    return rc;
+}
+
+// Whether no block the listing was copied from has been installed over
+static int listing_valid(struct heartyfs *fs, const struct listing *list) {
+    for (int i = 0; i < list->block_count; i++) {
+        if (heartyfs_read_changed(fs, list->blocks[i], list->seqs[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Call fn on every entry of a directory, "." and ".." first and the rest
+// in no particular order. Stops at and returns the first non-zero result.
+// The entries come from a consistent copy of the directory, so fn sees
+// each of them exactly once however it changes meanwhile.
+int heartyfs_dir_iterate(struct heartyfs *fs, int dir_block,
+                         int (*fn)(void *arg, const struct heartyfs_dir_entry *entry),
+                         void *arg) {
+    struct listing list = {0};
+    int rc;
+    do {
+        list.size = 0;
+        list.block_count = 0;
+        rc = list_directory(fs, &list, dir_block);
+    } while (rc != -ENOMEM && !listing_valid(fs, &list));
+
+    for (int i = 0; i < list.size && rc == 0; i++) {
+        rc = fn(arg, &list.entries[i]);
+    }
+    free(list.entries);
+    free(list.blocks);
+    free(list.seqs);
+    return rc;
+}
+
+// Release the index and leaf blocks of a directory. The first block is
+// left alone.
+void heartyfs_dir_release(struct heartyfs *fs, int dir_block) {
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    if (dir->index == 0) {
+        return;
+    }
+    const struct heartyfs_dir_index *root = heartyfs_block(fs, dir->index);
+    for (int i = 0; i < root->size; i++) {
+        if (root->depth == 2) {
+            const struct heartyfs_dir_index *child = heartyfs_block(fs, root->entries[i].block);
+            for (int j = 0; j < child->size; j++) {
+                heartyfs_free_block(fs, child->entries[j].block);
+            }
+        }
+        heartyfs_free_block(fs, root->entries[i].block);
+    }
+    heartyfs_free_block(fs, dir->index);
+}
@@ -0,0 +1,1280 @@
+#define _GNU_SOURCE  // vmsplice
+#include "../heartyfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IOV_BATCH 1024  // Blocks moved per readv/writev call (IOV_MAX on Linux)
+
+// Read into iov until it is full or EOF, retrying short reads. iov is
+// used up in the process. Returns the number of bytes read.
+static ssize_t readv_full(int fd, struct iovec *iov, int count) {
+    ssize_t done = 0;
+    while (count > 0) {
+        ssize_t n = readv(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+        for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) {
+            n -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return done;
+}
+
+// What heartyfs_write() copies in: first the bytes it read to find out
+// whether the file fits in its inode, then the rest of fd
+struct source {
+    int fd;
+    const char *head;
+    size_t head_len;
+};
+
+// readv_full() from a source
+static ssize_t source_readv(struct source *src, struct iovec *iov, int count) {
+    ssize_t done = 0;
+    while (src->head_len > 0 && count > 0) {
+        size_t n = src->head_len < iov->iov_len ? src->head_len : iov->iov_len;
+        memcpy(iov->iov_base, src->head, n);
+        src->head += n;
+        src->head_len -= n;
+        done += n;
+        if (n == iov->iov_len) {
+            iov++;
+            count--;
+        } else {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    if (count == 0) {
+        return done;
+    }
+    ssize_t n = readv_full(src->fd, iov, count);
+    return n < 0 ? n : done + n;
+}
+
+// Write everything described by iov, which is used up in the process.
+// With *splice set the segments are vmspliced into fd, a pipe, so that it
+// references the pages of the image instead of copying them; if the
+// kernel refuses, *splice is cleared and writev takes over.
+static int send_full(int fd, struct iovec *iov, int count, int *splice) {
+    while (count > 0) {
+        ssize_t n = *splice ? vmsplice(fd, iov, count, 0) : writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*splice && (errno == EINVAL || errno == ENOSYS)) {
+                *splice = 0;
+                continue;
+            }
+            return -errno;
+        }
+        for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) {
+            n -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Find the regular file named file_name in the locked directory at
+// parent_block, creating it if it does not exist yet
+static int find_or_create(struct heartyfs *fs, int parent_block, const char *file_name) {
+    int inode_block = heartyfs_dir_find(fs, parent_block, file_name);
+    if (inode_block >= 0) {
+        struct heartyfs_inode *inode = heartyfs_block(fs, inode_block);
+        return inode->type == INODE_TYPE_FILE ? inode_block : -EISDIR;
+    }
+    if (inode_block != -ENOENT) {
+        return inode_block;
+    }
+
+    inode_block = heartyfs_alloc_block(fs);
+    if (inode_block < 0) {
+        return inode_block;
+    }
+    int rc = heartyfs_dir_add(fs, parent_block, file_name, inode_block);
+    if (rc < 0) {
+        heartyfs_free_block(fs, inode_block);
+        return rc;
+    }
+    struct heartyfs_inode *inode = heartyfs_block_mut(fs, inode_block);
+    memset(inode, 0, fs->block_size);
+    inode->type = INODE_TYPE_FILE;
+    strcpy(inode->name, file_name);
+    return inode_block;
+}
+
+// Find the regular file named by path, creating it if it does not exist
+// yet, and the directory it is in. That stays locked until the write
+// commits.
+static int open_inode(struct heartyfs *fs, const char *path, int *dir_block) {
+    char file_name[MAX_NAME_LENGTH + 1];
+    int parent_block = heartyfs_lookup_parent_mut(fs, path, file_name);
+    if (parent_block < 0) {
+        return parent_block;
+    }
+    *dir_block = parent_block;
+    int rc = heartyfs_lock_dir(fs, parent_block);
+    if (rc < 0) {
+        return rc;
+    }
+    return find_or_create(fs, parent_block, file_name);
+}
+
+// Fill the data blocks of a run from src in place, IOV_BATCH blocks per
+// readv. Returns the number of bytes read, which is short only at EOF.
+static ssize_t fill_mapped(struct heartyfs *fs, struct source *src,
+                           const struct heartyfs_extent *extent) {
+    int payload = DATA_PAYLOAD(fs->block_size);
+    struct heartyfs_data_block *blocks[IOV_BATCH];
+    struct iovec iov[IOV_BATCH];
+    ssize_t total = 0;
+    for (int done = 0; done < extent->length; done += IOV_BATCH) {
+        int count = extent->length - done < IOV_BATCH ? extent->length - done : IOV_BATCH;
+        for (int i = 0; i < count; i++) {
+            blocks[i] = heartyfs_data_mut(fs, extent->start + done + i);
+            iov[i].iov_base = blocks[i]->data;
+            iov[i].iov_len = payload;
+        }
+        ssize_t n = source_readv(src, iov, count);
+        if (n < 0) {
+            return n;
+        }
+        for (int i = 0; i < count; i++) {
+            ssize_t left = n - (ssize_t)i * payload;
+            blocks[i]->size = left < 0 ? 0 : left < payload ? left : payload;
+        }
+        total += n;
+        if (n < (ssize_t)count * payload) {
+            break;
+        }
+    }
+    return total;
+}
+
+// Fill the data blocks of a run from src through a copying backend: each
+// batch is read into the staging buffer and written out with one call
+static ssize_t fill_staged(struct heartyfs *fs, struct source *src,
+                           const struct heartyfs_extent *extent) {
+    int payload = DATA_PAYLOAD(fs->block_size);
+    int batch = heartyfs_batch_blocks(fs);
+    batch = batch < IOV_BATCH ? batch : IOV_BATCH;
+    struct iovec iov[IOV_BATCH];
+    ssize_t total = 0;
+    for (int done = 0; done < extent->length; done += batch) {
+        int count = extent->length - done < batch ? extent->length - done : batch;
+        for (int i = 0; i < count; i++) {
+            struct heartyfs_data_block *db =
+                (void *)((char *)fs->io_buf + (size_t)i * fs->block_size);
+            iov[i].iov_base = db->data;
+            iov[i].iov_len = payload;
+        }
+        ssize_t n = source_readv(src, iov, count);
+        if (n < 0) {
+            return n;
+        }
+        int filled = (n + payload - 1) / payload;
+        for (int i = 0; i < filled; i++) {
+            struct heartyfs_data_block *db =
+                (void *)((char *)fs->io_buf + (size_t)i * fs->block_size);
+            ssize_t left = n - (ssize_t)i * payload;
+            db->size = left < payload ? left : payload;
+        }
+        struct heartyfs_io io = {extent->start + done, filled, fs->io_buf};
+        int rc = filled > 0 ? heartyfs_dev_write(fs, &io, 1) : 0;
+        if (rc < 0) {
+            return rc;
+        }
+        total += n;
+        if (n < (ssize_t)count * payload) {
+            break;
+        }
+    }
+    return total;
+}
+
+// Fill the data blocks of a run from src. Returns the number of bytes
+// read, which is short only at EOF.
+static ssize_t fill_run(struct heartyfs *fs, struct source *src,
+                        const struct heartyfs_extent *extent) {
+    return fs->backend->mapped ? fill_mapped(fs, src, extent) : fill_staged(fs, src, extent);
+}
+
+// Input of a compressed write that has yet to go into blocks
+struct packer {
+    int len;  // Bytes of it in fs->lz_buf
+    int pos;  // Bytes of those compressed so far
+    int eof;  // Whether the source has nothing more
+};
+
+// Fill the data blocks of a run with data from src compressed, one stream
+// per block, each block taking in as much as fits. Input is gathered in
+// fs->lz_buf, a megabyte at a time. Returns the number of blocks filled,
+// which is short only at EOF.
+static int fill_compressed(struct heartyfs *fs, struct source *src, struct packer *pk,
+                           const struct heartyfs_extent *extent) {
+    int payload = DATA_PAYLOAD(fs->block_size);
+    int batch = fs->backend->mapped ? extent->length : heartyfs_batch_blocks(fs);
+    int done = 0;
+    while (done < extent->length) {
+        int count = extent->length - done < batch ? extent->length - done : batch;
+        int i;
+        for (i = 0; i < count; i++) {
+            if (pk->len - pk->pos < LZ_MAX_RAW(fs->block_size) && !pk->eof) {
+                memmove(fs->lz_buf, fs->lz_buf + pk->pos, pk->len - pk->pos);
+                pk->len -= pk->pos;
+                pk->pos = 0;
+                struct iovec iov = {fs->lz_buf + pk->len, LZ_BUF_BYTES - pk->len};
+                ssize_t n = source_readv(src, &iov, 1);
+                if (n < 0) {
+                    return n;
+                }
+                pk->eof = n < LZ_BUF_BYTES - pk->len;
+                pk->len += n;
+            }
+            if (pk->pos == pk->len) {
+                break;
+            }
+            int block = extent->start + done + i;
+            struct heartyfs_data_block *db = fs->backend->mapped ?
+                heartyfs_data_mut(fs, block) :
+                (void *)((char *)fs->io_buf + (size_t)i * fs->block_size);
+            int end = pk->len - pk->pos < LZ_MAX_RAW(fs->block_size) ?
+                      pk->len : pk->pos + LZ_MAX_RAW(fs->block_size);
+            db->size = heartyfs_lz_compress(fs->lz_table, fs->lz_buf, &pk->pos, end, db->data,
+                                            payload);
+        }
+        if (!fs->backend->mapped && i > 0) {
+            struct heartyfs_io io = {extent->start + done, i, fs->io_buf};
+            int rc = heartyfs_dev_write(fs, &io, 1);
+            if (rc < 0) {
+                return rc;
+            }
+        }
+        done += i;
+        if (i < count) {
+            break;
+        }
+    }
+    return done;
+}
+
+// Release every block of the given extents
+static void free_extents(struct heartyfs *fs, const struct heartyfs_extent *extents,
+                         int count) {
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < extents[i].length; j++) {
+            heartyfs_free_block(fs, extents[i].start + j);
+        }
+    }
+}
+
+// Largest number of extents an inode can describe
+static int max_extents(struct heartyfs *fs) {
+    int per_block = EXTENTS_PER_BLOCK(fs->block_size);
+    return INODE_EXTENTS(fs->block_size) + per_block +
+           POINTERS_PER_BLOCK(fs->block_size) * per_block;
+}
+
+// Number of indirect blocks (including the double-indirect one) needed to
+// describe count extents
+static int map_blocks_needed(struct heartyfs *fs, int count) {
+    int per_block = EXTENTS_PER_BLOCK(fs->block_size);
+    int rest = count - INODE_EXTENTS(fs->block_size);
+    if (rest <= 0) {
+        return 0;
+    }
+    rest -= per_block;
+    return rest <= 0 ? 1 : 2 + (rest + per_block - 1) / per_block;
+}
+
+// Whether block is somewhere a file may keep its extents
+static int map_block_ok(struct heartyfs *fs, int block) {
+    return block >= fs->data_start && block < fs->block_count;
+}
+
+// Get extent i of a file, or NULL if the blocks that lead to it are not
+// blocks (which lock-free readers may see before they find out the inode
+// changed under them)
+static const struct heartyfs_extent *file_extent(struct heartyfs *fs,
+                                                 const struct heartyfs_inode *inode, int i) {
+    int per_block = EXTENTS_PER_BLOCK(fs->block_size);
+    if (i < 0) {
+        return NULL;
+    }
+    if (i < INODE_EXTENTS(fs->block_size)) {
+        return &inode->extents[i];
+    }
+    i -= INODE_EXTENTS(fs->block_size);
+    if (i < per_block) {
+        if (!map_block_ok(fs, inode->indirect)) {
+            return NULL;
+        }
+        return (struct heartyfs_extent *)heartyfs_block(fs, inode->indirect) + i;
+    }
+    i -= per_block;
+    if (i / per_block >= POINTERS_PER_BLOCK(fs->block_size) ||
+        !map_block_ok(fs, inode->double_indirect)) {
+        return NULL;
+    }
+    const int *pointers = heartyfs_block(fs, inode->double_indirect);
+    int block = pointers[i / per_block];
+    if (!map_block_ok(fs, block)) {
+        return NULL;
+    }
+    return (struct heartyfs_extent *)heartyfs_block(fs, block) + i % per_block;
+}
+
+// Release the data, indirect and tail blocks of a file. The inode itself
+// is left alone.
+void heartyfs_release_file(struct heartyfs *fs, const struct heartyfs_inode *inode) {
+    if (inode->flags & INODE_INLINE) {
+        return;
+    }
+    if (inode->tail.block != 0) {
+        heartyfs_tail_release(fs, &inode->tail);
+    }
+    for (int i = 0; i < inode->size; i++) {
+        const struct heartyfs_extent *extent = file_extent(fs, inode, i);
+        if (extent != NULL) {
+            free_extents(fs, extent, 1);
+        }
+    }
+    if (inode->double_indirect != 0) {
+        const int *pointers = heartyfs_block(fs, inode->double_indirect);
+        for (int i = 0; i < POINTERS_PER_BLOCK(fs->block_size) && pointers[i] != 0; i++) {
+            heartyfs_free_block(fs, pointers[i]);
+        }
+        heartyfs_free_block(fs, inode->double_indirect);
+    }
+    if (inode->indirect != 0) {
+        heartyfs_free_block(fs, inode->indirect);
+    }
+}
+
+// Point an inode at count extents, writing the ones that do not fit in it
+// to the freshly allocated blocks in map. Those blocks are not reachable
+// until the inode is committed, so they are written like data blocks
+// rather than through the journal.
+static void store_extents(struct heartyfs *fs, struct heartyfs_inode *inode,
+                          const struct heartyfs_extent *extents, int count, const int *map) {
+    int direct = INODE_EXTENTS(fs->block_size);
+    int per_block = EXTENTS_PER_BLOCK(fs->block_size);
+    int n = count < direct ? count : direct;
+    memset(inode->extents, 0, direct * sizeof(*extents));
+    memcpy(inode->extents, extents, n * sizeof(*extents));
+    inode->size = count;
+    inode->indirect = 0;
+    inode->double_indirect = 0;
+    inode->flags = 0;
+    memset(&inode->tail, 0, sizeof(inode->tail));
+
+    for (int i = 0; n < count; i++) {
+        int block = map[i];
+        if (i == 0) {
+            inode->indirect = block;
+        } else if (i == 1) {
+            inode->double_indirect = block;
+            int *pointers = heartyfs_data_mut(fs, block);
+            memset(pointers, 0, fs->block_size);
+            for (int j = 2; j < map_blocks_needed(fs, count); j++) {
+                pointers[j - 2] = map[j];
+            }
+            continue;
+        }
+        int chunk = count - n < per_block ? count - n : per_block;
+        struct heartyfs_extent *dst = heartyfs_data_mut(fs, block);
+        memset(dst, 0, fs->block_size);
+        memcpy(dst, extents + n, chunk * sizeof(*extents));
+        n += chunk;
+    }
+}
+
+// Keep the len bytes at data in the inode, in place of the extents
+static void store_inline(struct heartyfs *fs, struct heartyfs_inode *inode, const char *data,
+                         int len) {
+    memset(inode->extents, 0, INLINE_BYTES(fs->block_size));
+    memcpy(inode->extents, data, len);
+    inode->size = len;
+    inode->indirect = 0;
+    inode->double_indirect = 0;
+    inode->flags = INODE_INLINE;
+    memset(&inode->tail, 0, sizeof(inode->tail));
+}
+
+// Move the last block of a file written as extents into its directory's
+// tail block, if it holds no more than len bytes (and those are few enough
+// to pack). The block is given back, and the extents shortened.
+static void pack_tail(struct heartyfs *fs, int dir_block, struct heartyfs_extent *extents,
+                      int *count, int len, struct heartyfs_tail *tail) {
+    if (*count == 0 || len <= 0 || len > TAIL_BYTES(fs->block_size) / 2) {
+        return;
+    }
+    struct heartyfs_extent *last = &extents[*count - 1];
+    struct heartyfs_extent block = {last->start + last->length - 1, 1};
+    const struct heartyfs_data_block *db;
+    if (fs->backend->mapped) {
+        db = heartyfs_block(fs, block.start);
+    } else {
+        struct heartyfs_io io = {block.start, 1, fs->io_buf};
+        if (heartyfs_dev_read(fs, &io, 1) < 0) {
+            return;
+        }
+        db = fs->io_buf;
+    }
+    if (heartyfs_tail_pack(fs, dir_block, db->data, len, tail) < 0) {
+        return;  // It stays a block
+    }
+    free_extents(fs, &block, 1);
+    if (--last->length == 0) {
+        (*count)--;
+    }
+}
+
+// Make sure the running transaction has room for another allocation. A
+// long write on fragmented free space may dirty more bitmap blocks than a
+// transaction holds; what has gathered so far is committed then. Blocks
+// reserved by the write are not referenced yet, so a crash from here on
+// can only leak them. The directory lock is kept throughout.
+static int make_room(struct heartyfs *fs) {
+    if (fs->txn_count + OP_MAX_BLOCKS > fs->txn_max) {
+        return heartyfs_sync_keep_locks(fs);
+    }
+    return 0;
+}
+
+// Add a block to a list of extents, joining it to the last one if it
+// follows on
+static void append_block(struct heartyfs_extent *extents, int *count, int block) {
+    struct heartyfs_extent *last = *count > 0 ? &extents[*count - 1] : NULL;
+    if (last != NULL && last->start + last->length == block) {
+        last->length++;
+    } else {
+        extents[(*count)++] = (struct heartyfs_extent){block, 1};
+    }
+}
+
+// Run the data blocks of a file just written through the dedup index
+// (heartyfs_dedup_block()), giving back those that turn out to duplicate
+// a block already in the image and rebuilding the extents around the
+// blocks shared instead. Sharing splits extents; once there is no room
+// for more, the rest of the file is kept as it is. The extents are
+// replaced with a new array, which describes the file even if this fails.
+static int dedup_extents(struct heartyfs *fs, struct heartyfs_extent **extents, int *count) {
+    const struct heartyfs_extent *in = *extents;
+    int out_cap = *count + 16;
+    struct heartyfs_extent *out = malloc(out_cap * sizeof(*out));
+    if (out == NULL) {
+        return 0;
+    }
+    int batch = fs->backend->mapped ? IOV_BATCH : heartyfs_batch_blocks(fs);
+    int out_count = 0;
+    int sharing = 1;
+    int rc = 0;
+    for (int i = 0; i < *count; i++) {
+        for (int done = 0; done < in[i].length; done += batch) {
+            int n = in[i].length - done < batch ? in[i].length - done : batch;
+            if (sharing && !fs->backend->mapped) {
+                struct heartyfs_io io = {in[i].start + done, n, fs->io_buf};
+                sharing = heartyfs_dev_read(fs, &io, 1) == 0;
+            }
+            for (int j = 0; j < n; j++) {
+                int block = in[i].start + done + j;
+                // Room for this block on its own, then the rest of its
+                // extent and the extents after it
+                if (sharing && out_count + 2 + *count - i > out_cap) {
+                    int cap = out_cap * 2 < max_extents(fs) ? out_cap * 2 : max_extents(fs);
+                    struct heartyfs_extent *grown = realloc(out, cap * sizeof(*out));
+                    sharing = grown != NULL && out_count + 2 + *count - i <= cap;
+                    out = grown != NULL ? grown : out;
+                    out_cap = grown != NULL ? cap : out_cap;
+                }
+                if (sharing && (rc = make_room(fs)) < 0) {
+                    sharing = 0;
+                }
+                int use = block;
+                if (sharing) {
+                    const struct heartyfs_data_block *db = fs->backend->mapped ?
+                        heartyfs_block(fs, block) :
+                        (void *)((char *)fs->io_buf + (size_t)j * fs->block_size);
+                    use = heartyfs_dedup_block(fs, block, db);
+                    if (use < 0) {
+                        rc = use;
+                        use = block;
+                        sharing = 0;
+                    }
+                }
+                if (use != block) {
+                    heartyfs_free_block(fs, block);
+                    heartyfs_dirty_forget(&fs->data_dirty, block);
+                }
+                append_block(out, &out_count, use);
+            }
+        }
+    }
+    free(*extents);
+    *extents = out;
+    *count = out_count;
+    return rc;
+}
+
+// Replace the contents of the file named by path with everything that can
+// be read from src_fd. The file is created if it does not exist yet. Up to
+// INLINE_BYTES, the contents go in the inode. Past that, the source is
+// streamed into runs of blocks as they are allocated, so it may be a pipe,
+// and nothing is buffered beyond one readv (or, compressing, a megabyte).
+int heartyfs_write(struct heartyfs *fs, const char *path, int src_fd) {
+    struct stat st;
+    if (fstat(src_fd, &st) != 0) {
+        return -errno;
+    }
+    // No check against the free count up front: inline data, tails,
+    // compression, dedup and the blocks an overwrite releases all make it
+    // a poor guess. Running out fails the allocation, and is cleaned up.
+    int payload = DATA_PAYLOAD(fs->block_size);
+    long long remaining = S_ISREG(st.st_mode) ? (st.st_size + payload - 1) / payload : -1;
+
+    // A source that may fit in the inode is read up to a byte past that
+    // first, to find out. If it does not, the blocks are filled from there.
+    struct source src = {src_fd, NULL, 0};
+    char *head = NULL;
+    if (!S_ISREG(st.st_mode) || st.st_size <= INLINE_BYTES(fs->block_size)) {
+        head = malloc(INLINE_BYTES(fs->block_size) + 1);
+        if (head == NULL) {
+            return -ENOMEM;
+        }
+        struct iovec iov = {head, INLINE_BYTES(fs->block_size) + 1};
+        ssize_t n = readv_full(src_fd, &iov, 1);
+        if (n < 0) {
+            free(head);
+            return n;
+        }
+        src.head = head;
+        src.head_len = n;
+    }
+
+    int dir_block;
+    int inode_block = open_inode(fs, path, &dir_block);
+    if (inode_block < 0) {
+        free(head);
+        return heartyfs_fail(fs, inode_block);
+    }
+    if (head != NULL && src.head_len <= (size_t)INLINE_BYTES(fs->block_size)) {
+        struct heartyfs_inode *inode = heartyfs_block_mut(fs, inode_block);
+        heartyfs_release_file(fs, inode);
+        store_inline(fs, inode, head, src.head_len);
+        free(head);
+        return heartyfs_commit(fs);
+    }
+
+    // Compressed, the source is taken as a stream of unknown length
+    struct packer packer = {0};
+    struct packer *pk = NULL;
+    if (fs->compress) {
+        int rc = heartyfs_lz_init(fs);
+        if (rc < 0) {
+            free(head);
+            return heartyfs_fail(fs, rc);
+        }
+        pk = &packer;
+        remaining = -1;
+    }
+
+    // Copy the source in, a run at a time. The old contents stay in place
+    // until the end, so running out of space leaves them untouched.
+    struct heartyfs_extent *extents = NULL;
+    int extent_count = 0;
+    int extent_cap = 0;
+    int *map = NULL;
+    int map_count = 0;
+    struct heartyfs_tail tail = {0};
+    long long total = 0;
+    int rc = 0;
+    while (remaining != 0) {
+        if (extent_count == extent_cap) {
+            if (extent_cap == max_extents(fs)) {
+                rc = -EFBIG;
+                goto fail;
+            }
+            int cap = extent_cap == 0 ? 16 : extent_cap * 2;
+            cap = cap < max_extents(fs) ? cap : max_extents(fs);
+            struct heartyfs_extent *grown = realloc(extents, cap * sizeof(*extents));
+            if (grown == NULL) {
+                rc = -ENOMEM;
+                goto fail;
+            }
+            extents = grown;
+            extent_cap = cap;
+        }
+        if ((rc = make_room(fs)) < 0) {
+            goto fail;
+        }
+
+        int want = remaining < 0 ? IOV_BATCH : remaining < INT32_MAX ? remaining : INT32_MAX;
+        struct heartyfs_extent run;
+        run.start = heartyfs_alloc_run(fs, want, &run.length);
+        if (run.start < 0) {
+            rc = run.start;
+            goto fail;
+        }
+        int reserved = run.length;
+        ssize_t n = pk != NULL ? fill_compressed(fs, &src, pk, &run) : fill_run(fs, &src, &run);
+        if (n < 0) {
+            free_extents(fs, &run, 1);
+            rc = n;
+            goto fail;
+        }
+
+        // Give back what the source did not fill, and merge the run with
+        // the previous one when the allocator made them adjacent
+        int filled = pk != NULL ? n : (n + payload - 1) / payload;
+        struct heartyfs_extent rest = {run.start + filled, run.length - filled};
+        free_extents(fs, &rest, 1);
+        run.length = filled;
+        struct heartyfs_extent *last = extent_count > 0 ? &extents[extent_count - 1] : NULL;
+        if (last != NULL && last->start + last->length == run.start) {
+            last->length += run.length;
+        } else if (run.length > 0) {
+            extents[extent_count++] = run;
+        }
+        total += n;
+        if (pk != NULL ? filled < reserved : n < (ssize_t)reserved * payload) {
+            break;  // EOF
+        }
+        remaining -= remaining > 0 ? filled : 0;
+    }
+
+    if ((rc = make_room(fs)) < 0) {
+        goto fail;
+    }
+    if (pk == NULL) {
+        pack_tail(fs, dir_block, extents, &extent_count, total % payload, &tail);
+    }
+    if (fs->dedup && (rc = dedup_extents(fs, &extents, &extent_count)) < 0) {
+        goto fail;
+    }
+
+    // Blocks for the extents that do not fit in the inode
+    map = malloc((map_blocks_needed(fs, extent_count) + 1) * sizeof(int));
+    if (map == NULL) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+    for (; map_count < map_blocks_needed(fs, extent_count); map_count++) {
+        if ((rc = make_room(fs)) < 0 || (rc = heartyfs_alloc_block(fs)) < 0) {
+            goto fail;
+        }
+        map[map_count] = rc;
+    }
+
+    // Swap the new extents in and release the old ones
+    struct heartyfs_inode *inode = heartyfs_block_mut(fs, inode_block);
+    heartyfs_release_file(fs, inode);
+    store_extents(fs, inode, extents, extent_count, map);
+    inode->tail = tail;
+    inode->flags = pk != NULL ? INODE_COMPRESSED : 0;
+    free(head);
+    free(extents);
+    free(map);
+    return heartyfs_commit(fs);
+
+fail:
+    free_extents(fs, extents, extent_count);
+    if (tail.block != 0) {
+        heartyfs_tail_release(fs, &tail);
+    }
+    for (int i = 0; i < map_count; i++) {
+        heartyfs_free_block(fs, map[i]);
+    }
+    free(head);
+    free(extents);
+    free(map);
+    return heartyfs_fail(fs, rc);
+}
+
+// Have heartyfs_write() compress the files it writes from now on, or stop.
+// Files keep the form they were written in; reads handle both.
+void heartyfs_set_compress(struct heartyfs *fs, int on) {
+    fs->compress = on;
+}
+
+// Take another reference to every block of count extents. The counts of a
+// run of blocks are taken in one go under the journal lock, up to the end
+// of the block of counts they are in. If one cannot be taken, those that
+// were are given back.
+static int share_extents(struct heartyfs *fs, const struct heartyfs_extent *extents,
+                         int count) {
+    int per_block = REFS_PER_BLOCK(fs->block_size);
+    for (int i = 0; i < count; i++) {
+        for (int done = 0; done < extents[i].length;) {
+            int block = extents[i].start + done;
+            int n = extents[i].length - done;
+            n = n < per_block - block % per_block ? n : per_block - block % per_block;
+            int got = 0;
+            int rc = make_room(fs);
+            if (rc == 0 && (rc = heartyfs_lock_journal(fs)) == 0) {
+                while (got < n && (rc = heartyfs_ref_get(fs, block + got)) == 0) {
+                    got++;
+                }
+                heartyfs_unlock_journal(fs);
+            }
+            done += got;
+            if (rc < 0) {
+                struct heartyfs_extent partial = {extents[i].start, done};
+                free_extents(fs, extents, i);
+                free_extents(fs, &partial, 1);
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+// Lock the directories holding src_path and dst_path, and find the source
+// file in one and the destination (created if need be) in the other
+static int open_clone(struct heartyfs *fs, const char *src_path, const char *dst_path,
+                      int *src_block, int *dst_dir) {
+    char src_name[MAX_NAME_LENGTH + 1];
+    char dst_name[MAX_NAME_LENGTH + 1];
+    int src_dir;
+    int rc;
+    do {
+        src_dir = heartyfs_lookup_parent(fs, src_path, src_name);
+        if (src_dir < 0) {
+            return src_dir;
+        }
+        *dst_dir = heartyfs_lookup_parent_mut(fs, dst_path, dst_name);
+        if (*dst_dir < 0) {
+            return *dst_dir;
+        }
+        if ((rc = heartyfs_lock_dir(fs, src_dir)) < 0) {
+            return rc;
+        }
+
+        // Waiting for the second lock gives up the first; start over then
+        rc = heartyfs_lock_dir(fs, *dst_dir);
+        if (rc < 0) {
+            return rc;
+        }
+    } while (rc == 1);
+
+    *src_block = heartyfs_dir_find(fs, src_dir, src_name);
+    if (*src_block < 0) {
+        return *src_block;
+    }
+    const struct heartyfs_inode *src = heartyfs_block(fs, *src_block);
+    if (src->type != INODE_TYPE_FILE) {
+        return -EISDIR;
+    }
+    return find_or_create(fs, *dst_dir, dst_name);
+}
+
+// Make the file named by dst_path a copy of the one named by src_path
+// that shares its data blocks, taking another reference to each, so only
+// metadata is written: the inode, the blocks of extents and the tail.
+// Data blocks are never written in place, so rewriting either file later
+// leaves the other as it was. The destination is created if it does not
+// exist yet, and replaced if it does.
+int heartyfs_clone(struct heartyfs *fs, const char *src_path, const char *dst_path) {
+    int src_block;
+    int dst_dir;
+    int dst_block = open_clone(fs, src_path, dst_path, &src_block, &dst_dir);
+    if (dst_block < 0 || dst_block == src_block) {
+        return heartyfs_fail(fs, dst_block < 0 ? dst_block : 0);
+    }
+
+    // Work from a copy of the source, which stays put while the
+    // transaction is committed to make room
+    struct heartyfs_inode *src = malloc(fs->block_size);
+    struct heartyfs_extent *extents = NULL;
+    int *map = NULL;
+    int map_count = 0;
+    struct heartyfs_tail tail = {0};
+    int shared = 0;
+    int rc = -ENOMEM;
+    if (src == NULL) {
+        goto fail;
+    }
+    memcpy(src, heartyfs_block(fs, src_block), fs->block_size);
+    if (src->flags & INODE_INLINE) {
+        struct heartyfs_inode *inode = heartyfs_block_mut(fs, dst_block);
+        heartyfs_release_file(fs, inode);
+        store_inline(fs, inode, (const char *)src->extents, src->size);
+        free(src);
+        return heartyfs_commit(fs);
+    }
+
+    extents = malloc((src->size + 1) * sizeof(*extents));
+    if (extents == NULL) {
+        goto fail;
+    }
+    for (int i = 0; i < src->size; i++) {
+        const struct heartyfs_extent *extent = file_extent(fs, src, i);
+        if (extent == NULL) {
+            rc = -EIO;
+            goto fail;
+        }
+        extents[i] = *extent;
+    }
+    if ((rc = share_extents(fs, extents, src->size)) < 0) {
+        goto fail;
+    }
+    shared = 1;
+
+    // The tail goes into the destination's directory, which may not be the
+    // one the source packs its tails in
+    if (src->tail.block != 0) {
+        char data[MAX_BLOCK_SIZE / 2];
+        const struct heartyfs_tail_block *tb = heartyfs_block(fs, src->tail.block);
+        memcpy(data, tb->data + src->tail.offset, src->tail.length);
+        if ((rc = make_room(fs)) < 0 ||
+            (rc = heartyfs_tail_pack(fs, dst_dir, data, src->tail.length, &tail)) < 0) {
+            goto fail;
+        }
+    }
+
+    map = malloc((map_blocks_needed(fs, src->size) + 1) * sizeof(int));
+    if (map == NULL) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+    for (; map_count < map_blocks_needed(fs, src->size); map_count++) {
+        if ((rc = make_room(fs)) < 0 || (rc = heartyfs_alloc_block(fs)) < 0) {
+            goto fail;
+        }
+        map[map_count] = rc;
+    }
+
+    struct heartyfs_inode *inode = heartyfs_block_mut(fs, dst_block);
+    heartyfs_release_file(fs, inode);
+    store_extents(fs, inode, extents, src->size, map);
+    inode->tail = tail;
+    inode->flags = src->flags;
+    free(src);
+    free(extents);
+    free(map);
+    return heartyfs_commit(fs);
+
+fail:
+    if (shared) {
+        free_extents(fs, extents, src->size);
+    }
+    if (tail.block != 0) {
+        heartyfs_tail_release(fs, &tail);
+    }
+    for (int i = 0; i < map_count; i++) {
+        heartyfs_free_block(fs, map[i]);
+    }
+    free(src);
+    free(extents);
+    free(map);
+    return heartyfs_fail(fs, rc);
+}
+
+// Hash the part of an inode that says where a file's data is (or holds
+// it), so that a reader can tell whether the file was rewritten since it
+// last looked
+static unsigned int inode_hash(struct heartyfs *fs, const struct heartyfs_inode *inode) {
+    int size = inode->size;
+    size_t bytes;
+    if (inode->flags & INODE_INLINE) {
+        size = size < 0 ? 0 : size > INLINE_BYTES(fs->block_size) ? INLINE_BYTES(fs->block_size) : size;
+        bytes = size;
+    } else {
+        size = size < 0 ? 0 : size > INODE_EXTENTS(fs->block_size) ? INODE_EXTENTS(fs->block_size) : size;
+        bytes = size * sizeof(inode->extents[0]);
+    }
+    const unsigned int *words = (const unsigned int *)inode;
+    size_t count = (sizeof(*inode) + bytes + sizeof(*words) - 1) / sizeof(*words);
+    unsigned int hash = 2166136261U;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ words[i]) * 16777619U;
+    }
+    return hash;
+}
+
+// Start reading the file named by path with heartyfs_read_iov()
+int heartyfs_read_open(struct heartyfs *fs, const char *path,
+                       struct heartyfs_read_cursor *cursor) {
+    int inode_block = heartyfs_lookup(fs, path);
+    if (inode_block < 0) {
+        return inode_block;
+    }
+    struct heartyfs_read_set set;
+    int rc;
+    do {
+        set.count = 0;
+        const struct heartyfs_inode *inode = heartyfs_read_block(fs, &set, inode_block);
+        rc = inode == NULL ? -EIO : inode->type != INODE_TYPE_FILE ? -EISDIR : 0;
+        if (rc == 0) {
+            cursor->inode_hash = inode_hash(fs, inode);
+            cursor->inline_data = (inode->flags & INODE_INLINE) != 0;
+            cursor->rest = cursor->inline_data || inode->tail.block != 0;
+            cursor->compressed = (inode->flags & INODE_COMPRESSED) != 0;
+        }
+    } while (!heartyfs_read_valid(fs, &set));
+    cursor->inode_block = inode_block;
+    cursor->extent = 0;
+    cursor->block = 0;
+    cursor->ahead_extent = 0;
+    cursor->ahead_block = 0;
+    cursor->window = 0;
+    return rc;
+}
+
+// Map up to max blocks from where the cursor points into runs of
+// consecutive blocks, advancing it. Returns the number of runs, or -EIO if
+// the file leads somewhere it should not.
+static int map_runs(struct heartyfs *fs, const struct heartyfs_inode *inode,
+                    struct heartyfs_read_cursor *cursor, struct heartyfs_extent *runs, int max) {
+    if (inode->flags & INODE_INLINE) {
+        return 0;
+    }
+    int count = 0;
+    int blocks = 0;
+    while (blocks < max && cursor->extent < inode->size) {
+        const struct heartyfs_extent *extent = file_extent(fs, inode, cursor->extent);
+        if (extent == NULL || extent->start < fs->data_start || extent->length < 0 ||
+            extent->length > fs->block_count - extent->start) {
+            return -EIO;
+        }
+        int take = extent->length - cursor->block;
+        take = take < max - blocks ? take : max - blocks;
+        if (take > 0) {
+            runs[count].start = extent->start + cursor->block;
+            runs[count].length = take;
+            count++;
+            blocks += take;
+            cursor->block += take;
+        }
+        if (cursor->block >= extent->length) {
+            cursor->extent++;
+            cursor->block = 0;
+        }
+    }
+    return count;
+}
+
+// Map the next part of a file into up to max blocks' worth of runs and
+// advance the cursor past it, without locks. Returns the number of runs,
+// 0 at the end of the file, and -ESTALE if the file has been rewritten or
+// removed since the cursor was last advanced: the data it was advanced
+// past may already have been reused.
+static int next_runs(struct heartyfs *fs, struct heartyfs_read_cursor *cursor,
+                     struct heartyfs_extent *runs, int max) {
+    struct heartyfs_read_set set;
+    for (;;) {
+        set.count = 0;
+        struct heartyfs_read_cursor next = *cursor;
+        const struct heartyfs_inode *inode = heartyfs_read_block(fs, &set, cursor->inode_block);
+        int rc = inode == NULL ? -EIO :
+                 inode_hash(fs, inode) != cursor->inode_hash ? -ESTALE :
+                 map_runs(fs, inode, &next, runs, max);
+        if (heartyfs_read_valid(fs, &set)) {
+            if (rc >= 0) {
+                *cursor = next;
+                for (int i = 0; i < rc; i++) {
+                    fs->stats.data_blocks_read += runs[i].length;
+                }
+            }
+            return rc;
+        }
+    }
+}
+
+// Read ahead of a cursor just advanced past a batch, using runs (of
+// IOV_BATCH) for scratch. A reader that comes back for a second batch is
+// taken to be reading the file through: from then on, whenever it catches
+// up with what was read ahead, the next window of blocks along the file's
+// extents is prefetched and the window doubles, from READAHEAD_MIN up to
+// IOV_BATCH. Unlike the kernel's own read-ahead, this follows the file
+// however scattered it is.
+static void read_ahead(struct heartyfs *fs, struct heartyfs_read_cursor *cursor,
+                       struct heartyfs_extent *runs) {
+    if (cursor->window == 0) {
+        cursor->window = READAHEAD_MIN;
+        return;
+    }
+    if (cursor->extent < cursor->ahead_extent ||
+        (cursor->extent == cursor->ahead_extent && cursor->block < cursor->ahead_block)) {
+        return;
+    }
+    struct heartyfs_read_cursor ahead = *cursor;
+    int count = next_runs(fs, &ahead, runs, cursor->window);
+    if (count <= 0) {
+        return;  // The next batch will find out what went wrong, if anything
+    }
+    heartyfs_dev_prefetch(fs, runs, count);
+    cursor->ahead_extent = ahead.extent;
+    cursor->ahead_block = ahead.block;
+    cursor->window = cursor->window * 2 < IOV_BATCH ? cursor->window * 2 : IOV_BATCH;
+}
+
+// Describe the end of a file that is not in its data blocks, its inline
+// data or its tail, as one iovec (none if it is empty)
+static int rest_iov(struct heartyfs *fs, struct heartyfs_read_cursor *cursor,
+                    struct iovec *iov) {
+    struct heartyfs_read_set set;
+    for (;;) {
+        set.count = 0;
+        const struct heartyfs_inode *inode = heartyfs_read_block(fs, &set, cursor->inode_block);
+        int rc = inode == NULL ? -EIO : inode_hash(fs, inode) != cursor->inode_hash ? -ESTALE : 0;
+        const char *data = NULL;
+        int len = 0;
+        if (rc == 0 && (inode->flags & INODE_INLINE)) {
+            data = (const char *)inode->extents;
+            len = inode->size;
+            rc = len < 0 || len > INLINE_BYTES(fs->block_size) ? -EIO : 0;
+        } else if (rc == 0) {
+            const struct heartyfs_tail_block *tb =
+                inode->tail.block < fs->data_start ? NULL :
+                heartyfs_read_block(fs, &set, inode->tail.block);
+            len = inode->tail.length;
+            rc = tb == NULL || inode->tail.offset + len > TAIL_BYTES(fs->block_size) ? -EIO : 0;
+            data = rc == 0 ? tb->data + inode->tail.offset : NULL;
+        }
+        if (heartyfs_read_valid(fs, &set)) {
+            if (rc < 0) {
+                return rc;
+            }
+            cursor->rest = 0;
+            iov->iov_base = (void *)data;
+            iov->iov_len = len;
+            return len > 0;
+        }
+    }
+}
+
+// Describe the next part of a file as up to max iovecs pointing straight
+// into the mapped image, and advance the cursor past it. Returns the
+// number of iovecs filled in, 0 at the end of the file. They stay valid
+// until the file is written or removed, or the image is unmounted.
+//
+// No locks are taken. If the file has been rewritten or removed since the
+// previous call, the data that call described may already have been
+// reused, and this one fails with -ESTALE instead; so a caller that has
+// copied every batch and got 0 at the end read one version of the file.
+// Pages handed on by reference (vmsplice) may still change after that.
+// Compressed files cannot be described this way (-EOPNOTSUPP).
+int heartyfs_read_iov(struct heartyfs *fs, struct heartyfs_read_cursor *cursor,
+                      struct iovec *iov, int max) {
+    if (cursor->compressed) {
+        return -EOPNOTSUPP;
+    }
+    struct heartyfs_extent runs[IOV_BATCH];
+    int count = 0;
+    while (count == 0) {
+        int run_count = next_runs(fs, cursor, runs, max < IOV_BATCH ? max : IOV_BATCH);
+        if (run_count == 0 && cursor->rest) {
+            return rest_iov(fs, cursor, iov);
+        }
+        if (run_count <= 0) {
+            return run_count;
+        }
+        for (int i = 0; i < run_count; i++) {
+            for (int j = 0; j < runs[i].length; j++) {
+                struct heartyfs_data_block *db = heartyfs_block(fs, runs[i].start + j);
+                int size = db->size;
+                if (size > 0) {
+                    iov[count].iov_base = db->data;
+                    iov[count].iov_len = size < DATA_PAYLOAD(fs->block_size) ?
+                                         size : DATA_PAYLOAD(fs->block_size);
+                    count++;
+                }
+            }
+        }
+        // The caller has yet to touch this batch, so what comes next is
+        // read in while it faults this one in
+        read_ahead(fs, cursor, runs);
+    }
+    return count;
+}
+
+// Copy a file to out_fd straight from the mapping, in batches of
+// IOV_BATCH blocks. A pipe gets the pages by reference with vmsplice when
+// each block fills most of a page; smaller blocks, and files kept in their
+// inode, are packed into the pipe more tightly by writev.
+static int read_mapped(struct heartyfs *fs, struct heartyfs_read_cursor *cursor, int out_fd) {
+    struct stat st;
+    int splice = fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+                 (size_t)fs->block_size >= fs->page_size && !cursor->inline_data;
+    struct iovec iov[IOV_BATCH];
+    int count;
+    while ((count = heartyfs_read_iov(fs, cursor, iov, IOV_BATCH)) > 0) {
+        int rc = send_full(out_fd, iov, count, &splice);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return count;
+}
+
+// Add a block to those to read, into buf, joining it to the last run if
+// it follows on both on the image and in memory
+static void add_io(struct heartyfs *fs, struct heartyfs_io *ios, int *io_count, int block,
+                   char *buf) {
+    if (*io_count > 0) {
+        struct heartyfs_io *last = &ios[*io_count - 1];
+        if (last->block + last->count == block &&
+            (char *)last->buf + (size_t)last->count * fs->block_size == buf) {
+            last->count++;
+            return;
+        }
+    }
+    ios[(*io_count)++] = (struct heartyfs_io){block, 1, buf};
+}
+
+static int in_staging(struct heartyfs *fs, const char *p) {
+    return p >= (const char *)fs->io_buf && p < (const char *)fs->io_buf + IO_BATCH_BYTES;
+}
+
+// Decompress the count blocks of a batch into fs->lz_buf and send them on.
+// The file is checked before anything is sent: the blocks may be in the
+// mapping, where a rewrite can reuse them, so what they decompressed to
+// (if they did) only counts if it did not happen.
+static int send_decompressed(struct heartyfs *fs, struct heartyfs_read_cursor *cursor,
+                             int out_fd, const char *const *blocks, int count) {
+    int used = 0;
+    for (int i = 0;; i++) {
+        if (i == count || LZ_BUF_BYTES - used < LZ_MAX_RAW(fs->block_size)) {
+            int rc = next_runs(fs, cursor, NULL, 0);  // Only checks the file
+            if (rc == 0 && used > 0) {
+                struct iovec iov = {fs->lz_buf, used};
+                int splice = 0;
+                rc = send_full(out_fd, &iov, 1, &splice);
+            }
+            if (rc < 0 || i == count) {
+                return rc;
+            }
+            used = 0;
+        }
+        const struct heartyfs_data_block *db = (const struct heartyfs_data_block *)blocks[i];
+        int size = db->size;
+        int n = size < 0 || size > DATA_PAYLOAD(fs->block_size) ? -EIO :
+                heartyfs_lz_decompress(db->data, size, fs->lz_buf + used, LZ_BUF_BYTES - used);
+        if (n < 0) {
+            int rc = next_runs(fs, cursor, NULL, 0);
+            return rc < 0 ? rc : n;
+        }
+        used += n;
+    }
+}
+
+// Copy a file to out_fd a batch at a time, through a copying backend or
+// decompressing it. Blocks of the batch found in the block cache are sent
+// from there; the rest are read into cache slots, or the staging buffer
+// if the cache has no room, and the batch goes out with one writev. The
+// file is checked again once the batch is in memory, so a batch that
+// raced with a rewrite fails with -ESTALE before it is sent, and what it
+// read is not kept. The mmap backend has the blocks in place.
+static int read_staged(struct heartyfs *fs, struct heartyfs_read_cursor *cursor, int out_fd) {
+    int batch = heartyfs_batch_blocks(fs);
+    batch = batch < IOV_BATCH ? batch : IOV_BATCH;
+    struct heartyfs_extent runs[IOV_BATCH];
+    struct heartyfs_io ios[IOV_BATCH];
+    const char *blocks[IOV_BATCH];    // Where each block of the batch is in memory
+    unsigned char fresh[IOV_BATCH];   // Whether it is being read in
+    struct iovec iov[IOV_BATCH];
+    int rc;
+    while ((rc = next_runs(fs, cursor, runs, batch)) > 0) {
+        int count = 0;
+        int io_count = 0;
+        int staged = 0;
+        for (int i = 0; i < rc; i++) {
+            for (int j = 0; j < runs[i].length; j++, count++) {
+                int block = runs[i].start + j;
+                if (fs->backend->mapped) {
+                    blocks[count] = heartyfs_block(fs, block);
+                    fresh[count] = 0;
+                    continue;
+                }
+                blocks[count] = heartyfs_cache_get(fs, block);
+                fresh[count] = blocks[count] == NULL;
+                if (fresh[count]) {
+                    char *buf = heartyfs_cache_reserve(fs, block);
+                    if (buf == NULL) {
+                        buf = (char *)fs->io_buf + (size_t)staged++ * fs->block_size;
+                    }
+                    blocks[count] = buf;
+                    add_io(fs, ios, &io_count, block, buf);
+                }
+            }
+        }
+        read_ahead(fs, cursor, runs);
+
+        int read_rc = io_count > 0 ? heartyfs_dev_read(fs, ios, io_count) : 0;
+        if (read_rc == 0) {
+            read_rc = next_runs(fs, cursor, NULL, 0);  // Only checks the file
+        }
+        rc = read_rc;
+        int iov_count = 0;
+        for (int i = 0; i < count; i++) {
+            if (fresh[i] && !in_staging(fs, blocks[i])) {
+                if (read_rc < 0) {
+                    heartyfs_cache_drop(fs, blocks[i]);
+                } else {
+                    heartyfs_cache_filled(fs, blocks[i]);
+                }
+            }
+            const struct heartyfs_data_block *db = (const struct heartyfs_data_block *)blocks[i];
+            if (read_rc == 0 && !cursor->compressed && db->size > 0) {
+                iov[iov_count].iov_base = (void *)db->data;
+                iov[iov_count].iov_len = db->size < DATA_PAYLOAD(fs->block_size) ?
+                                         db->size : DATA_PAYLOAD(fs->block_size);
+                iov_count++;
+            }
+        }
+        if (rc == 0 && cursor->compressed) {
+            rc = send_decompressed(fs, cursor, out_fd, blocks, count);
+        } else if (rc == 0) {
+            int splice = 0;
+            rc = send_full(out_fd, iov, iov_count, &splice);
+        }
+        for (int i = 0; i < count; i++) {
+            if (!fs->backend->mapped && !in_staging(fs, blocks[i]) &&
+                !(read_rc < 0 && fresh[i])) {
+                heartyfs_cache_unpin(fs, blocks[i]);
+            }
+        }
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    // The inode and tail blocks are always read through the mapping
+    return rc == 0 && cursor->rest ? read_mapped(fs, cursor, out_fd) : rc;
+}
+
+// Copy the contents of the file named by path to out_fd
+int heartyfs_read(struct heartyfs *fs, const char *path, int out_fd) {
+    struct heartyfs_read_cursor cursor;
+    int rc = heartyfs_read_open(fs, path, &cursor);
+    if (rc < 0) {
+        return rc;
+    }
+    if (cursor.compressed && (rc = heartyfs_lz_init(fs)) < 0) {
+        return rc;
+    }
+    rc = fs->backend->mapped && !cursor.compressed ? read_mapped(fs, &cursor, out_fd) :
+                                                     read_staged(fs, &cursor, out_fd);
+    HEARTYFS_OP_DONE(fs);
+    return rc;
+}
@@ -0,0 +1,614 @@
+#include "../heartyfs.h"
+#include <endian.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+// heartyfs_fsck() checks an image it has to itself, in three passes that
+// each split the work between threads:
+//
+// 1. Read every allocated block once, in order, each thread a slice of the
+//    image, so that the walk finds them in the page cache instead of
+//    waiting for one random read after another.
+// 2. Walk the tree from the root. Threads take directories off a shared
+//    stack, check them and the files in them, and push the directories
+//    they find. Every block reached is claimed as metadata, data or a tail
+//    block; references to data blocks and tail bytes are counted as well.
+// 3. Compare the claims with the bitmap, the reference counts and the tail
+//    blocks, each thread a range of blocks.
+//
+// Repairs are written in place, not through the journal, once a
+// checkpoint has emptied it so that nothing older gets replayed over them.
+// A repair cut short by a crash is just done again by the next run.
+// Pointers out of range and blocks reachable twice are only reported: it
+// takes a person to decide which file keeps what.
+
+#define FSCK_MAX_THREADS 64
+#define PREFETCH_BYTES (1 << 20)
+#define PATH_BYTES 4096
+
+enum { KIND_FREE, KIND_META, KIND_DATA, KIND_TAIL };
+
+// A directory waiting to be checked
+struct fsck_dir {
+    int block;
+    int parent;
+    char *path;  // "" for the root
+};
+
+struct fsck {
+    struct heartyfs *fs;
+    int repair;
+    FILE *log;
+    int threads;
+    unsigned char *kinds;  // What each block was reached as
+    unsigned int *refs;    // References to a data block, or tail bytes in a tail block
+
+    // Directories not checked yet, threads checking one, and whether a
+    // directory had to be skipped for want of memory; under lock
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct fsck_dir *stack;
+    int depth;
+    int cap;
+    int busy;
+    int out_of_memory;
+};
+
+struct fsck_thread {
+    struct fsck *ck;
+    int index;
+    pthread_t thread;
+    unsigned int free_blocks;  // Tallied by the compare pass
+    unsigned int shared_refs;
+    struct heartyfs_fsck_report report;
+};
+
+// Count a problem in one of the fields of the report, and describe it
+static void problem(struct fsck_thread *t, int *field, int repaired, const char *path,
+                    const char *format, ...) {
+    struct fsck *ck = t->ck;
+    (*field)++;
+    t->report.repaired += repaired;
+    if (ck->log == NULL) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&ck->lock);
+    fprintf(ck->log, "%s: ", *path == '\0' ? "/" : path);
+    vfprintf(ck->log, format, args);
+    fprintf(ck->log, "%s\n", repaired ? " (repaired)" : "");
+    pthread_mutex_unlock(&ck->lock);
+    va_end(args);
+}
+
+// Claim a block as reached as kind. Metadata may only be reached once;
+// data and tail blocks any number of times, but always as the same kind.
+static int claim(struct fsck_thread *t, const char *path, int block, int kind) {
+    struct heartyfs *fs = t->ck->fs;
+    if (block < fs->data_start || block >= fs->block_count) {
+        problem(t, &t->report.broken, 0, path, "block %d is out of range", block);
+        return -1;
+    }
+    unsigned char old = KIND_FREE;
+    if (!__atomic_compare_exchange_n(&t->ck->kinds[block], &old, kind, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED) &&
+        (kind == KIND_META || old != kind)) {
+        problem(t, &t->report.broken, 0, path, "block %d is reachable twice", block);
+        return -1;
+    }
+    return 0;
+}
+
+// Check that a tail block's own idea of which directory packs into it
+// agrees with the directory at dir_block
+static void check_open_tail(struct fsck_thread *t, const char *path, int dir_block,
+                            int tail_block) {
+    struct heartyfs *fs = t->ck->fs;
+    struct heartyfs_tail_block *tb = heartyfs_block(fs, tail_block);
+    if (tb->dir == dir_block) {
+        return;
+    }
+    if (tb->dir >= fs->data_start && tb->dir < fs->block_count && tb->dir != dir_block) {
+        const struct heartyfs_directory *other = heartyfs_block(fs, tb->dir);
+        if (other->type == INODE_TYPE_DIR && other->tail_block == tail_block) {
+            problem(t, &t->report.broken, 0, path, "tail block %d is open in another directory",
+                    tail_block);
+            return;
+        }
+    }
+    problem(t, &t->report.bad_tails, t->ck->repair, path,
+            "tail block %d belongs to directory %d", tail_block, tb->dir);
+    if (t->ck->repair) {
+        tb->dir = dir_block;
+    }
+}
+
+// Get extent i of a file whose blocks of extents have been checked
+static const struct heartyfs_extent *file_extent(struct heartyfs *fs,
+                                                 const struct heartyfs_inode *inode, int i) {
+    int direct = INODE_EXTENTS(fs->block_size);
+    int per_block = EXTENTS_PER_BLOCK(fs->block_size);
+    if (i < direct) {
+        return &inode->extents[i];
+    }
+    i -= direct;
+    if (i < per_block) {
+        return (const struct heartyfs_extent *)heartyfs_block(fs, inode->indirect) + i;
+    }
+    i -= per_block;
+    const int *pointers = heartyfs_block(fs, inode->double_indirect);
+    return (const struct heartyfs_extent *)heartyfs_block(fs, pointers[i / per_block]) +
+           i % per_block;
+}
+
+// Check a file and claim its blocks. The inode block is claimed already.
+static void check_file(struct fsck_thread *t, const char *path, int block) {
+    struct heartyfs *fs = t->ck->fs;
+    const struct heartyfs_inode *inode = heartyfs_block(fs, block);
+    int direct = INODE_EXTENTS(fs->block_size);
+    int per_block = EXTENTS_PER_BLOCK(fs->block_size);
+    t->report.files++;
+    if (inode->flags & INODE_INLINE) {
+        if (inode->size < 0 || inode->size > INLINE_BYTES(fs->block_size)) {
+            problem(t, &t->report.broken, 0, path, "inline size %d is out of range",
+                    inode->size);
+        }
+        return;
+    }
+    int max = direct + per_block + POINTERS_PER_BLOCK(fs->block_size) * per_block;
+    if (inode->size < 0 || inode->size > max) {
+        problem(t, &t->report.broken, 0, path, "extent count %d is out of range", inode->size);
+        return;
+    }
+
+    // The blocks holding the extents that do not fit in the inode
+    if ((inode->indirect != 0 && claim(t, path, inode->indirect, KIND_META) < 0) ||
+        (inode->double_indirect != 0 && claim(t, path, inode->double_indirect, KIND_META) < 0)) {
+        return;
+    }
+    int needed = inode->size - direct - per_block;
+    needed = needed <= 0 ? 0 : (needed + per_block - 1) / per_block;
+    int pointer_count = 0;
+    if (inode->double_indirect != 0) {
+        const int *pointers = heartyfs_block(fs, inode->double_indirect);
+        for (; pointer_count < POINTERS_PER_BLOCK(fs->block_size) &&
+               pointers[pointer_count] != 0; pointer_count++) {
+            if (claim(t, path, pointers[pointer_count], KIND_META) < 0) {
+                return;
+            }
+        }
+    }
+    if ((inode->size > direct && inode->indirect == 0) || pointer_count < needed) {
+        problem(t, &t->report.broken, 0, path, "extents past the inode are missing");
+        return;
+    }
+
+    for (int i = 0; i < inode->size; i++) {
+        const struct heartyfs_extent *extent = file_extent(fs, inode, i);
+        if (extent->length <= 0 || extent->start < fs->data_start ||
+            extent->length > fs->block_count - extent->start) {
+            problem(t, &t->report.broken, 0, path, "extent %d (%d, %d) is out of range", i,
+                    extent->start, extent->length);
+            continue;
+        }
+        for (int b = extent->start; b < extent->start + extent->length; b++) {
+            if (claim(t, path, b, KIND_DATA) == 0) {
+                __atomic_fetch_add(&t->ck->refs[b], 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    const struct heartyfs_tail *tail = &inode->tail;
+    if (tail->block != 0 && claim(t, path, tail->block, KIND_TAIL) == 0) {
+        const struct heartyfs_tail_block *tb = heartyfs_block(fs, tail->block);
+        if (tail->length == 0 || tail->offset + tail->length > tb->used ||
+            tb->used > TAIL_BYTES(fs->block_size)) {
+            problem(t, &t->report.broken, 0, path, "tail (%d, %d) is out of range",
+                    tail->offset, tail->length);
+        }
+        __atomic_fetch_add(&t->ck->refs[tail->block], tail->length, __ATOMIC_RELAXED);
+    }
+}
+
+// Queue a directory for checking. Takes over path.
+static void push_dir(struct fsck_thread *t, int block, int parent, char *path) {
+    struct fsck *ck = t->ck;
+    pthread_mutex_lock(&ck->lock);
+    if (path != NULL && ck->depth == ck->cap) {
+        int cap = ck->cap == 0 ? 256 : ck->cap * 2;
+        struct fsck_dir *grown = realloc(ck->stack, cap * sizeof(*grown));
+        if (grown != NULL) {
+            ck->stack = grown;
+            ck->cap = cap;
+        }
+    }
+    if (path == NULL || ck->depth == ck->cap) {
+        ck->out_of_memory = 1;
+        free(path);
+    } else {
+        ck->stack[ck->depth++] = (struct fsck_dir){block, parent, path};
+        pthread_cond_signal(&ck->changed);
+    }
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// Check the entries[from .. size - 1] of a block of a directory, and what
+// they point at. Returns the number of entries.
+static int check_entries(struct fsck_thread *t, const struct fsck_dir *d,
+                         const struct heartyfs_directory *block, int from) {
+    struct heartyfs *fs = t->ck->fs;
+    char path[PATH_BYTES];
+    for (int i = from; i < block->size; i++) {
+        const struct heartyfs_dir_entry *entry = &block->entries[i];
+        const char *name = entry->file_name;
+        size_t len = strnlen(name, sizeof(entry->file_name));
+        snprintf(path, sizeof(path), "%s/%.*s", d->path, (int)len, name);
+        if (len == 0 || len > MAX_NAME_LENGTH || strchr(name, '/') != NULL ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            problem(t, &t->report.broken, 0, path, "bad name");
+            continue;
+        }
+        int target = entry->block_id;
+        if (claim(t, path, target, KIND_META) < 0) {
+            continue;
+        }
+        int type = ((const struct heartyfs_inode *)heartyfs_block(fs, target))->type;
+        if (type == INODE_TYPE_DIR) {
+            push_dir(t, target, d->block, strdup(path));
+        } else if (type == INODE_TYPE_FILE) {
+            check_file(t, path, target);
+        } else {
+            problem(t, &t->report.broken, 0, path, "block %d is neither a file nor a directory",
+                    target);
+        }
+    }
+    return block->size - from;
+}
+
+// Check a leaf block of a directory's index. Returns the number of
+// entries in it, or -1.
+static int check_leaf(struct fsck_thread *t, const struct fsck_dir *d, int leaf_block) {
+    struct heartyfs *fs = t->ck->fs;
+    if (claim(t, d->path, leaf_block, KIND_META) < 0) {
+        return -1;
+    }
+    const struct heartyfs_directory *leaf = heartyfs_block(fs, leaf_block);
+    if (leaf->type != INODE_TYPE_DIR_LEAF || leaf->size < 0 ||
+        leaf->size > DIR_ENTRIES(fs->block_size)) {
+        problem(t, &t->report.broken, 0, d->path, "block %d is not a directory leaf",
+                leaf_block);
+        return -1;
+    }
+    return check_entries(t, d, leaf, 0);
+}
+
+// Check an index block of depth (1 or 2) and everything under it. Returns
+// the number of entries in its leaves, or -1.
+static int check_index(struct fsck_thread *t, const struct fsck_dir *d, int index_block,
+                       int depth) {
+    struct heartyfs *fs = t->ck->fs;
+    if (claim(t, d->path, index_block, KIND_META) < 0) {
+        return -1;
+    }
+    const struct heartyfs_dir_index *index = heartyfs_block(fs, index_block);
+    if (index->depth != depth || index->size < 1 ||
+        index->size > INDEX_ENTRIES(fs->block_size)) {
+        problem(t, &t->report.broken, 0, d->path, "block %d is not an index block of depth %d",
+                index_block, depth);
+        return -1;
+    }
+    int count = 0;
+    for (int i = 0; i < index->size; i++) {
+        int n = depth == 2 ? check_index(t, d, index->entries[i].block, 1)
+                           : check_leaf(t, d, index->entries[i].block);
+        count = n < 0 || count < 0 ? -1 : count + n;
+    }
+    return count;
+}
+
+// Check a directory, claimed already, and queue the ones in it
+static void check_dir(struct fsck_thread *t, const struct fsck_dir *d) {
+    struct heartyfs *fs = t->ck->fs;
+    struct heartyfs_directory *dir = heartyfs_block(fs, d->block);
+    t->report.dirs++;
+    if (dir->size < 2 || dir->size > DIR_ENTRIES(fs->block_size)) {
+        problem(t, &t->report.broken, 0, d->path, "entry count %d is out of range", dir->size);
+        return;
+    }
+    if (strcmp(dir->entries[0].file_name, ".") != 0 || dir->entries[0].block_id != d->block ||
+        strcmp(dir->entries[1].file_name, "..") != 0 || dir->entries[1].block_id != d->parent) {
+        problem(t, &t->report.broken, 0, d->path, "\".\" or \"..\" is wrong");
+    }
+    int count = 2 + check_entries(t, d, dir, 2);
+    if (dir->index != 0) {
+        int depth = 1;
+        if (dir->index >= fs->data_start && dir->index < fs->block_count) {
+            const struct heartyfs_dir_index *root = heartyfs_block(fs, dir->index);
+            depth = root->depth == 2 ? 2 : 1;
+        }
+        int n = check_index(t, d, dir->index, depth);
+        count = n < 0 ? -1 : count + n;
+    }
+    if (count >= 0 && dir->count != count) {
+        problem(t, &t->report.bad_counts, t->ck->repair, d->path,
+                "directory says it has %d entries, not %d", dir->count, count);
+        if (t->ck->repair) {
+            dir->count = count;
+        }
+    }
+    if (dir->tail_block != 0 && claim(t, d->path, dir->tail_block, KIND_TAIL) == 0) {
+        check_open_tail(t, d->path, d->block, dir->tail_block);
+    }
+}
+
+// Pass 1: read the allocated blocks of a slice of the image in order
+static void *prefetch(void *arg) {
+    struct fsck_thread *t = arg;
+    struct heartyfs *fs = t->ck->fs;
+    char *buf = malloc(PREFETCH_BYTES);
+    if (buf == NULL) {
+        return NULL;
+    }
+    int span = fs->block_count - fs->data_start;
+    int first = fs->data_start + (long long)span * t->index / t->ck->threads;
+    int end = fs->data_start + (long long)span * (t->index + 1) / t->ck->threads;
+    int per_read = PREFETCH_BYTES / fs->block_size;
+    for (int b = first; b < end;) {
+        int run = 0;
+        while (b + run < end && run < per_read && heartyfs_block_in_use(fs, b + run)) {
+            run++;
+        }
+        if (run > 0 && pread(fs->fd, buf, (size_t)run * fs->block_size,
+                             (off_t)b * fs->block_size) < 0) {
+            break;
+        }
+        b += run > 0 ? run : 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Pass 2: check directories until there are none left
+static void *walk(void *arg) {
+    struct fsck_thread *t = arg;
+    struct fsck *ck = t->ck;
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        while (ck->depth == 0 && ck->busy > 0) {
+            pthread_cond_wait(&ck->changed, &ck->lock);
+        }
+        if (ck->depth == 0) {
+            break;
+        }
+        struct fsck_dir d = ck->stack[--ck->depth];
+        ck->busy++;
+        pthread_mutex_unlock(&ck->lock);
+        check_dir(t, &d);
+        free(d.path);
+        pthread_mutex_lock(&ck->lock);
+        if (--ck->busy == 0 && ck->depth == 0) {
+            pthread_cond_broadcast(&ck->changed);
+        }
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+// Check the bookkeeping of a tail block against the files found in it
+static void check_tail(struct fsck_thread *t, int block) {
+    struct fsck *ck = t->ck;
+    struct heartyfs *fs = ck->fs;
+    struct heartyfs_tail_block *tb = heartyfs_block(fs, block);
+    char what[32];
+    snprintf(what, sizeof(what), "tail block %d", block);
+    if ((unsigned int)tb->live != ck->refs[block]) {
+        problem(t, &t->report.bad_tails, ck->repair, what, "%d live bytes, not %u", tb->live,
+                ck->refs[block]);
+        if (ck->repair) {
+            tb->live = ck->refs[block];
+        }
+    }
+    if (tb->dir == 0) {
+        return;
+    }
+    int open = tb->dir >= fs->data_start && tb->dir < fs->block_count &&
+               ck->kinds[tb->dir] == KIND_META &&
+               ((const struct heartyfs_directory *)heartyfs_block(fs, tb->dir))->type ==
+                   INODE_TYPE_DIR &&
+               ((const struct heartyfs_directory *)heartyfs_block(fs, tb->dir))->tail_block ==
+                   block;
+    if (!open) {
+        problem(t, &t->report.bad_tails, ck->repair, what,
+                "directory %d it belongs to does not pack into it", tb->dir);
+        if (ck->repair) {
+            tb->dir = 0;
+        }
+    }
+}
+
+// Pass 3: compare what the walk found with the bitmap and the reference
+// counts, for a range of blocks on whole bitmap words
+static void *compare(void *arg) {
+    struct fsck_thread *t = arg;
+    struct fsck *ck = t->ck;
+    struct heartyfs *fs = ck->fs;
+    uint64_t *bitmap = heartyfs_block(fs, fs->bitmap_start);
+    uint16_t *entries = heartyfs_block(fs, fs->refcount_start);
+    int words = (fs->block_count + 63) / 64;
+    int first = (long long)words * t->index / ck->threads * 64;
+    int end = (long long)words * (t->index + 1) / ck->threads * 64;
+    end = end < fs->block_count ? end : fs->block_count;
+    char what[32];
+    for (int b = first; b < end; b++) {
+        int kind = ck->kinds[b];
+        t->report.used_blocks += b >= fs->data_start && kind != KIND_FREE;
+        uint64_t mask = htole64(1ULL << (b % 64));
+        int free_bit = (bitmap[b / 64] & mask) != 0;
+        snprintf(what, sizeof(what), "block %d", b);
+        if (kind == KIND_FREE && !free_bit) {
+            problem(t, &t->report.leaked, ck->repair, what, "allocated but not reachable");
+            if (ck->repair) {
+                bitmap[b / 64] |= mask;
+            }
+        } else if (kind != KIND_FREE && free_bit) {
+            problem(t, &t->report.missing, ck->repair, what, "reachable but free");
+            if (ck->repair) {
+                bitmap[b / 64] &= ~mask;
+            }
+        }
+        // The superblock counters are checked against the image as a
+        // repair leaves it, so that a check foresees what -r would change
+        t->free_blocks += kind == KIND_FREE;
+
+        // Data blocks count their references past the first, and whether
+        // the dedup index points at them; every other block 0
+        unsigned int want = 0;
+        if (kind == KIND_DATA) {
+            want = ck->refs[b] - 1;
+            if (want > REF_MAX) {
+                problem(t, &t->report.broken, 0, what, "%u references", ck->refs[b]);
+                want = REF_MAX;
+            }
+            want |= entries[b] & REF_INDEXED;
+        }
+        if (entries[b] != want) {
+            problem(t, &t->report.bad_refs, ck->repair, what, "reference count %#x, not %#x",
+                    entries[b], want);
+            if (ck->repair) {
+                entries[b] = want;
+            }
+        }
+        t->shared_refs += want & REF_MAX;
+        if (kind == KIND_TAIL) {
+            check_tail(t, b);
+        }
+    }
+    return NULL;
+}
+
+// Run one pass on every thread, or here for a thread that cannot be
+// started
+static void run_pass(struct fsck *ck, struct fsck_thread *threads, void *(*pass)(void *)) {
+    int started[FSCK_MAX_THREADS];
+    for (int i = 0; i < ck->threads; i++) {
+        started[i] = pthread_create(&threads[i].thread, NULL, pass, &threads[i]) == 0;
+        if (!started[i]) {
+            pass(&threads[i]);
+        }
+    }
+    for (int i = 0; i < ck->threads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i].thread, NULL);
+        }
+    }
+}
+
+// Check the superblock's counters against what the compare pass counted
+static void check_super(struct fsck_thread *t, unsigned int free_blocks,
+                        unsigned int shared_refs) {
+    struct heartyfs_super *sb = heartyfs_block(t->ck->fs, SUPER_BLOCK);
+    if (sb->free_blocks != free_blocks) {
+        problem(t, &t->report.bad_counts, t->ck->repair, "superblock", "%u free blocks, not %u",
+                sb->free_blocks, free_blocks);
+        if (t->ck->repair) {
+            sb->free_blocks = free_blocks;
+        }
+    }
+    if (sb->shared_refs != shared_refs) {
+        problem(t, &t->report.bad_counts, t->ck->repair, "superblock",
+                "%u shared references, not %u", sb->shared_refs, shared_refs);
+        if (t->ck->repair) {
+            sb->shared_refs = shared_refs;
+        }
+    }
+}
+
+static void add_report(struct heartyfs_fsck_report *sum, const struct heartyfs_fsck_report *r) {
+    sum->dirs += r->dirs;
+    sum->files += r->files;
+    sum->used_blocks += r->used_blocks;
+    sum->leaked += r->leaked;
+    sum->missing += r->missing;
+    sum->bad_refs += r->bad_refs;
+    sum->bad_tails += r->bad_tails;
+    sum->bad_counts += r->bad_counts;
+    sum->broken += r->broken;
+    sum->repaired += r->repaired;
+}
+
+// Check the mounted image: walk the tree from the root and compare the
+// blocks it reaches with the bitmap and the reference counts, the files
+// in each tail block with its bookkeeping, and the entries of each
+// directory and the superblock's counters with what they count. With
+// repair, put right everything but what report->broken counts. Each
+// problem is described on log, if not NULL. Uses threads threads, or one
+// per CPU if 0. Fails with -EBUSY if another process has the image
+// mounted, and keeps others from mounting it until done.
+int heartyfs_fsck(struct heartyfs *fs, int threads, int repair, FILE *log,
+                  struct heartyfs_fsck_report *report) {
+    memset(report, 0, sizeof(*report));
+    if (repair && fs->readonly) {
+        return -EROFS;
+    }
+    threads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < 1 ? 1 : threads > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : threads;
+    int rc = heartyfs_lock_image(fs);
+    if (rc < 0) {
+        return rc;
+    }
+    if (repair && (rc = heartyfs_checkpoint(fs)) < 0) {
+        heartyfs_shared_ready(fs);
+        return rc;
+    }
+
+    struct fsck ck = {.fs = fs, .repair = repair, .log = log, .threads = threads};
+    struct fsck_thread *ts = calloc(threads, sizeof(*ts));
+    ck.kinds = calloc(fs->block_count, 1);
+    ck.refs = calloc(fs->block_count, sizeof(*ck.refs));
+    if (ts == NULL || ck.kinds == NULL || ck.refs == NULL) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    pthread_mutex_init(&ck.lock, NULL);
+    pthread_cond_init(&ck.changed, NULL);
+    for (int i = 0; i < threads; i++) {
+        ts[i].ck = &ck;
+        ts[i].index = i;
+    }
+    memset(ck.kinds, KIND_META, fs->data_start);
+
+    run_pass(&ck, ts, prefetch);
+    push_dir(&ts[0], fs->root_block, fs->root_block, strdup(""));
+    run_pass(&ck, ts, walk);
+    free(ck.stack);
+    if (ck.out_of_memory) {
+        // Blocks of the directories left out would look leaked
+        rc = -ENOMEM;
+    } else {
+        run_pass(&ck, ts, compare);
+        unsigned int free_blocks = 0;
+        unsigned int shared_refs = 0;
+        for (int i = 0; i < threads; i++) {
+            free_blocks += ts[i].free_blocks;
+            shared_refs += ts[i].shared_refs;
+        }
+        check_super(&ts[0], free_blocks, shared_refs);
+        for (int i = 0; i < threads; i++) {
+            add_report(report, &ts[i].report);
+        }
+        if (report->repaired > 0) {
+            rc = heartyfs_flush_blocks(fs, 0, fs->block_count);
+        }
+    }
+    pthread_cond_destroy(&ck.changed);
+    pthread_mutex_destroy(&ck.lock);
+out:
+    free(ts);
+    free(ck.kinds);
+    free(ck.refs);
+    heartyfs_shared_ready(fs);
+    return rc;
+}
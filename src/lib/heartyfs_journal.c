@@ -0,0 +1,501 @@
+#include "../heartyfs.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// Metadata blocks (directories, inodes, the bitmap) are never modified in
+// place while an operation runs. heartyfs_block_mut() hands out a private
+// copy instead, and heartyfs_sync() commits all copies gathered since the
+// last commit as one transaction: data blocks are flushed, the copies are
+// appended to the log under a checksummed descriptor and flushed with a
+// single msync, and only then are they copied to their home locations.
+// Home locations are flushed lazily, when the log fills up (a checkpoint)
+// or at unmount; a crash before that is repaired by replaying the log.
+//
+// The log, and where the next transaction goes in it, is shared by every
+// process that mounts the image; writing to it takes the journal lock.
+// The bitmap, the reference counts and the superblock are the exception
+// to private copies: processes allocate from them concurrently, in place
+// (see heartyfs_bitmap.c). A transaction only lists them, logs whatever
+// they hold as it is written, and applies its frees to them once it is
+// durable. A crash may then replay allocations that had not committed
+// yet, which leaks those blocks but never hands one out twice.
+
+static struct heartyfs_journal_header *journal_header(struct heartyfs *fs) {
+    return (void *)((char *)fs->disk + (size_t)fs->journal_start * fs->block_size);
+}
+
+// Number of log positions after the journal header
+static int log_blocks(struct heartyfs *fs) {
+    return fs->journal_blocks - 1;
+}
+
+// Get the block at a position of the log
+static void *log_block(struct heartyfs *fs, int pos) {
+    return (char *)fs->disk + (size_t)(fs->journal_start + 1 + pos) * fs->block_size;
+}
+
+static void *home_block(struct heartyfs *fs, int block_id) {
+    return (char *)fs->disk + (size_t)block_id * fs->block_size;
+}
+
+// Whether a block is updated in place rather than through a private copy:
+// the superblock, the bitmap and the reference counts that follow it
+static int is_live(struct heartyfs *fs, int block_id) {
+    return block_id < fs->refcount_start + fs->refcount_blocks;
+}
+
+static void mark_logged(struct heartyfs *fs, int block_id) {
+    __atomic_fetch_or(&fs->shared->in_log[block_id / 64], 1ULL << (block_id % 64),
+                      __ATOMIC_SEQ_CST);
+}
+
+// Number of blocks the descriptor of a count-block transaction takes up
+static int descriptor_blocks(struct heartyfs *fs, int count) {
+    size_t bytes = sizeof(struct heartyfs_journal_descriptor) + (size_t)count * sizeof(int);
+    return (bytes + fs->block_size - 1) / fs->block_size;
+}
+
+// FNV-1a, continued from hash over len more bytes
+static unsigned int checksum(unsigned int hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619U;
+    }
+    return hash;
+}
+
+// Checksum a descriptor (as if its checksum field were 0), its target list
+// and the images that follow it
+static unsigned int transaction_checksum(struct heartyfs *fs,
+                                         const struct heartyfs_journal_descriptor *desc,
+                                         const void *images) {
+    struct heartyfs_journal_descriptor copy = *desc;
+    copy.checksum = 0;
+    unsigned int hash = checksum(2166136261U, &copy, sizeof(copy));
+    hash = checksum(hash, desc->targets, (size_t)desc->count * sizeof(int));
+    return checksum(hash, images, (size_t)desc->count * fs->block_size);
+}
+
+// Set up an empty running transaction, sized so that it always fits in
+// the log in one piece
+int heartyfs_journal_init(struct heartyfs *fs) {
+    fs->txn_max = log_blocks(fs) - 1;
+    while (fs->txn_max > 0 &&
+           descriptor_blocks(fs, fs->txn_max) + fs->txn_max > log_blocks(fs)) {
+        fs->txn_max--;
+    }
+    if (fs->txn_max < OP_MAX_BLOCKS) {
+        return -EINVAL;
+    }
+
+    int slots = 1;
+    while (slots < 2 * fs->txn_max) {
+        slots *= 2;
+    }
+    fs->txn_slot_mask = slots - 1;
+    fs->txn_slots = calloc(slots, sizeof(int));
+    fs->txn_map = calloc(fs->block_count / 8 + 1, 1);
+    fs->txn_blocks = malloc(fs->txn_max * sizeof(int));
+    fs->txn_images = malloc((size_t)fs->txn_max * fs->block_size);
+    fs->txn_count = 0;
+    fs->pending_free = NULL;
+    fs->pending_free_count = 0;
+    fs->pending_free_cap = 0;
+    fs->txn_free_count = 0;
+    fs->txn_drop_count = 0;
+    fs->txn_ops = 0;
+    fs->group_ops = 1;
+    if (fs->txn_slots == NULL || fs->txn_map == NULL || fs->txn_blocks == NULL ||
+        fs->txn_images == NULL) {
+        heartyfs_journal_free(fs);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void heartyfs_journal_free(struct heartyfs *fs) {
+    free(fs->txn_slots);
+    free(fs->txn_map);
+    free(fs->txn_blocks);
+    free(fs->txn_images);
+    free(fs->pending_free);
+    fs->txn_slots = NULL;
+    fs->txn_map = NULL;
+    fs->txn_blocks = NULL;
+    fs->txn_images = NULL;
+    fs->pending_free = NULL;
+}
+
+static int slot_of(struct heartyfs *fs, int block_id) {
+    return (unsigned int)block_id * 2654435761U & fs->txn_slot_mask;
+}
+
+// Find the private copy of a block in the running transaction (for the
+// live blocks: the image it will log), or NULL. Slots hold the
+// index of the copy plus one, so 0 marks an empty slot.
+void *heartyfs_txn_image(struct heartyfs *fs, int block_id) {
+    for (int slot = slot_of(fs, block_id); fs->txn_slots[slot] != 0;
+         slot = (slot + 1) & fs->txn_slot_mask) {
+        int i = fs->txn_slots[slot] - 1;
+        if (fs->txn_blocks[i] == block_id) {
+            return fs->txn_images + (size_t)i * fs->block_size;
+        }
+    }
+    return NULL;
+}
+
+// Whether the running transaction has modified a block
+int heartyfs_in_txn(struct heartyfs *fs, int block_id) {
+    if (is_live(fs, block_id)) {
+        return heartyfs_txn_image(fs, block_id) != NULL;
+    }
+    return (fs->txn_map[block_id / 8] & (1 << (block_id % 8))) != 0;
+}
+
+// Get a pointer to a specific block, as the running transaction sees it
+void *heartyfs_block(struct heartyfs *fs, int block_id) {
+    if (fs->txn_map[block_id / 8] & (1 << (block_id % 8))) {
+        return heartyfs_txn_image(fs, block_id);
+    }
+    return home_block(fs, block_id);
+}
+
+// Add a block to the running transaction and return its image slot
+static char *txn_add(struct heartyfs *fs, int block_id) {
+    // heartyfs_commit() keeps room for OP_MAX_BLOCKS more blocks
+    assert(fs->txn_count < fs->txn_max);
+
+    int i = fs->txn_count++;
+    fs->txn_blocks[i] = block_id;
+    int slot = slot_of(fs, block_id);
+    while (fs->txn_slots[slot] != 0) {
+        slot = (slot + 1) & fs->txn_slot_mask;
+    }
+    fs->txn_slots[slot] = i + 1;
+    return fs->txn_images + (size_t)i * fs->block_size;
+}
+
+// Get a pointer to a metadata block that is about to be modified
+void *heartyfs_block_mut(struct heartyfs *fs, int block_id) {
+    assert(!is_live(fs, block_id));
+    unsigned char mask = 1 << (block_id % 8);
+    if (fs->txn_map[block_id / 8] & mask) {
+        return heartyfs_txn_image(fs, block_id);
+    }
+    char *image = txn_add(fs, block_id);
+    memcpy(image, home_block(fs, block_id), fs->block_size);
+    fs->txn_map[block_id / 8] |= mask;
+    return image;
+}
+
+// Get a pointer to the live block (bitmap, reference counts or superblock)
+// at block_id, which the caller is about to update in place, and make sure
+// the running transaction logs it
+void *heartyfs_block_log(struct heartyfs *fs, int block_id) {
+    assert(is_live(fs, block_id));
+    if (heartyfs_txn_image(fs, block_id) == NULL) {
+        txn_add(fs, block_id);
+    }
+    return home_block(fs, block_id);
+}
+
+// Append the running transaction to the log and flush it
+static int write_transaction(struct heartyfs *fs) {
+    HEARTYFS_TIME_START(start);
+    struct heartyfs_shared *shared = fs->shared;
+    int desc_blocks = descriptor_blocks(fs, fs->txn_count);
+    struct heartyfs_journal_descriptor *desc = log_block(fs, shared->journal_pos);
+    void *images = log_block(fs, shared->journal_pos + desc_blocks);
+
+    // Take the images of the blocks updated in place, as they are now plus
+    // what this transaction frees
+    for (int i = 0; i < fs->txn_count; i++) {
+        if (is_live(fs, fs->txn_blocks[i])) {
+            memcpy(fs->txn_images + (size_t)i * fs->block_size,
+                   home_block(fs, fs->txn_blocks[i]), fs->block_size);
+        }
+    }
+    heartyfs_apply_frees(fs, 0);
+
+    memset(desc, 0, (size_t)desc_blocks * fs->block_size);
+    desc->magic = JOURNAL_TXN_MAGIC;
+    desc->sequence = shared->journal_seq;
+    desc->count = fs->txn_count;
+    memcpy(desc->targets, fs->txn_blocks, fs->txn_count * sizeof(int));
+    memcpy(images, fs->txn_images, (size_t)fs->txn_count * fs->block_size);
+    desc->checksum = transaction_checksum(fs, desc, images);
+
+    int rc = heartyfs_flush_blocks(fs, fs->journal_start + 1 + shared->journal_pos,
+                                   desc_blocks + fs->txn_count);
+    if (rc < 0) {
+        return rc;
+    }
+    for (int i = 0; i < fs->txn_count; i++) {
+        mark_logged(fs, fs->txn_blocks[i]);
+    }
+    shared->last_txn_pos = shared->journal_pos;
+    shared->journal_pos += desc_blocks + fs->txn_count;
+    shared->journal_seq++;
+    HEARTYFS_TIME_END(fs, PHASE_JOURNAL_WRITE, start);
+    return 0;
+}
+
+// Copy the private blocks of the transaction at log position pos to their
+// home locations, telling lock-free readers of each one
+static void install_transaction(struct heartyfs *fs, int pos) {
+    HEARTYFS_TIME_START(start);
+    const struct heartyfs_journal_descriptor *desc = log_block(fs, pos);
+    const char *images = log_block(fs, pos + descriptor_blocks(fs, desc->count));
+    for (int i = 0; i < desc->count; i++) {
+        int block_id = desc->targets[i];
+        if (!is_live(fs, block_id)) {
+            heartyfs_install_begin(fs, block_id);
+            memcpy(home_block(fs, block_id), images + (size_t)i * fs->block_size,
+                   fs->block_size);
+            heartyfs_install_end(fs, block_id);
+        }
+    }
+    HEARTYFS_TIME_END(fs, PHASE_INSTALL, start);
+}
+
+// Flush every block in the log to its home location and empty the log.
+// The caller holds the journal lock.
+static int checkpoint(struct heartyfs *fs) {
+    HEARTYFS_TIME_START(start);
+    struct heartyfs_shared *shared = fs->shared;
+    int total_words = (fs->block_count + 63) / 64;
+    for (int w = 0; w < total_words; w++) {
+        for (uint64_t word = shared->in_log[w]; word != 0; word &= word - 1) {
+            heartyfs_dirty_add(&fs->home_dirty, w * 64 + __builtin_ctzll(word));
+        }
+    }
+    int rc = heartyfs_dirty_flush(fs, &fs->home_dirty);
+    if (rc < 0) {
+        return rc;
+    }
+    memset(shared->in_log, 0, total_words * sizeof(uint64_t));
+
+    struct heartyfs_journal_header *header = journal_header(fs);
+    header->sequence = shared->journal_seq;
+    header->start = 0;
+    shared->journal_pos = 0;
+    shared->last_txn_pos = -1;
+    fs->checkpoint_needed = 0;
+    fs->stats.checkpoints++;
+    rc = heartyfs_flush_blocks(fs, fs->journal_start, 1);
+    HEARTYFS_TIME_END(fs, PHASE_CHECKPOINT, start);
+    return rc;
+}
+
+int heartyfs_checkpoint(struct heartyfs *fs) {
+    int rc = heartyfs_lock_journal(fs);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = checkpoint(fs);
+    heartyfs_unlock_journal(fs);
+    return rc;
+}
+
+// Write the running transaction to the log and install it
+static int commit_transaction(struct heartyfs *fs) {
+    if (fs->txn_count == 0 && fs->data_dirty.count == 0 && fs->pending_free_count == 0) {
+        return 0;
+    }
+    HEARTYFS_TIME_START(start);
+    fs->stats.last_bytes_flushed = 0;
+    fs->stats.data_blocks_written += fs->data_dirty.count;
+
+    // Data must be on disk before the metadata that points at it
+    int rc = heartyfs_dirty_flush(fs, &fs->data_dirty);
+    if (rc < 0 || (fs->txn_count == 0 && fs->pending_free_count == 0)) {
+        return rc;
+    }
+
+    rc = heartyfs_lock_journal(fs);
+    if (rc < 0) {
+        return rc;
+    }
+    heartyfs_release_pending(fs);
+
+    // No older transaction may be replayed over a data block, and the
+    // transaction has to fit in the log
+    int needed = descriptor_blocks(fs, fs->txn_count) + fs->txn_count;
+    if (fs->checkpoint_needed || fs->shared->journal_pos + needed > log_blocks(fs)) {
+        rc = checkpoint(fs);
+    }
+    if (rc == 0) {
+        rc = write_transaction(fs);
+    }
+    if (rc < 0) {
+        fs->txn_free_count = 0;
+        fs->txn_drop_count = 0;
+        heartyfs_unlock_journal(fs);
+        return rc;
+    }
+
+    // The transaction is durable; install it at the home locations
+    install_transaction(fs, fs->shared->last_txn_pos);
+    heartyfs_apply_frees(fs, 1);
+    heartyfs_dedup_publish(fs);
+    for (int i = 0; i < fs->txn_count; i++) {
+        fs->txn_map[fs->txn_blocks[i] / 8] = 0;
+    }
+    memset(fs->txn_slots, 0, (fs->txn_slot_mask + 1) * sizeof(int));
+    fs->stats.blocks_logged += fs->txn_count;
+    fs->txn_count = 0;
+    fs->stats.commits++;
+    if (fs->namespace_dirty) {
+        heartyfs_dcache_invalidate(fs);
+    }
+    heartyfs_unlock_journal(fs);
+    HEARTYFS_TIME_END(fs, PHASE_COMMIT, start);
+    heartyfs_counters_publish(fs);
+    return 0;
+}
+
+// Commit the running transaction, whatever the group size, but keep the
+// directory locks it holds. Blocks freed in it become allocatable again
+// from here on; frees that did not fit in it go into further transactions.
+int heartyfs_sync_keep_locks(struct heartyfs *fs) {
+    fs->txn_ops = 0;
+    int rc;
+    do {
+        rc = commit_transaction(fs);
+    } while (rc == 0 && fs->pending_free_count > 0);
+    return rc;
+}
+
+// Commit the running transaction and release its directory locks
+int heartyfs_sync(struct heartyfs *fs) {
+    int rc = heartyfs_sync_keep_locks(fs);
+    if (rc == 0) {
+        heartyfs_unlock_all(fs);
+    }
+    return rc;
+}
+
+// Mark the end of an operation. The running transaction is committed once
+// group_ops operations have gathered in it, or when it might not have room
+// for another operation.
+int heartyfs_commit(struct heartyfs *fs) {
+    fs->stats.ops++;
+    fs->txn_ops++;
+    HEARTYFS_OP_DONE(fs);
+    if (fs->txn_ops >= fs->group_ops || fs->txn_count + OP_MAX_BLOCKS > fs->txn_max) {
+        return heartyfs_sync(fs);
+    }
+    return 0;
+}
+
+// Mark the end of an operation that failed with rc, and return rc. The
+// failure left nothing worth committing, but the operation may have taken
+// locks; unless earlier operations are waiting in the transaction with
+// them, it is committed now so that they are released.
+int heartyfs_fail(struct heartyfs *fs, int rc) {
+    if (fs->txn_ops == 0) {
+        heartyfs_sync(fs);
+    }
+    return rc;
+}
+
+// Gather up to ops operations into each transaction. With ops > 1 a crash
+// may lose the most recent operations, but never leaves them half applied.
+void heartyfs_set_group_commit(struct heartyfs *fs, int ops) {
+    fs->group_ops = ops < 1 ? 1 : ops;
+}
+
+// Take the sequence and the log position of the next transaction from
+// the journal header into the shared state, which the first process to
+// mount the image has just set up. Returns NULL if there is no journal.
+static struct heartyfs_journal_header *journal_load(struct heartyfs *fs) {
+    struct heartyfs_journal_header *header = journal_header(fs);
+    if (header->magic != JOURNAL_MAGIC) {
+        return NULL;
+    }
+    fs->shared->journal_seq = header->sequence;
+    fs->shared->journal_pos = header->start;
+    return header;
+}
+
+// Re-apply every committed transaction in the log, then empty it. Only
+// done by the first process to mount the image, before anyone allocates.
+int heartyfs_journal_replay(struct heartyfs *fs) {
+    struct heartyfs_shared *shared = fs->shared;
+    if (journal_load(fs) == NULL) {
+        return -EINVAL;
+    }
+
+    int replayed = 0;
+    while (shared->journal_pos < log_blocks(fs)) {
+        struct heartyfs_journal_descriptor *desc = log_block(fs, shared->journal_pos);
+        if (desc->magic != JOURNAL_TXN_MAGIC || desc->sequence != shared->journal_seq ||
+            desc->count <= 0 || desc->count > fs->txn_max) {
+            break;
+        }
+        int desc_blocks = descriptor_blocks(fs, desc->count);
+        if (shared->journal_pos + desc_blocks + desc->count > log_blocks(fs)) {
+            break;
+        }
+        char *images = log_block(fs, shared->journal_pos + desc_blocks);
+        if (transaction_checksum(fs, desc, images) != desc->checksum) {
+            break;
+        }
+
+        for (int i = 0; i < desc->count; i++) {
+            int block_id = desc->targets[i];
+            if (block_id < 0 || block_id >= fs->block_count ||
+                (block_id >= fs->journal_start &&
+                 block_id < fs->journal_start + fs->journal_blocks)) {
+                continue;
+            }
+            memcpy(home_block(fs, block_id), images + (size_t)i * fs->block_size,
+                   fs->block_size);
+            mark_logged(fs, block_id);
+        }
+        shared->journal_pos += desc_blocks + desc->count;
+        shared->journal_seq++;
+        replayed++;
+    }
+    if (replayed == 0) {
+        return 0;
+    }
+
+    // The bitmap and the free count were logged at different moments of
+    // concurrent allocation, so the count is taken afresh
+    struct heartyfs_super *sb = home_block(fs, SUPER_BLOCK);
+    sb->free_blocks = heartyfs_count_free(fs);
+    mark_logged(fs, SUPER_BLOCK);
+    heartyfs_dcache_invalidate(fs);
+    return checkpoint(fs);
+}
+
+// Finish the commit of a process that died holding the journal lock: its
+// newest transaction may be durable but only partly installed. Installing
+// it again is harmless if it was complete. Frees it had not applied yet
+// are lost, which leaks those blocks.
+void heartyfs_journal_recover(struct heartyfs *fs) {
+    heartyfs_install_repair(fs);
+    if (fs->shared->last_txn_pos >= 0) {
+        install_transaction(fs, fs->shared->last_txn_pos);
+    }
+    heartyfs_dcache_invalidate(fs);
+}
+
+// Whether the log holds a transaction that replay would apply. Called in
+// place of replay by a read-only process mounting first, which sets the
+// shared state up just the same: processes that mount the image read-write
+// after it go on writing the log where the header says.
+int heartyfs_journal_dirty(struct heartyfs *fs) {
+    const struct heartyfs_journal_header *header = journal_load(fs);
+    if (header == NULL) {
+        return -EINVAL;
+    }
+    if (header->start < 0 || header->start >= log_blocks(fs)) {
+        return 0;
+    }
+    const struct heartyfs_journal_descriptor *desc = log_block(fs, header->start);
+    return desc->magic == JOURNAL_TXN_MAGIC && desc->sequence == header->sequence;
+}
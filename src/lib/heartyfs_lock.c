@@ -0,0 +1,334 @@
+#define _GNU_SOURCE  // F_OFD_SETLK
+#include "../heartyfs.h"
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Several processes may mount an image at once. They agree through the
+// shared segment: commits and checkpoints take the journal lock, and an
+// operation locks every directory it modifies (and with it the inodes of
+// the files in it) until the transaction holding the change commits.
+// Allocation needs no lock; it claims bitmap bits with compare-and-swap.
+//
+// A process never waits for a directory lock while holding another one:
+// if the lock it wants is busy, it commits first, which releases the ones
+// it has. Nothing can deadlock that way. The mutexes are robust, so a
+// process that dies holding one only loses its uncommitted changes.
+//
+// Mounting is serialized with flock() on the image, and a shared byte lock
+// held for as long as the image is mounted tells a process whether it is
+// the only one mounting it. Only then is the segment set up afresh and the
+// journal replayed; replaying under someone else's feet would undo
+// allocations they have made since. Both kinds of lock work on a file
+// opened read-only, so read-only mounts take part too.
+//
+// Readers take no locks at all. Installing a committed block bumps the
+// sequence counter of its stripe before and after the copy, and a reader
+// checks that the counters of every block it looked at are unchanged at
+// the end, and starts over otherwise.
+
+#define MOUNTED_BYTE 0
+
+static int lock_byte(int fd, int cmd, short type, off_t byte) {
+    struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1};
+    return fcntl(fd, cmd, &fl) == 0 ? 0 : -errno;
+}
+
+static unsigned int stripe_of(int block_id) {
+    return (unsigned int)block_id * 2654435761U >> 22 & (LOCK_STRIPES - 1);
+}
+
+static unsigned int seq_stripe_of(int block_id) {
+    return (unsigned int)block_id * 2654435761U >> 20 & (SEQ_STRIPES - 1);
+}
+
+static unsigned int *seq_of(struct heartyfs *fs, int block_id) {
+    return &fs->shared->block_seq[seq_stripe_of(block_id)];
+}
+
+// Whether anyone else has the image mounted. A read-only file can only be
+// tested for an exclusive lock, not given one, but mounting is serialized
+// so that makes no difference.
+static int mounted_alone(struct heartyfs *fs) {
+    struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = MOUNTED_BYTE,
+                       .l_len = 1};
+    if (fs->readonly) {
+        return fcntl(fs->fd, F_OFD_GETLK, &fl) == 0 && fl.l_type == F_UNLCK;
+    }
+    return fcntl(fs->fd, F_OFD_SETLK, &fl) == 0;
+}
+
+// Lock a robust mutex, taking over from an owner that died
+static int lock_robust(pthread_mutex_t *mutex, int wait, int *owner_died) {
+    int rc = wait ? pthread_mutex_lock(mutex) : pthread_mutex_trylock(mutex);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+        *owner_died = 1;
+        rc = 0;
+    }
+    return -rc;
+}
+
+static void init_shared(struct heartyfs *fs, struct heartyfs_shared *shared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->journal_lock, &attr);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_mutex_init(&shared->dir_locks[i], &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    shared->block_count = fs->block_count;
+    shared->last_txn_pos = -1;
+}
+
+// Attach to the shared state of the image open on fs->fd. Returns 1 if
+// this process is the only one mounting the image, in which case the state
+// is new and the caller must recover the image before calling
+// heartyfs_shared_ready(). Other processes wait to mount until then.
+int heartyfs_shared_attach(struct heartyfs *fs) {
+    if (flock(fs->fd, LOCK_EX) != 0) {
+        return -errno;
+    }
+    int alone = mounted_alone(fs);
+    int rc = lock_byte(fs->fd, F_OFD_SETLK, F_RDLCK, MOUNTED_BYTE);
+    if (rc < 0) {
+        return rc;
+    }
+
+    struct stat st;
+    if (fstat(fs->fd, &st) != 0) {
+        return -errno;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), SHARED_NAME_FORMAT, (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino);
+    size_t size = sizeof(struct heartyfs_shared) + (fs->block_count + 63) / 64 * 8;
+
+    // Start from a new segment whenever nobody else is using the old one
+    if (alone) {
+        shm_unlink(name);
+    }
+    int fd = shm_open(name, alone ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0 || (alone && ftruncate(fd, size) != 0) ||
+        (!alone && (fstat(fd, &st) != 0 || (size_t)st.st_size != size))) {
+        rc = fd < 0 ? -errno : -EINVAL;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!alone) {
+            return rc;
+        }
+        // Alone, the state need not be shared with anyone
+        fs->shared = calloc(1, size);
+        if (fs->shared == NULL) {
+            return -ENOMEM;
+        }
+        fs->shared_private = 1;
+        fd = -1;
+    } else {
+        fs->shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (fs->shared == MAP_FAILED) {
+            fs->shared = NULL;
+            return -errno;
+        }
+    }
+    fs->shared_size = size;
+
+    // As with the lookup cache, the magic goes in last
+    if (alone) {
+        init_shared(fs, fs->shared);
+        __atomic_store_n(&fs->shared->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&fs->shared->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC ||
+               fs->shared->block_count != fs->block_count) {
+        return -EINVAL;
+    }
+    return alone;
+}
+
+// Let other processes mount the image
+void heartyfs_shared_ready(struct heartyfs *fs) {
+    flock(fs->fd, LOCK_UN);
+}
+
+// Have the mounted image to ourselves until heartyfs_shared_ready(): keep
+// others from mounting it, and fail with -EBUSY if another process has it
+// mounted already. Our own byte lock does not count against us.
+int heartyfs_lock_image(struct heartyfs *fs) {
+    if (flock(fs->fd, LOCK_EX) != 0) {
+        return -errno;
+    }
+    struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = MOUNTED_BYTE,
+                       .l_len = 1};
+    if (fcntl(fs->fd, F_OFD_GETLK, &fl) != 0 || fl.l_type != F_UNLCK) {
+        flock(fs->fd, LOCK_UN);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+void heartyfs_shared_detach(struct heartyfs *fs) {
+    if (fs->shared == NULL) {
+        return;
+    }
+    if (fs->shared_private) {
+        free(fs->shared);
+    } else {
+        munmap(fs->shared, fs->shared_size);
+    }
+    fs->shared = NULL;
+}
+
+// Take the journal lock. If its owner died mid-commit, the transaction it
+// was installing is finished from the log first.
+int heartyfs_lock_journal(struct heartyfs *fs) {
+    int owner_died = 0;
+    int rc = lock_robust(&fs->shared->journal_lock, 1, &owner_died);
+    if (rc == 0 && owner_died) {
+        heartyfs_journal_recover(fs);
+    }
+    return rc;
+}
+
+void heartyfs_unlock_journal(struct heartyfs *fs) {
+    pthread_mutex_unlock(&fs->shared->journal_lock);
+}
+
+// Lock the directory at dir_block until the running transaction commits.
+// Returns 1 if other locks had to be given up (and the transaction
+// committed) to wait for this one: anything the operation looked up under
+// them may be stale by now. Fails with -ENOENT if the directory was
+// removed before the lock was granted, and with -EROFS on a read-only
+// mount, which makes every modifying operation fail before it starts.
+int heartyfs_lock_dir(struct heartyfs *fs, int dir_block) {
+    if (fs->readonly) {
+        return -EROFS;
+    }
+    unsigned int stripe = stripe_of(dir_block);
+    int dropped = 0;
+    if (!(fs->held_map[stripe / 8] & (1 << (stripe % 8)))) {
+        pthread_mutex_t *mutex = &fs->shared->dir_locks[stripe];
+        int owner_died = 0;
+        int rc = lock_robust(mutex, 0, &owner_died);
+        if (rc == -EBUSY) {
+            if (fs->held_count > 0) {
+                rc = heartyfs_sync(fs);
+                if (rc < 0) {
+                    return rc;
+                }
+                dropped = 1;
+            }
+            HEARTYFS_TIME_START(start);
+            rc = lock_robust(mutex, 1, &owner_died);
+            HEARTYFS_TIME_END(fs, PHASE_LOCK_WAIT, start);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        fs->held_map[stripe / 8] |= 1 << (stripe % 8);
+        fs->held_locks[fs->held_count++] = stripe;
+    }
+
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    if (dir->type == INODE_TYPE_DEAD) {
+        return -ENOENT;
+    }
+    if (dir->type != INODE_TYPE_DIR) {
+        return -ENOTDIR;
+    }
+    return dropped;
+}
+
+// Release every directory lock, once the changes made under them are
+// committed and installed
+void heartyfs_unlock_all(struct heartyfs *fs) {
+    for (int i = 0; i < fs->held_count; i++) {
+        int stripe = fs->held_locks[i];
+        pthread_mutex_unlock(&fs->shared->dir_locks[stripe]);
+        fs->held_map[stripe / 8] = 0;
+    }
+    fs->held_count = 0;
+}
+
+// Bracket the copy of a committed block to its home location. Installs
+// are serialized by the journal lock.
+void heartyfs_install_begin(struct heartyfs *fs, int block_id) {
+    unsigned int *seq = seq_of(fs, block_id);
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void heartyfs_install_end(struct heartyfs *fs, int block_id) {
+    unsigned int *seq = seq_of(fs, block_id);
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Even out the counter a process left odd by dying mid-install. Called
+// with the journal lock held, once the install has been redone.
+void heartyfs_install_repair(struct heartyfs *fs) {
+    for (int i = 0; i < SEQ_STRIPES; i++) {
+        if (fs->shared->block_seq[i] & 1) {
+            __atomic_fetch_add(&fs->shared->block_seq[i], 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Start reading a block without locking it. Returns the sequence to check
+// with heartyfs_read_changed() once done; waits out an install under way.
+unsigned int heartyfs_read_begin(struct heartyfs *fs, int block_id) {
+    unsigned int *seq = seq_of(fs, block_id);
+    unsigned int value;
+    while ((value = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return value;
+}
+
+// Whether the block may have been installed over since heartyfs_read_begin()
+int heartyfs_read_changed(struct heartyfs *fs, int block_id, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq_of(fs, block_id), __ATOMIC_RELAXED) != seq;
+}
+
+// Get a block for a lock-free reader and add it to the reader's set.
+// Returns NULL if block_id is not a block, which (unless the set turns out
+// to be stale) means the image is corrupt.
+const void *heartyfs_read_block(struct heartyfs *fs, struct heartyfs_read_set *set,
+                                int block_id) {
+    if (block_id < 0 || block_id >= fs->block_count || set->count == READ_SET_MAX) {
+        return NULL;
+    }
+    set->blocks[set->count] = block_id;
+    set->seqs[set->count] = heartyfs_read_begin(fs, block_id);
+    set->count++;
+    return heartyfs_block(fs, block_id);
+}
+
+// Whether nothing a reader looked at has been installed over since. If
+// not, whatever it read may be torn and it has to start over.
+int heartyfs_read_valid(struct heartyfs *fs, const struct heartyfs_read_set *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (heartyfs_read_changed(fs, set->blocks[i], set->seqs[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Count a free of block_id before it shows in the bitmap, so that copies
+// of the block cached by any mount stop being used before it can be
+// reallocated and overwritten
+void heartyfs_free_note(struct heartyfs *fs, int block_id) {
+    __atomic_fetch_add(&fs->shared->free_seq[seq_stripe_of(block_id)], 1, __ATOMIC_RELEASE);
+}
+
+// The free count of block_id's stripe: a copy of the block taken after
+// reading it is good for as long as it stays the same
+unsigned int heartyfs_free_seq(struct heartyfs *fs, int block_id) {
+    return __atomic_load_n(&fs->shared->free_seq[seq_stripe_of(block_id)], __ATOMIC_ACQUIRE);
+}
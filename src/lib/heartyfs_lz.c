@@ -0,0 +1,255 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+// A small LZ77 codec in the style of LZ4, for compressed files. Every data
+// block of such a file holds one stream of its own, so blocks decompress
+// independently, in any order. A stream is a series of sequences, each a
+// token byte (literal count in the high nibble, match length - LZ_MIN_MATCH
+// in the low one; 15 means more follow in bytes of 255 and a last one
+// below), the literals, then a 2-byte little-endian offset back into what
+// was decompressed so far. The stream ends after the literals or the
+// match of its last sequence.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Set up the buffers compressed files go through, unless already done
+int heartyfs_lz_init(struct heartyfs *fs) {
+    if (fs->lz_buf != NULL) {
+        return 0;
+    }
+    fs->lz_buf = malloc(LZ_BUF_BYTES);
+    fs->lz_table = malloc(sizeof(int) << LZ_HASH_BITS);
+    if (fs->lz_buf == NULL || fs->lz_table == NULL) {
+        heartyfs_lz_free(fs);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void heartyfs_lz_free(struct heartyfs *fs) {
+    free(fs->lz_buf);
+    free(fs->lz_table);
+    fs->lz_buf = NULL;
+    fs->lz_table = NULL;
+}
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash32(uint32_t v) {
+    return v * 2654435761U >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes it takes to carry on a length of len past the 15 of its nibble
+static int length_bytes(int len) {
+    return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static char *put_length(char *op, int len) {
+    if (len >= 15) {
+        for (len -= 15; len >= 255; len -= 255) {
+            *op++ = (char)255;
+        }
+        *op++ = (char)len;
+    }
+    return op;
+}
+
+static char *put_sequence(char *op, const char *lits, int lit_len, int offset, int match) {
+    int ml = match - LZ_MIN_MATCH;
+    *op++ = (char)((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+    op = put_length(op, lit_len);
+    memcpy(op, lits, lit_len);
+    op += lit_len;
+    *op++ = (char)(offset & 0xff);
+    *op++ = (char)(offset >> 8);
+    return put_length(op, ml);
+}
+
+// Compress buf from *pos up to end into at most cap bytes at dst, taking
+// in as much as fits, and advance *pos past what was taken. table
+// (1 << LZ_HASH_BITS entries) remembers where 4-byte sequences of buf were
+// last seen; it may hold anything, as every candidate is checked. Returns
+// the length of the stream.
+int heartyfs_lz_compress(int *table, const char *buf, int *pos, int end, char *dst, int cap) {
+    int start = *pos;
+    int ip = start;
+    int anchor = start;
+    char *op = dst;
+    char *op_end = dst + cap;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t seq = read32(buf + ip);
+        unsigned int h = hash32(seq);
+        int cand = table[h];
+        table[h] = ip;
+        if (cand < start || cand >= ip || ip - cand > LZ_MAX_OFFSET || read32(buf + cand) != seq) {
+            // Step faster through data that does not compress, but stop
+            // once the literals alone would not fit
+            ip += 1 + ((ip - anchor) >> 6);
+            if (ip - anchor > op_end - op) {
+                break;
+            }
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len + 8 <= end && read64(buf + cand + len) == read64(buf + ip + len)) {
+            len += 8;
+        }
+        while (ip + len < end && buf[cand + len] == buf[ip + len]) {
+            len++;
+        }
+        while (ip > anchor && cand > start && buf[ip - 1] == buf[cand - 1]) {
+            ip--;
+            cand--;
+            len++;
+        }
+        int lits = ip - anchor;
+        int cost = 1 + length_bytes(lits) + lits + 2 + length_bytes(len - LZ_MIN_MATCH);
+        if (cost > op_end - op) {
+            break;
+        }
+        op = put_sequence(op, buf + anchor, lits, ip - cand, len);
+        ip += len;
+        anchor = ip;
+        if (ip - 2 > start && ip + LZ_MIN_MATCH <= end) {
+            table[hash32(read32(buf + ip - 2))] = ip - 2;
+        }
+    }
+
+    // The rest goes in as literals, as many as fit
+    int lits = end - anchor;
+    while (lits > 0 && 1 + length_bytes(lits) + lits > op_end - op) {
+        lits = op_end - op - 1 - length_bytes(lits);
+    }
+    if (lits > 0) {
+        *op++ = (char)((lits < 15 ? lits : 15) << 4);
+        op = put_length(op, lits);
+        memcpy(op, buf + anchor, lits);
+        op += lits;
+        anchor += lits;
+    }
+    *pos = anchor;
+    return op - dst;
+}
+
+// Read a length carried on past the 15 of its nibble
+static int get_length(const unsigned char **ip, const unsigned char *end, int len) {
+    if (len < 15) {
+        return len;
+    }
+    unsigned char b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// Copy len bytes 16 at a time, which may write (and read) up to 15 past
+// them
+static void wild_copy(char *dst, const char *src, int len) {
+    char *end = dst + len;
+    do {
+        memcpy(dst, src, 16);
+        dst += 16;
+        src += 16;
+    } while (dst < end);
+}
+
+// Decompress the len-byte stream at src into at most cap bytes at dst.
+// Returns the number of bytes it decompresses to, or -EIO if it is not a
+// stream or does not fit. Copies run over by up to 15 bytes where there
+// is room, which saves exact-length copies of short runs.
+int heartyfs_lz_decompress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + len;
+    char *op = dst;
+    char *op_end = dst + cap;
+    while (ip < end) {
+        int token = *ip++;
+
+        // Most sequences carry both lengths in the token, and are copied
+        // with a few fixed-size moves while there is room to spare
+        if (token >> 4 < 15 && (token & 15) < 15 && end - ip >= 32 && op_end - op >= 32) {
+            int lits = token >> 4;
+            memcpy(op, ip, 16);
+            ip += lits;
+            op += lits;
+            int offset = ip[0] | ip[1] << 8;
+            ip += 2;
+            if (offset >= 8 && offset <= op - dst) {
+                const char *from = op - offset;
+                memcpy(op, from, 8);
+                memcpy(op + 8, from + 8, 8);
+                memcpy(op + 16, from + 16, 2);
+                op += (token & 15) + LZ_MIN_MATCH;
+                continue;
+            }
+            ip -= 2;  // Decoded below
+            token &= 15;
+        }
+
+        int lits = get_length(&ip, end, token >> 4);
+        if (lits < 0 || lits > end - ip || lits > op_end - op) {
+            return -EIO;
+        }
+        if (end - ip >= lits + 16 && op_end - op >= lits + 16) {
+            wild_copy(op, (const char *)ip, lits);
+        } else {
+            memcpy(op, ip, lits);
+        }
+        ip += lits;
+        op += lits;
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return -EIO;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int match = get_length(&ip, end, token & 15);
+        if (match < 0 || offset == 0 || offset > op - dst ||
+            match + LZ_MIN_MATCH > op_end - op) {
+            return -EIO;
+        }
+        match += LZ_MIN_MATCH;
+        const char *from = op - offset;
+        if (offset >= 16 && op_end - op >= match + 16) {
+            wild_copy(op, from, match);
+            op += match;
+            continue;
+        }
+        if (offset >= 8 && op_end - op >= match + 8) {
+            for (int i = 0; i < match; i += 8) {
+                memcpy(op + i, from + i, 8);
+            }
+            op += match;
+            continue;
+        }
+        // A match closer than its length repeats the last offset bytes;
+        // each copy doubles what the next one can take
+        while (match > 0) {
+            int n = op - from < match ? op - from : match;
+            memcpy(op, from, n);
+            op += n;
+            match -= n;
+        }
+    }
+    return op - dst;
+}
@@ -0,0 +1,177 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Free everything heartyfs_mount() set up, without writing to the image
+static void release(struct heartyfs *fs) {
+    heartyfs_backend_reset(fs);
+    heartyfs_lz_free(fs);
+    heartyfs_dedup_free(fs);
+    heartyfs_counters_detach(fs);
+    heartyfs_dcache_detach(fs);
+    heartyfs_shared_detach(fs);
+    heartyfs_journal_free(fs);
+    heartyfs_dirty_free(&fs->data_dirty);
+    heartyfs_dirty_free(&fs->home_dirty);
+    if (fs->disk != NULL) {
+        munmap(fs->disk, fs->disk_size);
+    }
+    close(fs->fd);
+    fs->disk = NULL;
+    fs->fd = -1;
+}
+
+// Read the superblock and check that it describes an image that fits in a
+// file of file_size bytes
+static int read_geometry(struct heartyfs *fs, off_t file_size) {
+    struct heartyfs_super sb;
+    if (pread(fs->fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        return -EINVAL;
+    }
+    if (sb.magic != SUPER_MAGIC || sb.version != SUPER_VERSION) {
+        return -EINVAL;
+    }
+    if (sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE ||
+        (sb.block_size & (sb.block_size - 1)) != 0 || sb.block_count > INT32_MAX ||
+        sb.root_block >= sb.block_count || sb.free_blocks > sb.block_count ||
+        sb.refcount_start != sb.bitmap_start + sb.bitmap_blocks ||
+        (unsigned long long)sb.refcount_blocks * REFS_PER_BLOCK(sb.block_size) < sb.block_count ||
+        sb.dedup_start + sb.dedup_blocks > sb.journal_start ||
+        (off_t)sb.block_size * sb.block_count > file_size) {
+        return -EINVAL;
+    }
+
+    fs->block_size = sb.block_size;
+    fs->block_count = sb.block_count;
+    fs->bitmap_start = sb.bitmap_start;
+    fs->bitmap_blocks = sb.bitmap_blocks;
+    fs->refcount_start = sb.refcount_start;
+    fs->refcount_blocks = sb.refcount_blocks;
+    fs->dedup_start = sb.dedup_start;
+    fs->dedup_blocks = sb.dedup_blocks;
+    fs->journal_start = sb.journal_start;
+    fs->journal_blocks = sb.journal_blocks;
+    fs->root_block = sb.root_block;
+    fs->data_start = sb.root_block + 1;
+    fs->alloc_cursor = fs->data_start;
+    fs->disk_size = (size_t)fs->block_size * fs->block_count;
+    return 0;
+}
+
+// Keep the superblock, the bitmap and the root directory, which nearly
+// every operation goes through, in memory however little of the image
+// fits. Locked memory is limited, so this is best effort.
+static void pin_metadata(struct heartyfs *fs) {
+    mlock(fs->disk, (size_t)(fs->bitmap_start + fs->bitmap_blocks) * fs->block_size);
+    mlock(heartyfs_block(fs, fs->root_block), fs->block_size);
+}
+
+// Map the image at image_path and attach to the state shared with other
+// processes mounting it. Returns 1 if a read-only mount found the image
+// in need of recovery, which it cannot do itself.
+static int mount_image(struct heartyfs *fs, const char *image_path, int readonly) {
+    memset(fs, 0, sizeof(*fs));
+    fs->readonly = readonly;
+    fs->io_fd = -1;
+    fs->cache_bytes = CACHE_BYTES;
+    fs->fd = open(image_path, readonly ? O_RDONLY : O_RDWR);
+    if (fs->fd < 0) {
+        return -errno;
+    }
+    heartyfs_backend_reset(fs);
+
+    struct stat st;
+    int rc = fstat(fs->fd, &st) == 0 ? read_geometry(fs, st.st_size) : -errno;
+    if (rc < 0) {
+        release(fs);
+        return rc;
+    }
+
+    int prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+    fs->disk = mmap(NULL, fs->disk_size, prot, MAP_SHARED, fs->fd, 0);
+    if (fs->disk == MAP_FAILED) {
+        rc = -errno;
+        fs->disk = NULL;
+        release(fs);
+        return rc;
+    }
+
+    fs->page_size = sysconf(_SC_PAGESIZE);
+    rc = heartyfs_dirty_init(&fs->data_dirty, fs->block_count);
+    if (rc == 0) {
+        rc = heartyfs_dirty_init(&fs->home_dirty, fs->block_count);
+    }
+    if (rc == 0) {
+        rc = heartyfs_journal_init(fs);
+    }
+    int alone = 0;
+    if (rc == 0) {
+        rc = alone = heartyfs_shared_attach(fs);
+    }
+    if (rc >= 0) {
+        heartyfs_dcache_attach(fs);
+        heartyfs_counters_attach(fs);
+        if (alone && readonly) {
+            // Refuses a log in need of replay, so whoever mounts the image
+            // read-write alongside finds it clean and writes on after it
+            rc = heartyfs_journal_dirty(fs);
+        } else if (alone) {
+            rc = heartyfs_journal_replay(fs);
+            if (rc == 0) {
+                heartyfs_ref_scrub(fs);
+            }
+        }
+    }
+    if (rc != 0) {
+        release(fs);
+        return rc;
+    }
+    heartyfs_shared_ready(fs);
+
+    // Check if heartyfs is initialized
+    struct heartyfs_directory *root = heartyfs_block(fs, fs->root_block);
+    if (root->type != INODE_TYPE_DIR || strcmp(root->name, "/") != 0) {
+        release(fs);
+        return -EINVAL;
+    }
+    pin_metadata(fs);
+    return 0;
+}
+
+// Map the image at image_path, recover it from the journal if needed and
+// check that it holds an initialized heartyfs. Other processes may have it
+// mounted at the same time; the first one recovers it.
+int heartyfs_mount(struct heartyfs *fs, const char *image_path) {
+    return mount_image(fs, image_path, 0);
+}
+
+// Mount the image at image_path for reading only: the file is opened and
+// mapped read-only, and every operation that would modify it fails with
+// -EROFS. Lookups and reads take no locks, so they never wait for writers
+// (or hold them up). An image left in need of recovery is recovered with a
+// brief read-write mount first.
+int heartyfs_mount_readonly(struct heartyfs *fs, const char *image_path) {
+    int rc = mount_image(fs, image_path, 1);
+    if (rc == 1) {
+        rc = heartyfs_mount(fs, image_path);
+        if (rc < 0) {
+            return rc;
+        }
+        heartyfs_unmount(fs);
+        rc = mount_image(fs, image_path, 1);
+    }
+    return rc == 1 ? -EIO : rc;
+}
+
+// Commit and checkpoint anything outstanding, unmap the image and close
+// the disk file
+void heartyfs_unmount(struct heartyfs *fs) {
+    if (!fs->readonly) {
+        heartyfs_sync(fs);
+        heartyfs_checkpoint(fs);
+    }
+    release(fs);
+}
@@ -0,0 +1,161 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+
+// Lock the directory at dir_block and check that name may be added to it
+static int check_new_entry(struct heartyfs *fs, int dir_block, const char *name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -EINVAL;
+    }
+    int rc = heartyfs_lock_dir(fs, dir_block);
+    if (rc < 0) {
+        return rc;
+    }
+    int existing = heartyfs_dir_find(fs, dir_block, name);
+    if (existing >= 0) {
+        return -EEXIST;
+    }
+    return existing == -ENOENT ? 0 : existing;
+}
+
+// Create the directory named by path
+int heartyfs_mkdir(struct heartyfs *fs, const char *path) {
+    char dir_name[MAX_NAME_LENGTH + 1];
+    int parent_block = heartyfs_lookup_parent_mut(fs, path, dir_name);
+    if (parent_block < 0) {
+        return parent_block;
+    }
+    int rc = check_new_entry(fs, parent_block, dir_name);
+    if (rc < 0) {
+        return heartyfs_fail(fs, rc);
+    }
+
+    int free_block = heartyfs_alloc_block(fs);
+    if (free_block < 0) {
+        return heartyfs_fail(fs, free_block);
+    }
+
+    // Initialize the new directory with its "." and ".." entries
+    struct heartyfs_directory *new_dir = heartyfs_block_mut(fs, free_block);
+    memset(new_dir, 0, fs->block_size);
+    new_dir->type = INODE_TYPE_DIR;
+    strcpy(new_dir->name, dir_name);
+    new_dir->size = 2;
+    new_dir->count = 2;
+    new_dir->entries[0].block_id = free_block;
+    strcpy(new_dir->entries[0].file_name, ".");
+    new_dir->entries[1].block_id = parent_block;
+    strcpy(new_dir->entries[1].file_name, "..");
+
+    rc = heartyfs_dir_add(fs, parent_block, dir_name, free_block);
+    if (rc < 0) {
+        heartyfs_free_block(fs, free_block);
+        return heartyfs_fail(fs, rc);
+    }
+    return heartyfs_commit(fs);
+}
+
+// Remove the empty directory named by path
+int heartyfs_rmdir(struct heartyfs *fs, const char *path) {
+    char dir_name[MAX_NAME_LENGTH + 1];
+    int parent_block;
+    int target_block;
+    int rc;
+    do {
+        parent_block = heartyfs_lookup_parent_mut(fs, path, dir_name);
+        if (parent_block < 0) {
+            return parent_block;
+        }
+        if (strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0) {
+            return -EINVAL;
+        }
+        rc = heartyfs_lock_dir(fs, parent_block);
+        if (rc < 0) {
+            return heartyfs_fail(fs, rc);
+        }
+        target_block = heartyfs_dir_find(fs, parent_block, dir_name);
+        if (target_block < 0) {
+            return heartyfs_fail(fs, target_block);
+        }
+
+        // Lock the target too, so that nothing is created in it meanwhile.
+        // Waiting for it gives up the parent; start over then.
+        rc = heartyfs_lock_dir(fs, target_block);
+        if (rc < 0) {
+            return heartyfs_fail(fs, rc);
+        }
+    } while (rc == 1);
+
+    struct heartyfs_directory *target_dir = heartyfs_block(fs, target_block);
+    if (target_dir->count > 2) {  // Only . and .. should be present
+        return heartyfs_fail(fs, -ENOTEMPTY);
+    }
+
+    heartyfs_dir_remove(fs, parent_block, dir_name);
+    heartyfs_dir_release(fs, target_block);
+    heartyfs_tail_close(fs, target_block);
+
+    // Anyone still waiting to lock it finds it gone
+    target_dir = heartyfs_block_mut(fs, target_block);
+    target_dir->type = INODE_TYPE_DEAD;
+    heartyfs_free_block(fs, target_block);
+    return heartyfs_commit(fs);
+}
+
+// Create an empty regular file named by path
+int heartyfs_creat(struct heartyfs *fs, const char *path) {
+    char file_name[MAX_NAME_LENGTH + 1];
+    int parent_block = heartyfs_lookup_parent_mut(fs, path, file_name);
+    if (parent_block < 0) {
+        return parent_block;
+    }
+    int rc = check_new_entry(fs, parent_block, file_name);
+    if (rc < 0) {
+        return heartyfs_fail(fs, rc);
+    }
+
+    int free_block = heartyfs_alloc_block(fs);
+    if (free_block < 0) {
+        return heartyfs_fail(fs, free_block);
+    }
+
+    struct heartyfs_inode *new_inode = heartyfs_block_mut(fs, free_block);
+    memset(new_inode, 0, fs->block_size);
+    new_inode->type = INODE_TYPE_FILE;
+    strcpy(new_inode->name, file_name);
+
+    rc = heartyfs_dir_add(fs, parent_block, file_name, free_block);
+    if (rc < 0) {
+        heartyfs_free_block(fs, free_block);
+        return heartyfs_fail(fs, rc);
+    }
+    return heartyfs_commit(fs);
+}
+
+// Remove the regular file named by path and release its blocks. Files are
+// covered by the lock of the directory they are in.
+int heartyfs_rm(struct heartyfs *fs, const char *path) {
+    char file_name[MAX_NAME_LENGTH + 1];
+    int parent_block = heartyfs_lookup_parent_mut(fs, path, file_name);
+    if (parent_block < 0) {
+        return parent_block;
+    }
+    int rc = heartyfs_lock_dir(fs, parent_block);
+    if (rc < 0) {
+        return heartyfs_fail(fs, rc);
+    }
+    int inode_block = heartyfs_dir_find(fs, parent_block, file_name);
+    if (inode_block < 0) {
+        return heartyfs_fail(fs, inode_block);
+    }
+
+    struct heartyfs_inode *inode = heartyfs_block(fs, inode_block);
+    if (inode->type != INODE_TYPE_FILE) {
+        return heartyfs_fail(fs, -EISDIR);
+    }
+
+    heartyfs_dir_remove(fs, parent_block, file_name);
+    heartyfs_release_file(fs, inode);
+    heartyfs_free_block(fs, inode_block);
+    return heartyfs_commit(fs);
+}
@@ -0,0 +1,102 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+
+// Walk the directories named in path (relative to the root directory)
+// and return the block of the last one
+static int walk(struct heartyfs *fs, char *path) {
+    HEARTYFS_TIME_START(start);
+    int current_block = fs->root_block;
+    char *save = NULL;
+    for (char *token = strtok_r(path, "/", &save); token != NULL;
+         token = strtok_r(NULL, "/", &save)) {
+        current_block = heartyfs_dir_find(fs, current_block, token);
+        if (current_block < 0) {
+            break;
+        }
+    }
+    HEARTYFS_TIME_END(fs, PHASE_LOOKUP, start);
+    return current_block;
+}
+
+// Resolve path to the block of the file or directory it names
+int heartyfs_lookup(struct heartyfs *fs, const char *path) {
+    char *path_copy = strdup(path);
+    if (path_copy == NULL) {
+        return -ENOMEM;
+    }
+    int block_id = walk(fs, path_copy);
+    free(path_copy);
+    return block_id;
+}
+
+// Resolve every component of path except the last one. The last component
+// is copied into name and the block of its parent directory is returned.
+int heartyfs_lookup_parent(struct heartyfs *fs, const char *path,
+                           char name[MAX_NAME_LENGTH + 1]) {
+    char *path_copy = strdup(path);
+    if (path_copy == NULL) {
+        return -ENOMEM;
+    }
+
+    // Strip trailing slashes so that "/dir1/dir2/" names "dir2"
+    size_t len = strlen(path_copy);
+    while (len > 0 && path_copy[len - 1] == '/') {
+        path_copy[--len] = '\0';
+    }
+
+    char *last = strrchr(path_copy, '/');
+    char *base = last == NULL ? path_copy : last + 1;
+    if (*base == '\0') {
+        free(path_copy);
+        return -EINVAL;
+    }
+    if (strlen(base) > MAX_NAME_LENGTH) {
+        free(path_copy);
+        return -ENAMETOOLONG;
+    }
+    strcpy(name, base);
+    if (last != NULL) {
+        *last = '\0';
+    } else {
+        *path_copy = '\0';
+    }
+
+    int parent_block = walk(fs, path_copy);
+    free(path_copy);
+    return parent_block;
+}
+
+// Whether the directory name in dir_block is SNAPSHOT_DIR or something in
+// it. This is decided by following ".." up to the root from the parent the
+// path resolved to, so "." and ".." in the path make no difference.
+static int in_snapshots(struct heartyfs *fs, int dir_block, const char *name) {
+    if (dir_block == fs->root_block) {
+        return strcmp(name, SNAPSHOT_DIR) == 0;
+    }
+    // Bounded, in case a damaged image has ".." go round in a loop
+    for (int steps = 0; steps < fs->block_count; steps++) {
+        const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+        int parent = dir->entries[1].block_id;
+        if (parent == fs->root_block) {
+            return strcmp(dir->name, SNAPSHOT_DIR) == 0;
+        }
+        if (parent < fs->data_start || parent >= fs->block_count) {
+            return 0;
+        }
+        dir_block = parent;
+    }
+    return 0;
+}
+
+// heartyfs_lookup_parent() for an operation that modifies the parent.
+// Snapshots are read-only: paths in them fail with -EROFS, except while
+// heartyfs_snapshot() itself is creating or removing one.
+int heartyfs_lookup_parent_mut(struct heartyfs *fs, const char *path,
+                               char name[MAX_NAME_LENGTH + 1]) {
+    int parent_block = heartyfs_lookup_parent(fs, path, name);
+    if (parent_block >= 0 && !fs->in_snapshot && in_snapshots(fs, parent_block, name)) {
+        return -EROFS;
+    }
+    return parent_block;
+}
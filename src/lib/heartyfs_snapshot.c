@@ -0,0 +1,184 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+
+// A snapshot is a copy of the tree under /SNAPSHOT_DIR/<name>: its own
+// directories, and a clone (heartyfs_clone()) of every file, which shares
+// the file's data blocks. Taking one writes metadata only, and data blocks
+// stay shared until either side rewrites or removes its file. Nothing but
+// heartyfs_snapshot() and heartyfs_snapshot_remove() may modify a
+// snapshot (see heartyfs_lookup_parent_mut()); it can be read like any
+// other directory, and files cloned back out of it.
+//
+// The tree is copied a directory at a time, with each file cloned as it
+// stands when its turn comes, so operations that other processes run
+// meanwhile may or may not make it into the snapshot.
+
+#define PATH_BYTES 4096
+#define SNAPSHOT_GROUP_OPS 256  // Operations of a snapshot committed together
+
+// Names in a directory, as listed by heartyfs_dir_iterate()
+struct names {
+    char (*names)[MAX_NAME_LENGTH + 1];
+    int count;
+    int cap;
+};
+
+static int add_name(void *arg, const struct heartyfs_dir_entry *entry) {
+    struct names *list = arg;
+    if (strcmp(entry->file_name, ".") == 0 || strcmp(entry->file_name, "..") == 0) {
+        return 0;
+    }
+    if (list->count == list->cap) {
+        int cap = list->cap == 0 ? 64 : list->cap * 2;
+        void *grown = realloc(list->names, cap * sizeof(*list->names));
+        if (grown == NULL) {
+            return -ENOMEM;
+        }
+        list->names = grown;
+        list->cap = cap;
+    }
+    strcpy(list->names[list->count++], entry->file_name);
+    return 0;
+}
+
+// List the directory named by path, not counting "." and ".."
+static int list_names(struct heartyfs *fs, const char *path, struct names *list) {
+    int dir_block = heartyfs_lookup(fs, path);
+    if (dir_block < 0) {
+        return dir_block;
+    }
+    return heartyfs_dir_iterate(fs, dir_block, add_name, list);
+}
+
+// Append "/name" to the path in buf, which holds len bytes
+static int push_name(char *buf, size_t len, const char *name) {
+    if (len + 1 + strlen(name) >= PATH_BYTES) {
+        return -ENAMETOOLONG;
+    }
+    buf[len] = '/';
+    strcpy(buf + len + 1, name);
+    return 0;
+}
+
+// Copy everything in the directory named by src into the empty one named
+// by dst. top leaves out SNAPSHOT_DIR, which only the root has.
+static int copy_dir(struct heartyfs *fs, char *src, char *dst, int top) {
+    struct names list = {0};
+    int rc = list_names(fs, src, &list);
+    size_t src_len = strlen(src);
+    size_t dst_len = strlen(dst);
+    for (int i = 0; i < list.count && rc == 0; i++) {
+        if (top && strcmp(list.names[i], SNAPSHOT_DIR) == 0) {
+            continue;
+        }
+        if ((rc = push_name(src, src_len, list.names[i])) < 0 ||
+            (rc = push_name(dst, dst_len, list.names[i])) < 0) {
+            break;
+        }
+        rc = heartyfs_clone(fs, src, dst);
+        if (rc == -EISDIR && (rc = heartyfs_mkdir(fs, dst)) == 0) {
+            rc = copy_dir(fs, src, dst, 0);
+        }
+        if (rc == -ENOENT) {
+            rc = 0;  // Removed since it was listed
+        }
+        src[src_len] = '\0';
+        dst[dst_len] = '\0';
+    }
+    free(list.names);
+    return rc;
+}
+
+// Remove the directory named by path and everything in it
+static int remove_dir(struct heartyfs *fs, char *path) {
+    struct names list = {0};
+    int rc = list_names(fs, path, &list);
+    size_t len = strlen(path);
+    for (int i = 0; i < list.count && rc == 0; i++) {
+        if ((rc = push_name(path, len, list.names[i])) < 0) {
+            break;
+        }
+        rc = heartyfs_rm(fs, path);
+        if (rc == -EISDIR) {
+            rc = remove_dir(fs, path);
+        }
+        path[len] = '\0';
+    }
+    free(list.names);
+    return rc < 0 ? rc : heartyfs_rmdir(fs, path);
+}
+
+// Every file is an operation of its own, and a small one. Commit them in
+// groups, and everything once done. Returns the group size to go back to.
+static int group_begin(struct heartyfs *fs) {
+    int group_ops = fs->group_ops;
+    heartyfs_set_group_commit(fs, group_ops > SNAPSHOT_GROUP_OPS ? group_ops :
+                                                                   SNAPSHOT_GROUP_OPS);
+    return group_ops;
+}
+
+static int group_end(struct heartyfs *fs, int group_ops, int rc) {
+    int sync_rc = heartyfs_sync(fs);
+    heartyfs_set_group_commit(fs, group_ops);
+    return rc < 0 ? rc : sync_rc;
+}
+
+// Get the path of the snapshot called name into buf
+static int snapshot_path(char buf[PATH_BYTES], const char *name) {
+    if (*name == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0 ||
+        strcmp(name, "..") == 0) {
+        return -EINVAL;
+    }
+    if (strlen(name) > MAX_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    snprintf(buf, PATH_BYTES, "/%s/%s", SNAPSHOT_DIR, name);
+    return 0;
+}
+
+// Take a snapshot of the whole tree called name. Fails with -EEXIST if
+// there already is one by that name; one that cannot be completed is
+// removed again.
+int heartyfs_snapshot(struct heartyfs *fs, const char *name) {
+    char src[PATH_BYTES] = "";
+    char dst[PATH_BYTES];
+    int rc = snapshot_path(dst, name);
+    if (rc < 0) {
+        return rc;
+    }
+    fs->in_snapshot = 1;
+    rc = heartyfs_mkdir(fs, "/" SNAPSHOT_DIR);
+    if (rc == 0 || rc == -EEXIST) {
+        rc = heartyfs_mkdir(fs, dst);
+    }
+    if (rc == 0) {
+        int group_ops = group_begin(fs);
+        rc = group_end(fs, group_ops, copy_dir(fs, src, dst, 1));
+        if (rc < 0) {
+            snapshot_path(dst, name);
+            remove_dir(fs, dst);
+            heartyfs_rmdir(fs, "/" SNAPSHOT_DIR);
+        }
+    }
+    fs->in_snapshot = 0;
+    return rc;
+}
+
+// Remove the snapshot called name, releasing whatever its files held on
+// to alone. SNAPSHOT_DIR goes too once it is empty.
+int heartyfs_snapshot_remove(struct heartyfs *fs, const char *name) {
+    char path[PATH_BYTES];
+    int rc = snapshot_path(path, name);
+    if (rc < 0) {
+        return rc;
+    }
+    fs->in_snapshot = 1;
+    int group_ops = group_begin(fs);
+    rc = group_end(fs, group_ops, remove_dir(fs, path));
+    if (rc == 0) {
+        heartyfs_rmdir(fs, "/" SNAPSHOT_DIR);
+    }
+    fs->in_snapshot = 0;
+    return rc;
+}
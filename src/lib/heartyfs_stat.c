@@ -0,0 +1,172 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every process that mounts an image adds what it counted to totals kept
+// in a POSIX shared-memory segment named after the image's device and
+// inode, like the lookup cache. Unlike the other segments it is never
+// emptied by a mount, so the totals run from its creation (or the last
+// reset) until heartyfs_init makes the image anew or the machine restarts.
+// Counting itself only touches the mount: the segment is written a batch
+// at a time, with atomic adds.
+
+const char *const heartyfs_counter_names[COUNTERS] = {
+    "ops", "lookups", "entries_compared", "allocs", "bitmap_bits_scanned",
+    "blocks_allocated", "blocks_freed", "refs_dropped", "msyncs", "bytes_msynced",
+};
+
+const char *const heartyfs_phase_names[PHASES] = {
+    "lookup", "lock_wait", "alloc", "dev_read", "dev_write",
+    "commit", "journal_write", "install", "checkpoint", "msync",
+};
+
+// Get the segment name of the image open on fd
+static int segment_name(int fd, char name[64]) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -errno;
+    }
+    snprintf(name, 64, COUNTERS_NAME_FORMAT, (unsigned long long)st.st_dev,
+             (unsigned long long)st.st_ino);
+    return 0;
+}
+
+// Map the counter segment open on fd, if it is one of this size
+static struct heartyfs_counter_segment *map_segment(int fd, int prot) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(struct heartyfs_counter_segment)) {
+        return NULL;
+    }
+    struct heartyfs_counter_segment *seg =
+        mmap(NULL, sizeof(*seg), prot, MAP_SHARED, fd, 0);
+    if (seg == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != COUNTERS_MAGIC ||
+        seg->size != sizeof(*seg)) {
+        munmap(seg, sizeof(*seg));
+        return NULL;
+    }
+    return seg;
+}
+
+// Get the totals of the image at image_path, and with reset, set them back
+// to zero. Fails with -ENOENT if nothing has counted anything for it yet.
+int heartyfs_counters_read(const char *image_path, struct heartyfs_counters *totals,
+                           int reset) {
+    int image_fd = open(image_path, O_RDONLY);
+    if (image_fd < 0) {
+        return -errno;
+    }
+    char name[64];
+    int rc = segment_name(image_fd, name);
+    close(image_fd);
+    if (rc < 0) {
+        return rc;
+    }
+    int fd = shm_open(name, reset ? O_RDWR : O_RDONLY, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct heartyfs_counter_segment *seg =
+        map_segment(fd, reset ? PROT_READ | PROT_WRITE : PROT_READ);
+    close(fd);
+    if (seg == NULL) {
+        return -EINVAL;
+    }
+
+    // Each counter is read and reset at once, so no count is lost to a
+    // process publishing meanwhile; the counters may just not add up with
+    // one another
+    uint64_t *from = (uint64_t *)&seg->totals;
+    uint64_t *to = (uint64_t *)totals;
+    for (size_t i = 0; i < sizeof(*totals) / sizeof(uint64_t); i++) {
+        to[i] = reset ? __atomic_exchange_n(&from[i], 0, __ATOMIC_RELAXED)
+                      : __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    munmap(seg, sizeof(*seg));
+    return 0;
+}
+
+#ifdef HEARTYFS_STATS
+
+uint64_t heartyfs_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Account the time since start to a phase
+void heartyfs_phase_add(struct heartyfs *fs, enum heartyfs_phase phase, uint64_t start) {
+    fs->counters.phase_calls[phase]++;
+    fs->counters.phase_ns[phase] += heartyfs_now_ns() - start;
+}
+
+// Attach to the counter segment of the image open on fs->fd, creating it
+// if there is none. Counting without one is not an error; the counts are
+// just not kept.
+void heartyfs_counters_attach(struct heartyfs *fs) {
+    char name[64];
+    if (segment_name(fs->fd, name) < 0) {
+        return;
+    }
+    size_t size = sizeof(struct heartyfs_counter_segment);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        struct heartyfs_counter_segment *seg = MAP_FAILED;
+        if (ftruncate(fd, size) == 0) {
+            seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (seg == MAP_FAILED) {
+            shm_unlink(name);
+            return;
+        }
+        // The magic goes in last so that others never use a half-set-up one
+        seg->size = size;
+        __atomic_store_n(&seg->magic, COUNTERS_MAGIC, __ATOMIC_RELEASE);
+        fs->counter_segment = seg;
+    } else if (errno == EEXIST && (fd = shm_open(name, O_RDWR, 0600)) >= 0) {
+        fs->counter_segment = map_segment(fd, PROT_READ | PROT_WRITE);
+        close(fd);
+    }
+    fs->counter_ops = COUNTERS_PUBLISH_OPS;
+}
+
+// Add what this mount counted to the totals, and start counting afresh
+void heartyfs_counters_publish(struct heartyfs *fs) {
+    struct heartyfs_counter_segment *seg = fs->counter_segment;
+    if (seg != NULL) {
+        uint64_t *from = (uint64_t *)&fs->counters;
+        uint64_t *to = (uint64_t *)&seg->totals;
+        for (size_t i = 0; i < sizeof(fs->counters) / sizeof(uint64_t); i++) {
+            if (from[i] != 0) {
+                __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    memset(&fs->counters, 0, sizeof(fs->counters));
+    fs->counter_ops = COUNTERS_PUBLISH_OPS;
+}
+
+void heartyfs_counters_detach(struct heartyfs *fs) {
+    if (fs->counter_segment != NULL) {
+        heartyfs_counters_publish(fs);
+        munmap(fs->counter_segment, sizeof(*fs->counter_segment));
+        fs->counter_segment = NULL;
+    }
+}
+
+// Count an operation, publishing every COUNTERS_PUBLISH_OPS of them so
+// that long-running mounts that seldom commit show up in the totals too
+void heartyfs_counters_op(struct heartyfs *fs) {
+    fs->counters.count[COUNT_OPS]++;
+    if (--fs->counter_ops <= 0) {
+        heartyfs_counters_publish(fs);
+    }
+}
+
+#endif
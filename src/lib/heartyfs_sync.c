@@ -0,0 +1,121 @@
+#include "../heartyfs.h"
+#include <errno.h>
+
+// Allocate an empty dirty set that can hold every block of the image
+int heartyfs_dirty_init(struct heartyfs_dirty_set *set, int block_count) {
+    set->map = calloc(block_count / 8 + 1, 1);
+    set->list = malloc(block_count * sizeof(int));
+    set->count = 0;
+    if (set->map == NULL || set->list == NULL) {
+        heartyfs_dirty_free(set);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void heartyfs_dirty_free(struct heartyfs_dirty_set *set) {
+    free(set->map);
+    free(set->list);
+    set->map = NULL;
+    set->list = NULL;
+    set->count = 0;
+}
+
+// Remember that a block has to be flushed
+void heartyfs_dirty_add(struct heartyfs_dirty_set *set, int block_id) {
+    unsigned char mask = 1 << (block_id % 8);
+    if (!(set->map[block_id / 8] & mask)) {
+        set->map[block_id / 8] |= mask;
+        set->list[set->count++] = block_id;
+    }
+}
+
+// Forget that a block has to be flushed, as for a data block given back
+// before anything pointed at it. It stays in the list, and is passed over.
+void heartyfs_dirty_forget(struct heartyfs_dirty_set *set, int block_id) {
+    set->map[block_id / 8] &= ~(1 << (block_id % 8));
+}
+
+// Note that a data block is about to be written. Data blocks bypass the
+// journal; they are flushed before the transaction that makes them
+// reachable is committed. A block that was metadata in a transaction
+// still in the log must not be overwritten by replay once it holds data,
+// so the log is checkpointed before that commit.
+void heartyfs_data_written(struct heartyfs *fs, int block_id) {
+    uint64_t logged = __atomic_load_n(&fs->shared->in_log[block_id / 64], __ATOMIC_ACQUIRE);
+    if (logged & (1ULL << (block_id % 64))) {
+        fs->checkpoint_needed = 1;
+    }
+    heartyfs_dirty_add(&fs->data_dirty, block_id);
+}
+
+// Get a pointer to a data block that is about to be written in place
+void *heartyfs_data_mut(struct heartyfs *fs, int block_id) {
+    heartyfs_data_written(fs, block_id);
+    return (char *)fs->disk + (size_t)block_id * fs->block_size;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Flush one page-aligned byte range of the image
+static int flush_range(struct heartyfs *fs, size_t start, size_t end) {
+    HEARTYFS_TIME_START(msync_start);
+    if (msync((char *)fs->disk + start, end - start, MS_SYNC) != 0) {
+        return -errno;
+    }
+    HEARTYFS_TIME_END(fs, PHASE_MSYNC, msync_start);
+    HEARTYFS_COUNT(fs, COUNT_MSYNCS, 1);
+    HEARTYFS_COUNT(fs, COUNT_BYTES_MSYNCED, end - start);
+    fs->stats.flush_ranges++;
+    fs->stats.last_bytes_flushed += end - start;
+    fs->stats.bytes_flushed += end - start;
+    return 0;
+}
+
+// Flush count consecutive blocks starting at first_block
+int heartyfs_flush_blocks(struct heartyfs *fs, int first_block, int count) {
+    size_t page_mask = fs->page_size - 1;
+    size_t start = (size_t)first_block * fs->block_size & ~page_mask;
+    size_t end = ((size_t)(first_block + count) * fs->block_size + page_mask) & ~page_mask;
+    return flush_range(fs, start, end);
+}
+
+// Flush every block in set to disk and empty the set. Dirty blocks are
+// widened to whole pages, since that is what msync works on, and
+// neighbouring ranges are merged so that each run costs one msync.
+int heartyfs_dirty_flush(struct heartyfs *fs, struct heartyfs_dirty_set *set) {
+    qsort(set->list, set->count, sizeof(int), compare_blocks);
+
+    size_t page_mask = fs->page_size - 1;
+    size_t run_start = 0;
+    size_t run_end = 0;
+    int rc = 0;
+    for (int i = 0; i < set->count; i++) {
+        if (!(set->map[set->list[i] / 8] & (1 << (set->list[i] % 8)))) {
+            continue;
+        }
+        size_t offset = (size_t)set->list[i] * fs->block_size;
+        size_t start = offset & ~page_mask;
+        size_t end = (offset + fs->block_size + page_mask) & ~page_mask;
+        if (run_end != 0 && start <= run_end) {
+            run_end = end > run_end ? end : run_end;
+            continue;
+        }
+        if (run_end != 0 && rc == 0) {
+            rc = flush_range(fs, run_start, run_end);
+        }
+        run_start = start;
+        run_end = end;
+    }
+    if (run_end != 0 && rc == 0) {
+        rc = flush_range(fs, run_start, run_end);
+    }
+
+    for (int i = 0; i < set->count; i++) {
+        set->map[set->list[i] / 8] = 0;
+    }
+    set->count = 0;
+    return rc;
+}
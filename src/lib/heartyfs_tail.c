@@ -0,0 +1,80 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+
+// The last block of most files is only partly full. Rather than spend a
+// block on each, files pack tails of up to half a block into a tail block
+// their directory keeps open, and point at them from the inode. Files only
+// ever belong to one directory, so the directory lock, which every
+// operation on them holds, covers the tail blocks too. Tail blocks are
+// updated through the journal like any other metadata.
+
+// Pack len bytes of data into the open tail block of the directory at
+// dir_block, starting a new one when it has no room. Fails with -ENOSPC
+// if the tail is too big to pack, or there is no block for it.
+int heartyfs_tail_pack(struct heartyfs *fs, int dir_block, const void *data, int len,
+                       struct heartyfs_tail *tail) {
+    if (len <= 0 || len > TAIL_BYTES(fs->block_size) / 2) {
+        return -ENOSPC;
+    }
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    int tail_block = dir->tail_block;
+    const struct heartyfs_tail_block *open =
+        tail_block != 0 ? heartyfs_block(fs, tail_block) : NULL;
+    if (open == NULL || open->used + len > TAIL_BYTES(fs->block_size)) {
+        int fresh_block = heartyfs_alloc_block(fs);
+        if (fresh_block < 0) {
+            return fresh_block;
+        }
+        if (tail_block != 0) {
+            // Left to be freed by the last file with a tail in it
+            struct heartyfs_tail_block *full = heartyfs_block_mut(fs, tail_block);
+            full->dir = 0;
+        }
+        tail_block = fresh_block;
+        struct heartyfs_tail_block *fresh = heartyfs_block_mut(fs, tail_block);
+        memset(fresh, 0, fs->block_size);
+        fresh->dir = dir_block;
+        struct heartyfs_directory *dir_mut = heartyfs_block_mut(fs, dir_block);
+        dir_mut->tail_block = tail_block;
+    }
+
+    struct heartyfs_tail_block *tb = heartyfs_block_mut(fs, tail_block);
+    memcpy(tb->data + tb->used, data, len);
+    tail->block = tail_block;
+    tail->offset = tb->used;
+    tail->length = len;
+    tb->used += len;
+    tb->live += len;
+    return 0;
+}
+
+// Release a file's tail. Once a tail block holds no more tails, it is
+// freed if its directory has moved on, and emptied for reuse otherwise.
+void heartyfs_tail_release(struct heartyfs *fs, const struct heartyfs_tail *tail) {
+    if (tail->block < fs->data_start || tail->block >= fs->block_count) {
+        return;
+    }
+    struct heartyfs_tail_block *tb = heartyfs_block_mut(fs, tail->block);
+    tb->live -= tail->length;
+    if (tb->live > 0) {
+        return;
+    }
+    if (tb->dir == 0) {
+        heartyfs_free_block(fs, tail->block);
+    } else {
+        tb->used = 0;
+        tb->live = 0;
+    }
+}
+
+// Free the tail block of a directory that is being removed, and so has no
+// files with tails in it left
+void heartyfs_tail_close(struct heartyfs *fs, int dir_block) {
+    const struct heartyfs_directory *dir = heartyfs_block(fs, dir_block);
+    if (dir->tail_block != 0) {
+        heartyfs_free_block(fs, dir->tail_block);
+        struct heartyfs_directory *dir_mut = heartyfs_block_mut(fs, dir_block);
+        dir_mut->tail_block = 0;
+    }
+}
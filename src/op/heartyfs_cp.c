@@ -0,0 +1,50 @@
+#include "../heartyfs.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Copy a file by reading it out into a temporary file and writing that
+// back in
+static int copy(struct heartyfs *fs, const char *src_path, const char *dst_path) {
+    FILE *tmp = tmpfile();
+    if (tmp == NULL) {
+        return -errno;
+    }
+    int rc = heartyfs_read(fs, src_path, fileno(tmp));
+    if (rc == 0 && lseek(fileno(tmp), 0, SEEK_SET) != 0) {
+        rc = -errno;
+    }
+    if (rc == 0) {
+        rc = heartyfs_write(fs, dst_path, fileno(tmp));
+    }
+    fclose(tmp);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int reflink = argc == 4 && strcmp(argv[1], "--reflink") == 0;
+    if (argc != 3 + reflink) {
+        fprintf(stderr, "Usage: %s [--reflink] <source_path> <dest_path>\n", argv[0]);
+        return 1;
+    }
+    const char *src_path = argv[1 + reflink];
+    const char *dst_path = argv[2 + reflink];
+
+    struct heartyfs fs;
+    int rc = heartyfs_mount(&fs, DISK_FILE_PATH);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot mount %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return 1;
+    }
+
+    // --reflink shares the data blocks instead of copying them
+    rc = reflink ? heartyfs_clone(&fs, src_path, dst_path) : copy(&fs, src_path, dst_path);
+    heartyfs_unmount(&fs);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot copy %s to %s: %s\n", src_path, dst_path, strerror(-rc));
+        return 1;
+    }
+
+    printf("Successfully copied file: %s\n", dst_path);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include "../heartyfs.h"
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+    int check = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c")) != -1) {
+        if (opt != 'c') {
+            argc = -1;
+            break;
+        }
+        check = 1;
+    }
+    if (argc < 0 || optind != argc) {
+        fprintf(stderr, "Usage: %s [-c]\n", argv[0]);
+        return 1;
+    }
+
+    struct heartyfs fs;
+    int rc = heartyfs_mount_readonly(&fs, DISK_FILE_PATH);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot mount %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return 1;
+    }
+
+    struct heartyfs_statfs st;
+    heartyfs_statfs(&fs, &st);
+    int used = st.data_blocks - st.free_blocks;
+    printf("%-10s %10s %10s %10s %5s %10s\n", "Block size", "Blocks", "Used", "Free", "Use%",
+           "Shared");
+    printf("%-10d %10d %10d %10d %4d%% %10d\n", st.block_size, st.data_blocks, used,
+           st.free_blocks, st.data_blocks == 0 ? 0 : (int)(100LL * used / st.data_blocks),
+           st.shared_refs);
+
+    // With -c, count the bitmap to make sure the stored count is right
+    int counted = check ? heartyfs_count_free(&fs) : st.free_blocks;
+    heartyfs_unmount(&fs);
+    if (counted != st.free_blocks) {
+        fprintf(stderr, "Free count mismatch: superblock says %d, bitmap has %d\n",
+                st.free_blocks, counted);
+        return 1;
+    }
+    return 0;
+}
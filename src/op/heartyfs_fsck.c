@@ -0,0 +1,58 @@
+#include "../heartyfs.h"
+#include <string.h>
+#include <unistd.h>
+
+// Exit codes, as with fsck(8)
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNREPAIRED 4
+#define FSCK_FAILED 8
+
+int main(int argc, char *argv[]) {
+    int repair = 0;
+    int quiet = 0;
+    int threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "rqj:")) != -1) {
+        switch (opt) {
+        case 'r': repair = 1; break;
+        case 'q': quiet = 1; break;
+        case 'j': threads = atoi(optarg); break;
+        default: argc = -1; break;
+        }
+    }
+    if (argc < 0 || optind != argc) {
+        fprintf(stderr, "Usage: %s [-r] [-q] [-j threads]\n", argv[0]);
+        return FSCK_FAILED;
+    }
+
+    // Checking only needs a read-only mount; with -r, problems are repaired
+    struct heartyfs fs;
+    int rc = repair ? heartyfs_mount(&fs, DISK_FILE_PATH)
+                    : heartyfs_mount_readonly(&fs, DISK_FILE_PATH);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot mount %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return FSCK_FAILED;
+    }
+    struct heartyfs_fsck_report report;
+    rc = heartyfs_fsck(&fs, threads, repair, quiet ? NULL : stderr, &report);
+    heartyfs_unmount(&fs);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot check %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return FSCK_FAILED;
+    }
+
+    printf("%d directories, %d files, %d blocks in use\n", report.dirs, report.files,
+           report.used_blocks);
+    printf("leaked %d, missing %d, bad refs %d, bad tails %d, bad counts %d, broken %d\n",
+           report.leaked, report.missing, report.bad_refs, report.bad_tails, report.bad_counts,
+           report.broken);
+    int found = report.leaked + report.missing + report.bad_refs + report.bad_tails +
+                report.bad_counts + report.broken;
+    if (report.repaired > 0) {
+        printf("repaired %d\n", report.repaired);
+    }
+    return report.broken > 0 || found > report.repaired ? FSCK_UNREPAIRED :
+           report.repaired > 0                          ? FSCK_REPAIRED :
+                                                          FSCK_OK;
+}
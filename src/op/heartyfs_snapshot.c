@@ -0,0 +1,40 @@
+#include "../heartyfs.h"
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+    int remove = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d")) != -1) {
+        if (opt != 'd') {
+            argc = -1;
+            break;
+        }
+        remove = 1;
+    }
+    if (argc < 0 || optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-d] <name>\n", argv[0]);
+        return 1;
+    }
+    const char *name = argv[optind];
+
+    struct heartyfs fs;
+    int rc = heartyfs_mount(&fs, DISK_FILE_PATH);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot mount %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return 1;
+    }
+
+    // With -d, remove the snapshot instead
+    rc = remove ? heartyfs_snapshot_remove(&fs, name) : heartyfs_snapshot(&fs, name);
+    heartyfs_unmount(&fs);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot %s snapshot %s: %s\n", remove ? "remove" : "take", name,
+                strerror(-rc));
+        return 1;
+    }
+
+    printf("Successfully %s snapshot: /%s/%s\n", remove ? "removed" : "took", SNAPSHOT_DIR,
+           name);
+    return 0;
+}
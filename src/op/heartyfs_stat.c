@@ -0,0 +1,47 @@
+#include "../heartyfs.h"
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+    int reset = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        if (opt != 'r') {
+            argc = -1;
+            break;
+        }
+        reset = 1;
+    }
+    if (argc < 0 || optind != argc) {
+        fprintf(stderr, "Usage: %s [-r]\n", argv[0]);
+        return 1;
+    }
+
+    // With -r, start the totals over once they are printed
+    struct heartyfs_counters totals;
+    int rc = heartyfs_counters_read(DISK_FILE_PATH, &totals, reset);
+    if (rc < 0) {
+        fprintf(stderr, "Cannot read the counters of %s: %s\n", DISK_FILE_PATH, strerror(-rc));
+        return 1;
+    }
+
+    printf("{\n  \"counters\": {");
+    for (int i = 0; i < COUNTERS; i++) {
+        printf("%s\n    \"%s\": %llu", i == 0 ? "" : ",", heartyfs_counter_names[i],
+               (unsigned long long)totals.count[i]);
+    }
+    const uint64_t *count = totals.count;
+    printf("\n  },\n  \"entries_per_lookup\": %.2f,\n  \"bits_per_alloc\": %.2f,",
+           count[COUNT_LOOKUPS] == 0 ? 0.0 :
+                                       (double)count[COUNT_ENTRIES_COMPARED] / count[COUNT_LOOKUPS],
+           count[COUNT_ALLOCS] == 0 ? 0.0 :
+                                      (double)count[COUNT_BITS_SCANNED] / count[COUNT_ALLOCS]);
+    printf("\n  \"phases\": {");
+    for (int i = 0; i < PHASES; i++) {
+        printf("%s\n    \"%s\": {\"calls\": %llu, \"ns\": %llu}", i == 0 ? "" : ",",
+               heartyfs_phase_names[i], (unsigned long long)totals.phase_calls[i],
+               (unsigned long long)totals.phase_ns[i]);
+    }
+    printf("\n  }\n}\n");
+    return 0;
+}